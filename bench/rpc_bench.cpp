@@ -0,0 +1,408 @@
+/**
+ * End to end load generator for rpc::server over loopback.
+ *
+ * Closed loop: every connection keeps a fixed number of calls in flight, each
+ * one issued as soon as the previous completes. Measures peak throughput.
+ *
+ * Open loop: calls are issued at a constant rate no matter how fast responses
+ * come back, and latency is measured from the time each call was *meant* to be
+ * sent. A stalled server therefore shows up in the percentiles instead of
+ * silently slowing the generator down (coordinated omission).
+ *
+ * Without arguments, sweeps payload size, worker and connection count with the
+ * closed loop generator. Run with --help for the options.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "rpc/server.hpp"
+#include "rpc/client.hpp"
+#include "rpc/local_client.hpp"
+#include "rpc/histogram.hpp"
+#include "rpc/lifecycle.hpp"
+#include "rpc/concurrent_queue.hpp"
+
+namespace
+{
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_config
+{
+   std::string mode = "closed";   // closed or open
+   size_t connections = 1;
+   size_t outstanding = 1;        // Closed loop: calls in flight per connection
+   size_t workers = 1;
+   size_t payload = 16;
+   double rate = 10000;           // Open loop: calls per second over all connections
+   double duration = 2.0;         // Seconds
+   std::string host;              // Empty to run the server in this process
+   uint16_t port = 20100;
+   std::string unix_path;         // Use a Unix domain socket rather than TCP
+   std::string shm_path;          // Or shared memory rings, set up through this Unix socket
+   std::string local;             // Call the in-process server without any transport, direct or serialized
+   bool stages = false;           // Print where the in-process server spent the time
+   unsigned busy_poll_us = 0;     // Spin window of the in-process server, 0 to sleep
+   rpc::io_backend backend = rpc::io_backend::poll;   // Of the in-process server
+};
+
+struct bench_result
+{
+   uint64_t calls = 0;
+   uint64_t errors = 0;
+   double seconds = 0;
+   rpc::latency_histogram latency;
+   std::shared_ptr<rpc::stage_stats> stages;   // Set with --stages
+};
+
+void print_header()
+{
+   std::printf( "%-6s %5s %5s %7s %9s %10s %7s %11s %9s %9s %9s %9s %9s\n",
+                "mode", "conns", "outst", "workers", "payload", "calls", "errors", "calls/s",
+                "p50(us)", "p99(us)", "p99.9(us)", "p99.99", "max(us)" );
+}
+
+void print_result( bench_config const & cfg, bench_result const & res )
+{
+   auto us = [&res]( double p ){ return res.latency.percentile( p ) / 1000.0; };
+
+   std::printf( "%-6s %5zu %5zu %7zu %9zu %10llu %7llu %11.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                cfg.mode.c_str(), cfg.connections, (cfg.mode == "closed") ? cfg.outstanding : 0, cfg.workers, cfg.payload,
+                static_cast<unsigned long long>( res.calls ), static_cast<unsigned long long>( res.errors ),
+                res.seconds > 0 ? res.calls / res.seconds : 0.0,
+                us( 50 ), us( 99 ), us( 99.9 ), us( 99.99 ), res.latency.max() / 1000.0 );
+   std::fflush( stdout );
+}
+
+void print_stages( rpc::stage_stats const & stages )
+{
+   for( size_t i = 0; i < rpc::interval_count; ++i )
+   {
+      rpc::latency_histogram const & h = stages.intervals[i];
+      std::printf( "  %-10s p50 %9.1f us  p99 %9.1f us  p99.9 %9.1f us  max %9.1f us\n", rpc::interval_name( i ),
+                   h.percentile( 50 ) / 1000.0, h.percentile( 99 ) / 1000.0, h.percentile( 99.9 ) / 1000.0, h.max() / 1000.0 );
+   }
+   std::fflush( stdout );
+}
+
+template< class Client >
+void closed_loop( bench_config const & cfg, std::vector<std::unique_ptr<Client>> & clients, bench_result & res )
+{
+   std::string const payload( cfg.payload, 'x' );
+   std::vector<bench_result> partial( clients.size() * cfg.outstanding );
+   std::vector<std::thread> threads;
+
+   bench_clock::time_point const begin = bench_clock::now();
+   bench_clock::time_point const deadline = begin + std::chrono::duration_cast<bench_clock::duration>( std::chrono::duration<double>( cfg.duration ) );
+
+   for( size_t i = 0; i < partial.size(); ++i )
+   {
+      threads.emplace_back( [&, i]()
+      {
+         Client & client = *clients[i / cfg.outstanding];
+         bench_result & mine = partial[i];
+
+         for( bench_clock::time_point now = bench_clock::now(); now < deadline; /*no increment*/ )
+         {
+            try
+            {
+               client.template call<std::string>( "echo", payload );
+            }
+            catch( std::exception & )
+            {
+               ++mine.errors;
+            }
+
+            bench_clock::time_point const done = bench_clock::now();
+            mine.latency.record( done - now );
+            ++mine.calls;
+            now = done;
+         }
+      } );
+   }
+
+   for( auto& it : threads )
+   {
+      it.join();
+   }
+
+   res.seconds = std::chrono::duration<double>( bench_clock::now() - begin ).count();
+   for( auto const & it : partial )
+   {
+      res.calls += it.calls;
+      res.errors += it.errors;
+      res.latency.merge( it.latency );
+   }
+}
+
+template< class Client >
+void open_loop( bench_config const & cfg, std::vector<std::unique_ptr<Client>> & clients, bench_result & res )
+{
+   struct in_flight
+   {
+      bench_clock::time_point intended;
+      std::future<std::string> result;   // Not valid for the end marker
+   };
+
+   std::string const payload( cfg.payload, 'x' );
+   std::vector<bench_result> partial( clients.size() );
+   std::vector<std::thread> threads;
+
+   auto const interval = std::chrono::duration_cast<bench_clock::duration>( std::chrono::duration<double>( clients.size() / cfg.rate ) );
+   bench_clock::time_point const begin = bench_clock::now();
+   bench_clock::time_point const deadline = begin + std::chrono::duration_cast<bench_clock::duration>( std::chrono::duration<double>( cfg.duration ) );
+
+   for( size_t i = 0; i < clients.size(); ++i )
+   {
+      // Completions are collected in order by a second thread, so that a slow response never delays
+      // the sending schedule. A response overtaken by an earlier one is accounted a bit late
+      std::shared_ptr<concurrent_queue<in_flight>> pending( new concurrent_queue<in_flight>() );
+
+      threads.emplace_back( [&, i, pending]()
+      {
+         Client & client = *clients[i];
+         // Connections are staggered so that they do not all fire at once
+         bench_clock::time_point intended = begin + (interval * i) / clients.size();
+         for( ; intended < deadline; intended += interval )
+         {
+            std::this_thread::sleep_until( intended );
+            in_flight call;
+            call.intended = intended;
+            call.result = client.template async_call<std::string>( "echo", payload );
+            pending->push_back( std::move(call) );
+         }
+         pending->push_back( in_flight() );
+      } );
+
+      threads.emplace_back( [&, i, pending]()
+      {
+         bench_result & mine = partial[i];
+         for( ;; )
+         {
+            if( pending->empty_blocking() )
+            {
+               continue;
+            }
+
+            in_flight call = pending->pop_back();
+            if( !call.result.valid() )
+            {
+               break;
+            }
+
+            try
+            {
+               call.result.get();
+            }
+            catch( std::exception & )
+            {
+               ++mine.errors;
+            }
+            mine.latency.record( bench_clock::now() - call.intended );
+            ++mine.calls;
+         }
+      } );
+   }
+
+   for( auto& it : threads )
+   {
+      it.join();
+   }
+
+   res.seconds = std::chrono::duration<double>( bench_clock::now() - begin ).count();
+   for( auto const & it : partial )
+   {
+      res.calls += it.calls;
+      res.errors += it.errors;
+      res.latency.merge( it.latency );
+   }
+}
+
+rpc::endpoint endpoint( bench_config const & cfg )
+{
+   if( !cfg.shm_path.empty() )
+   {
+      return rpc::endpoint::shared_memory( cfg.shm_path );
+   }
+   if( !cfg.unix_path.empty() )
+   {
+      return rpc::endpoint::unix_domain( cfg.unix_path );
+   }
+   return rpc::endpoint::tcp( cfg.host.empty() ? "127.0.0.1" : cfg.host.c_str(), cfg.port );
+}
+
+template< class Client >
+void measure( bench_config const & cfg, std::vector<std::unique_ptr<Client>> & clients, bench_result & res )
+{
+   // Warm up connections and allocators before measuring
+   for( auto& it : clients )
+   {
+      it->template call<std::string>( "echo", std::string( cfg.payload, 'x' ) );
+   }
+
+   if( cfg.mode == "open" )
+   {
+      open_loop( cfg, clients, res );
+   }
+   else
+   {
+      closed_loop( cfg, clients, res );
+   }
+}
+
+bench_result run( bench_config const & cfg )
+{
+   std::unique_ptr<rpc::server> server;
+   if( cfg.host.empty() )
+   {
+      server.reset( new rpc::server( endpoint( cfg ), cfg.backend ) );
+      server->bind( "echo", []( std::string const & s ){ return s; } );
+      server->set_busy_poll( std::chrono::microseconds( cfg.busy_poll_us ) );
+      server->async_run( cfg.workers );
+   }
+
+   bench_result res;
+   if( server && !cfg.local.empty() )
+   {  // Baseline: the cost of the call itself, without any transport
+      rpc::local_client::mode const m = (cfg.local == "serialized") ? rpc::local_client::mode::serialized : rpc::local_client::mode::direct;
+      std::vector<std::unique_ptr<rpc::local_client>> clients;
+      for( size_t i = 0; i < cfg.connections; ++i )
+      {
+         clients.emplace_back( new rpc::local_client( *server, m ) );
+      }
+      measure( cfg, clients, res );
+   }
+   else
+   {
+      std::vector<std::unique_ptr<rpc::client>> clients;
+      for( size_t i = 0; i < cfg.connections; ++i )
+      {
+         clients.emplace_back( new rpc::client( endpoint( cfg ) ) );
+      }
+      measure( cfg, clients, res );
+   }  // Clients must go before the server
+
+   if( server && cfg.stages )
+   {
+      res.stages.reset( new rpc::stage_stats( server->stages_stats() ) );
+   }
+
+   return res;
+}
+
+void usage( char const * argv0 )
+{
+   std::printf( "Usage: %s [options]\n"
+                "  --mode=closed|open|sweep  Load generator, sweep runs closed loop over a grid (default sweep)\n"
+                "  --connections=N           Client connections (default 1)\n"
+                "  --outstanding=M           Closed loop: calls in flight per connection (default 1)\n"
+                "  --workers=W               Server worker threads (default 1)\n"
+                "  --payload=BYTES           Size of the echoed string (default 16)\n"
+                "  --rate=CALLS              Open loop: calls per second over all connections (default 10000)\n"
+                "  --duration=SECONDS        Length of each run (default 2)\n"
+                "  --host=ADDR               Benchmark an external server instead of an in-process one\n"
+                "  --port=PORT               Server port (default 20100)\n"
+                "  --unix=PATH               Unix domain socket instead of TCP, '@name' for the abstract namespace\n"
+                "  --shm=PATH                Shared memory rings, set up through the Unix socket PATH\n"
+                "  --local=direct|serialized Call the in-process server without transport, with or without msgpack\n"
+                "  --stages                  Also print time spent per request stage in the server\n"
+                "  --busy-poll=US            In-process server spins this long before sleeping (default 0)\n"
+                "  --backend=poll|io_uring   Transport of the in-process server (default poll)\n", argv0 );
+}
+
+}
+
+int main( int argc, char * argv[] )
+{
+   bench_config cfg;
+   std::string mode = "sweep";
+
+   for( int i = 1; i < argc; ++i )
+   {
+      std::string const arg = argv[i];
+      size_t const eq = arg.find( '=' );
+      std::string const key = arg.substr( 0, eq );
+      std::string const value = (eq == std::string::npos) ? std::string() : arg.substr( eq + 1 );
+
+      if( key == "--mode" )               mode = value;
+      else if( key == "--connections" )   cfg.connections = std::strtoul( value.c_str(), nullptr, 10 );
+      else if( key == "--outstanding" )   cfg.outstanding = std::strtoul( value.c_str(), nullptr, 10 );
+      else if( key == "--workers" )       cfg.workers = std::strtoul( value.c_str(), nullptr, 10 );
+      else if( key == "--payload" )       cfg.payload = std::strtoul( value.c_str(), nullptr, 10 );
+      else if( key == "--rate" )          cfg.rate = std::strtod( value.c_str(), nullptr );
+      else if( key == "--duration" )      cfg.duration = std::strtod( value.c_str(), nullptr );
+      else if( key == "--host" )          cfg.host = value;
+      else if( key == "--stages" )        cfg.stages = true;
+      else if( key == "--busy-poll" )     cfg.busy_poll_us = static_cast<unsigned>( std::strtoul( value.c_str(), nullptr, 10 ) );
+      else if( (key == "--backend") && (value == "poll") )       cfg.backend = rpc::io_backend::poll;
+      else if( (key == "--backend") && (value == "io_uring") )   cfg.backend = rpc::io_backend::io_uring;
+      else if( key == "--unix" )          cfg.unix_path = value;
+      else if( key == "--shm" )           cfg.shm_path = value;
+      else if( key == "--local" )         cfg.local = value;
+      else if( key == "--port" )          cfg.port = static_cast<uint16_t>( std::strtoul( value.c_str(), nullptr, 10 ) );
+      else
+      {
+         usage( argv[0] );
+         return (key == "--help") ? 0 : 1;
+      }
+   }
+
+   if( (cfg.connections == 0) || (cfg.outstanding == 0) || (cfg.workers == 0) || (cfg.rate <= 0) ||
+       ((mode != "closed") && (mode != "open") && (mode != "sweep")) ||
+       (!cfg.local.empty() && (cfg.local != "direct") && (cfg.local != "serialized")) )
+   {
+      usage( argv[0] );
+      return 1;
+   }
+
+   print_header();
+
+   if( mode == "sweep" )
+   {
+      size_t const payloads[] = { 16, 1024, 64 * 1024 };
+      size_t const workers[] = { 1, 4 };
+      size_t const connections[] = { 1, 4 };
+
+      cfg.mode = "closed";
+      cfg.outstanding = 4;
+      cfg.duration = 1.0;
+      for( size_t payload : payloads )
+      {
+         for( size_t w : workers )
+         {
+            for( size_t c : connections )
+            {
+               cfg.payload = payload;
+               cfg.workers = w;
+               cfg.connections = c;
+               bench_result const res = run( cfg );
+               print_result( cfg, res );
+               if( res.stages )
+               {
+                  print_stages( *res.stages );
+               }
+            }
+         }
+      }
+   }
+   else
+   {
+      cfg.mode = mode;
+      bench_result const res = run( cfg );
+      print_result( cfg, res );
+      if( res.stages )
+      {
+         print_stages( *res.stages );
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,356 @@
+/**
+ * Microbenchmarks of msgpack pack/unpack/convert for the shapes the RPC layer
+ * moves around, without any sockets or threads involved:
+ *
+ *   envelope   [type, msgid, method, params] request, packed the way
+ *              rpc::client does it and converted the way rpc::server does
+ *   foo_args   the argument tuple of foo() in test/test_server.cpp
+ *   string     std::string, 8 B to 16 MB
+ *   vector     std::vector<int32_t>, 8 B to 16 MB worth of elements
+ *   map        std::map<uint32_t, uint32_t>, 8 B to 16 MB worth of entries
+ *
+ * Every row reports the time per operation, the size of the packed data and
+ * the allocations per operation. operator new and the C allocator (used
+ * directly by msgpack's zone and unpacker buffers) are counted separately.
+ *
+ * Usage: serialization_bench [filter] [--min-time=SECONDS]
+ * Only shapes whose name contains filter are run.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <msgpack.hpp>
+#include "rpc/transport_defs.hpp"
+
+namespace
+{
+
+struct alloc_counters
+{
+   std::atomic<uint64_t> news{ 0 };
+   std::atomic<uint64_t> mallocs{ 0 };
+   std::atomic<uint64_t> bytes{ 0 };
+};
+
+alloc_counters g_allocs;
+
+}
+
+#ifdef __GLIBC__
+// Interposes the C allocator, forwarding to glibc's own entry points
+extern "C"
+{
+void * __libc_malloc( size_t );
+void * __libc_calloc( size_t, size_t );
+void * __libc_realloc( void *, size_t );
+void __libc_free( void * );
+
+void * malloc( size_t size )
+{
+   g_allocs.mallocs.fetch_add( 1, std::memory_order_relaxed );
+   g_allocs.bytes.fetch_add( size, std::memory_order_relaxed );
+   return __libc_malloc( size );
+}
+
+void * calloc( size_t n, size_t size )
+{
+   g_allocs.mallocs.fetch_add( 1, std::memory_order_relaxed );
+   g_allocs.bytes.fetch_add( n * size, std::memory_order_relaxed );
+   return __libc_calloc( n, size );
+}
+
+void * realloc( void * ptr, size_t size )
+{
+   g_allocs.mallocs.fetch_add( 1, std::memory_order_relaxed );
+   g_allocs.bytes.fetch_add( size, std::memory_order_relaxed );
+   return __libc_realloc( ptr, size );
+}
+
+void free( void * ptr )
+{
+   __libc_free( ptr );
+}
+}
+
+#define BENCH_RAW_MALLOC __libc_malloc
+#define BENCH_RAW_FREE __libc_free
+#else
+#define BENCH_RAW_MALLOC std::malloc
+#define BENCH_RAW_FREE std::free
+#endif
+
+// Counted apart from malloc, and not counted twice when the library implements new on top of it
+void * operator new( size_t size )
+{
+   g_allocs.news.fetch_add( 1, std::memory_order_relaxed );
+   g_allocs.bytes.fetch_add( size, std::memory_order_relaxed );
+   void * ptr = BENCH_RAW_MALLOC( size ? size : 1 );
+   if( ptr == nullptr )
+   {
+      throw std::bad_alloc();
+   }
+   return ptr;
+}
+
+void * operator new[]( size_t size )
+{
+   return operator new( size );
+}
+
+void * operator new( size_t size, std::nothrow_t const & ) noexcept
+{
+   try
+   {
+      return operator new( size );
+   }
+   catch( ... )
+   {
+      return nullptr;
+   }
+}
+
+void * operator new[]( size_t size, std::nothrow_t const & ) noexcept
+{
+   return operator new( size, std::nothrow );
+}
+
+void operator delete( void * ptr ) noexcept
+{
+   BENCH_RAW_FREE( ptr );
+}
+
+void operator delete[]( void * ptr ) noexcept
+{
+   BENCH_RAW_FREE( ptr );
+}
+
+void operator delete( void * ptr, std::nothrow_t const & ) noexcept
+{
+   BENCH_RAW_FREE( ptr );
+}
+
+void operator delete[]( void * ptr, std::nothrow_t const & ) noexcept
+{
+   BENCH_RAW_FREE( ptr );
+}
+
+namespace
+{
+
+using bench_clock = std::chrono::steady_clock;
+
+// Same as rpc::server's
+using envelope_type = std::tuple< rpc_message, uint32_t, std::string, std::vector<char> >;
+using foo_args_type = std::tuple< int, bool, std::string, double, std::vector<int> >;
+
+double g_min_time = 0.2;           // Seconds per row
+volatile size_t g_sink = 0;        // Keeps results alive
+
+void print_header()
+{
+   std::printf( "%-10s %-8s %10s %12s %10s %9s %9s %12s\n",
+                "shape", "op", "bytes", "ns/op", "MB/s", "new/op", "malloc/op", "alloc B/op" );
+}
+
+// Runs fn until g_min_time has passed and prints one row. bytes is the size of the packed data
+template< class Fn >
+void measure( char const * shape, char const * op, size_t const bytes, Fn fn )
+{
+   g_sink += fn();   // Warm up caches and allocator
+
+   uint64_t iterations = 0;
+   uint64_t const news = g_allocs.news.load( std::memory_order_relaxed );
+   uint64_t const mallocs = g_allocs.mallocs.load( std::memory_order_relaxed );
+   uint64_t const alloc_bytes = g_allocs.bytes.load( std::memory_order_relaxed );
+   bench_clock::time_point const begin = bench_clock::now();
+   double elapsed = 0;
+
+   for( uint64_t batch = 1; elapsed < g_min_time; batch *= 2 )
+   {
+      for( uint64_t i = 0; i < batch; ++i )
+      {
+         g_sink += fn();
+      }
+      iterations += batch;
+      elapsed = std::chrono::duration<double>( bench_clock::now() - begin ).count();
+   }
+
+   double const n = static_cast<double>( iterations );
+   std::printf( "%-10s %-8s %10zu %12.1f %10.1f %9.2f %9.2f %12.1f\n",
+                shape, op, bytes, elapsed * 1e9 / n, bytes * n / elapsed / 1e6,
+                (g_allocs.news.load( std::memory_order_relaxed ) - news) / n,
+                (g_allocs.mallocs.load( std::memory_order_relaxed ) - mallocs) / n,
+                (g_allocs.bytes.load( std::memory_order_relaxed ) - alloc_bytes) / n );
+   std::fflush( stdout );
+}
+
+// pack, unpack and convert of a value, the three steps every argument and result goes through
+template< class T >
+void measure_value( char const * shape, T const & value )
+{
+   pack_buffer packed;
+   msgpack::pack( packed, value );
+   msgpack::object_handle const unpacked = msgpack::unpack( packed.data(), packed.size() );
+
+   measure( shape, "pack", packed.size(), [&value]()
+   {
+      pack_buffer buffer;
+      msgpack::pack( buffer, value );
+      return buffer.size();
+   } );
+
+   measure( shape, "unpack", packed.size(), [&packed]()
+   {
+      msgpack::object_handle const hndl = msgpack::unpack( packed.data(), packed.size() );
+      return static_cast<size_t>( hndl.get().type );
+   } );
+
+   measure( shape, "convert", packed.size(), [&unpacked]()
+   {
+      T out;
+      unpacked.get().convert( out );
+      return sizeof(out);
+   } );
+}
+
+void bench_envelope()
+{
+   std::vector<int> const vec{ 5, 6 };
+   std::string const method = "foo";
+
+   // Client side: arguments, then the envelope around them
+   auto pack_request = [&vec, &method]()
+   {
+      pack_buffer params;
+      msgpack::pack( params, std::make_tuple( 1, false, "Hello, World", 3.1415, vec ) );
+
+      pack_buffer message;
+      msgpack::pack( message, std::make_tuple( rpc_message::request, uint32_t(42), method, static_cast<std::vector<char>>(params) ) );
+      return message;
+   };
+
+   pack_buffer const request = pack_request();
+
+   measure( "envelope", "pack", request.size(), [&pack_request]()
+   {
+      return pack_request().size();
+   } );
+
+   measure( "envelope", "unpack", request.size(), [&request]()
+   {
+      msgpack::object_handle const hndl = msgpack::unpack( request.data(), request.size() );
+      return static_cast<size_t>( hndl.get().type );
+   } );
+
+   msgpack::object_handle const unpacked = msgpack::unpack( request.data(), request.size() );
+   measure( "envelope", "convert", request.size(), [&unpacked]()
+   {
+      envelope_type envelope;
+      unpacked.get().convert( envelope );
+      return std::get<3>(envelope).size();
+   } );
+
+   // Server side: everything from the received bytes to the arguments of foo()
+   measure( "envelope", "decode", request.size(), [&request]()
+   {
+      msgpack::object_handle const hndl = msgpack::unpack( request.data(), request.size() );
+      envelope_type envelope;
+      hndl.get().convert( envelope );
+
+      std::vector<char> const & params = std::get<3>(envelope);
+      msgpack::object_handle const params_hndl = msgpack::unpack( params.data(), params.size() );
+      foo_args_type args;
+      params_hndl.get().convert( args );
+      return std::get<4>(args).size();
+   } );
+}
+
+std::string make_string( size_t const bytes )
+{
+   return std::string( bytes, 'x' );
+}
+
+std::vector<int32_t> make_vector( size_t const bytes )
+{
+   std::vector<int32_t> vec( bytes / sizeof(int32_t) ? bytes / sizeof(int32_t) : 1 );
+   for( size_t i = 0; i < vec.size(); ++i )
+   {
+      vec[i] = static_cast<int32_t>( i * 2654435761u );   // All msgpack integer widths show up
+   }
+   return vec;
+}
+
+std::map<uint32_t, uint32_t> make_map( size_t const bytes )
+{
+   std::map<uint32_t, uint32_t> map;
+   size_t const entries = bytes / (2 * sizeof(uint32_t)) ? bytes / (2 * sizeof(uint32_t)) : 1;
+   for( size_t i = 0; i < entries; ++i )
+   {
+      map.emplace( static_cast<uint32_t>(i), static_cast<uint32_t>( i * 2654435761u ) );
+   }
+   return map;
+}
+
+}
+
+int main( int argc, char * argv[] )
+{
+   std::string filter;
+   for( int i = 1; i < argc; ++i )
+   {
+      std::string const arg = argv[i];
+      if( arg.compare( 0, 11, "--min-time=" ) == 0 )
+      {
+         g_min_time = std::strtod( arg.c_str() + 11, nullptr );
+      }
+      else if( (arg == "--help") || (arg.compare( 0, 2, "--" ) == 0) )
+      {
+         std::printf( "Usage: %s [filter] [--min-time=SECONDS]\n", argv[0] );
+         return (arg == "--help") ? 0 : 1;
+      }
+      else
+      {
+         filter = arg;
+      }
+   }
+
+   auto selected = [&filter]( char const * shape ){ return std::string( shape ).find( filter ) != std::string::npos; };
+
+   print_header();
+
+   if( selected( "envelope" ) )
+   {
+      bench_envelope();
+   }
+
+   if( selected( "foo_args" ) )
+   {
+      measure_value( "foo_args", foo_args_type( 1, false, "Hello, World", 3.1415, std::vector<int>{ 5, 6 } ) );
+   }
+
+   size_t const sizes[] = { 8, 128, 2 * 1024, 32 * 1024, 512 * 1024, 16 * 1024 * 1024 };
+   for( size_t size : sizes )
+   {
+      if( selected( "string" ) )
+      {
+         measure_value( "string", make_string( size ) );
+      }
+      if( selected( "vector" ) )
+      {
+         measure_value( "vector", make_vector( size ) );
+      }
+      if( selected( "map" ) )
+      {
+         measure_value( "map", make_map( size ) );
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,549 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "msgpack.hpp"
+#include "rpc/transport_defs.hpp"
+#include "rpc/log.hpp"
+
+namespace rpc
+{
+
+// Descriptors received with, or to be sent with, frames. Closes those it still holds when destroyed
+class fd_list
+{
+public:
+   // At most this many go with one sendmsg() (SCM_MAX_FD)
+   static constexpr size_t max_per_message = 253;
+
+   fd_list() = default;
+   fd_list( fd_list const & ) = delete;
+   fd_list& operator=( fd_list const & ) = delete;
+
+   ~fd_list()
+   {
+      for( int const fd : _fds )
+      {
+         close( fd );
+      }
+   }
+
+   void push_back( int const fd )
+   {
+      _fds.push_back( fd );
+   }
+
+   size_t size() const
+   {
+      return _fds.size();
+   }
+
+   bool empty() const
+   {
+      return _fds.empty();
+   }
+
+   int operator[]( size_t const i ) const
+   {
+      return _fds[i];
+   }
+
+   // Closes them all
+   void clear()
+   {
+      for( int const fd : _fds )
+      {
+         close( fd );
+      }
+      _fds.clear();
+   }
+
+   // Moves the first n descriptors, or as many as there are, to a list of their own
+   std::shared_ptr<fd_list> take_front( size_t n )
+   {
+      std::shared_ptr<fd_list> ret( new fd_list() );
+      for( ; (n > 0) && !_fds.empty(); --n )
+      {
+         ret->_fds.push_back( _fds.front() );
+         _fds.pop_front();
+      }
+      return ret;
+   }
+
+private:
+   std::deque<int> _fds;
+};
+
+// send() that passes fds along with the first byte of data
+inline ssize_t send_with_fds( int const sock, char const * data, size_t const len, fd_list const & fds, int const flags )
+{
+   struct iovec iov;
+   iov.iov_base = const_cast<char *>( data );
+   iov.iov_len = len;
+
+   union
+   {
+      struct cmsghdr align;
+      char buffer[CMSG_SPACE(sizeof(int) * fd_list::max_per_message)];
+   } control;
+   memset( &control, 0, sizeof(control) );
+
+   size_t const count = (fds.size() < fd_list::max_per_message) ? fds.size() : fd_list::max_per_message;
+   struct msghdr msg;
+   memset( &msg, 0, sizeof(msg) );
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.buffer;
+   msg.msg_controllen = CMSG_SPACE( sizeof(int) * count );
+
+   struct cmsghdr * cmsg = CMSG_FIRSTHDR( &msg );
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN( sizeof(int) * count );
+   for( size_t i = 0; i < count; ++i )
+   {
+      int const fd = fds[i];
+      memcpy( CMSG_DATA( cmsg ) + i * sizeof(int), &fd, sizeof(int) );
+   }
+
+   return sendmsg( sock, &msg, flags );
+}
+
+// recv() that appends the descriptors passed along to fds
+inline ssize_t recv_with_fds( int const sock, char * buffer, size_t const len, fd_list & fds )
+{
+   struct iovec iov;
+   iov.iov_base = buffer;
+   iov.iov_len = len;
+
+   union
+   {
+      struct cmsghdr align;
+      char buffer[CMSG_SPACE(sizeof(int) * fd_list::max_per_message)];
+   } control;
+
+   struct msghdr msg;
+   memset( &msg, 0, sizeof(msg) );
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.buffer;
+   msg.msg_controllen = sizeof(control.buffer);
+
+   ssize_t const ret = recvmsg( sock, &msg, MSG_CMSG_CLOEXEC );
+   if( ret < 0 )
+   {
+      return ret;
+   }
+   if( msg.msg_flags & MSG_CTRUNC )
+   {
+      RPC_LOG( warning, "recv: descriptors dropped on fd %d", sock );
+   }
+
+   for( struct cmsghdr * cmsg = CMSG_FIRSTHDR( &msg ); cmsg != nullptr; cmsg = CMSG_NXTHDR( &msg, cmsg ) )
+   {
+      if( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS) )
+      {
+         size_t const count = (cmsg->cmsg_len - CMSG_LEN( 0 )) / sizeof(int);
+         for( size_t i = 0; i < count; ++i )
+         {
+            int fd;
+            memcpy( &fd, CMSG_DATA( cmsg ) + i * sizeof(int), sizeof(int) );
+            fds.push_back( fd );
+         }
+      }
+   }
+   return ret;
+}
+
+// Bytes that can go from one process to another on the same host without being copied.
+//
+// A blob is serialized as msgpack bin, like a std::vector<char>, except on Unix socket connections
+// with a blob threshold set (see server::set_blob_fd_threshold()): blobs from that size on are then
+// put in a sealed memfd, whose descriptor goes along with the frame (SCM_RIGHTS) while the frame
+// only refers to it. The receiver maps the memfd and hands the handler a read only view of it, so
+// moving 100 MB costs about as much as moving 100 bytes.
+//
+// Blobs are immutable once sent, and cheap to copy. A received blob sent on goes out as the same
+// memfd, without touching the bytes.
+class blob
+{
+public:
+   // msgpack ext types: a reference to the fd of a blob, and the number of fds of the next frame
+   static constexpr int8_t ext_type = 0x62;
+   static constexpr int8_t fds_ext_type = 0x66;
+
+   blob() = default;
+
+   // Copies size bytes of data
+   blob( void const * data, size_t const size ) :
+      blob( std::vector<char>( static_cast<char const *>( data ), static_cast<char const *>( data ) + size ) )
+   {
+   }
+
+   explicit blob( std::vector<char> bytes )
+   {
+      std::shared_ptr<storage> s = std::make_shared<storage>();
+      s->heap = std::move( bytes );
+      s->bytes = s->heap.data();
+      s->size = s->heap.size();
+      _storage = std::move( s );
+   }
+
+   // size bytes in a memfd, to be filled through writable_data() before the blob is sent. Sending
+   // it never copies then
+   static blob allocate( size_t const size )
+   {
+      std::shared_ptr<storage> s = std::make_shared<storage>();
+      s->fd = memfd_create( "rpc-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+      if( (s->fd == -1) || (ftruncate( s->fd, static_cast<off_t>( size ) ) != 0) )
+      {
+         throw std::system_error( errno, std::generic_category(), "blob: memfd" );
+      }
+      s->map( PROT_READ | PROT_WRITE );
+      s->writable = true;
+
+      blob ret;
+      ret._storage = std::move( s );
+      return ret;
+   }
+
+   char const * data() const
+   {
+      return _storage ? _storage->bytes : nullptr;
+   }
+
+   // Only for blobs from allocate(), nullptr for others
+   char * writable_data() const
+   {
+      return (_storage && _storage->writable) ? _storage->bytes : nullptr;
+   }
+
+   size_t size() const
+   {
+      return _storage ? _storage->size : 0;
+   }
+
+   bool empty() const
+   {
+      return size() == 0;
+   }
+
+   // Sealed memfd with the bytes from offset 0, for the caller to close. Copies them into a new
+   // memfd unless the blob already is in one
+   int memfd() const
+   {
+      if( (_storage != nullptr) && (_storage->fd != -1) )
+      {
+         if( _storage->writable )
+         {  // Seal what allocate() made, the mapping of the sender stays writable
+            fcntl( _storage->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+#ifdef F_SEAL_FUTURE_WRITE
+                   | F_SEAL_FUTURE_WRITE
+#endif
+                 );
+         }
+         int const fd = fcntl( _storage->fd, F_DUPFD_CLOEXEC, 0 );
+         if( fd == -1 )
+         {
+            throw std::system_error( errno, std::generic_category(), "blob: dup" );
+         }
+         return fd;
+      }
+
+      int const fd = memfd_create( "rpc-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+      if( fd == -1 )
+      {
+         throw std::system_error( errno, std::generic_category(), "blob: memfd_create" );
+      }
+      for( size_t written = 0; written < size(); /*no increment*/ )
+      {
+         ssize_t const ret = write( fd, data() + written, size() - written );
+         if( (ret < 0) && (errno != EINTR) )
+         {
+            int const err = errno;
+            close( fd );
+            throw std::system_error( err, std::generic_category(), "blob: write" );
+         }
+         written += (ret > 0) ? static_cast<size_t>( ret ) : 0;
+      }
+      fcntl( fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL );
+      return fd;
+   }
+
+   // Maps size bytes of a memfd received from a peer, which keeps fd open
+   static blob map( int const fd, size_t const size )
+   {
+      int const seals = fcntl( fd, F_GET_SEALS );
+      struct stat st;
+      if( (seals == -1) || !(seals & F_SEAL_SHRINK) || (fstat( fd, &st ) != 0) || (static_cast<size_t>( st.st_size ) < size) )
+      {  // A peer able to shrink it would crash us with SIGBUS
+         throw std::runtime_error( "blob: descriptor is not a sealed memfd of the expected size" );
+      }
+
+      std::shared_ptr<storage> s = std::make_shared<storage>();
+      s->fd = fcntl( fd, F_DUPFD_CLOEXEC, 0 );
+      if( s->fd == -1 )
+      {
+         throw std::system_error( errno, std::generic_category(), "blob: dup" );
+      }
+      s->map( PROT_READ );
+      s->size = size;
+
+      blob ret;
+      ret._storage = std::move( s );
+      return ret;
+   }
+
+private:
+   struct storage
+   {
+      storage() = default;
+      storage( storage const & ) = delete;
+      storage& operator=( storage const & ) = delete;
+
+      ~storage()
+      {
+         if( mapping != nullptr )
+         {
+            munmap( mapping, mapping_size );
+         }
+         if( fd != -1 )
+         {
+            close( fd );
+         }
+      }
+
+      // Maps the whole of fd
+      void map( int const prot )
+      {
+         struct stat st;
+         if( fstat( fd, &st ) != 0 )
+         {
+            throw std::system_error( errno, std::generic_category(), "blob: fstat" );
+         }
+         size = mapping_size = static_cast<size_t>( st.st_size );
+         if( size == 0 )
+         {  // mmap() refuses empty mappings
+            return;
+         }
+         mapping = mmap( nullptr, mapping_size, prot, MAP_SHARED, fd, 0 );
+         if( mapping == MAP_FAILED )
+         {
+            mapping = nullptr;
+            throw std::system_error( errno, std::generic_category(), "blob: mmap" );
+         }
+         bytes = static_cast<char *>( mapping );
+      }
+
+      std::vector<char> heap;
+      char * bytes = nullptr;
+      size_t size = 0;
+      void * mapping = nullptr;
+      size_t mapping_size = 0;
+      int fd = -1;             // memfd holding the bytes, if any
+      bool writable = false;   // From allocate()
+   };
+
+   std::shared_ptr<storage const> _storage;
+};
+
+// While one is alive on a thread, blobs packed on that thread from threshold bytes on are passed as
+// descriptors, collected here to go out with the frame. Blobs are packed inline without one
+class blob_sink
+{
+public:
+   explicit blob_sink( size_t const threshold ) : _threshold( threshold ), _previous( current() )
+   {
+      current() = (threshold != 0) ? this : nullptr;
+   }
+
+   blob_sink( blob_sink const & ) = delete;
+   blob_sink& operator=( blob_sink const & ) = delete;
+
+   ~blob_sink()
+   {
+      current() = _previous;
+   }
+
+   // The descriptors the blobs packed refer to, nullptr if none
+   std::shared_ptr<fd_list> take()
+   {
+      return std::move( _fds );
+   }
+
+   // Returns the index of the descriptor b is passed as, or -1 to pack it inline
+   static int pass( blob const & b )
+   {
+      blob_sink * const sink = current();
+      if( (sink == nullptr) || (b.size() < sink->_threshold) || (sink->_fds && (sink->_fds->size() >= fd_list::max_per_message)) )
+      {
+         return -1;
+      }
+
+      int fd;
+      try
+      {
+         fd = b.memfd();
+      }
+      catch( std::exception const & e )
+      {
+         RPC_LOG( warning, "%s, blob sent inline", e.what() );
+         return -1;
+      }
+      if( !sink->_fds )
+      {
+         sink->_fds.reset( new fd_list() );
+      }
+      sink->_fds->push_back( fd );
+      return static_cast<int>( sink->_fds->size() - 1 );
+   }
+
+private:
+   size_t const _threshold;
+   blob_sink * const _previous;
+   std::shared_ptr<fd_list> _fds;
+
+   static blob_sink *& current()
+   {
+      static thread_local blob_sink * sink = nullptr;
+      return sink;
+   }
+};
+
+// While one is alive on a thread, blobs unpacked on that thread find the descriptors they refer to
+// in fds, the ones received with the frame
+class blob_source
+{
+public:
+   explicit blob_source( fd_list const * fds ) : _previous( current() )
+   {
+      current() = fds;
+   }
+
+   blob_source( blob_source const & ) = delete;
+   blob_source& operator=( blob_source const & ) = delete;
+
+   ~blob_source()
+   {
+      current() = _previous;
+   }
+
+   static blob map( uint32_t const index, size_t const size )
+   {
+      fd_list const * const fds = current();
+      if( (fds == nullptr) || (index >= fds->size()) )
+      {
+         throw std::runtime_error( "blob: descriptor missing, the transport does not pass descriptors" );
+      }
+      return blob::map( (*fds)[index], size );
+   }
+
+private:
+   fd_list const * const _previous;
+
+   static fd_list const *& current()
+   {
+      static thread_local fd_list const * fds = nullptr;
+      return fds;
+   }
+};
+
+// Announces the descriptors of the frame packed next into buffer, which takes them to send along
+inline void pack_fds_marker( pack_buffer & buffer, std::shared_ptr<fd_list> fds )
+{
+   uint32_t const count = htonl( static_cast<uint32_t>( fds->size() ) );
+   msgpack::packer<pack_buffer> packer( buffer );
+   packer.pack_ext( sizeof(count), blob::fds_ext_type );
+   packer.pack_ext_body( reinterpret_cast<char const *>( &count ), sizeof(count) );
+   buffer.fds = std::move( fds );
+}
+
+// If obj is a marker from pack_fds_marker(), returns true and the number of descriptors it announces
+inline bool is_fds_marker( msgpack::object const & obj, size_t & count )
+{
+   if( (obj.type != msgpack::type::EXT) || (obj.via.ext.type() != blob::fds_ext_type) || (obj.via.ext.size != sizeof(uint32_t)) )
+   {
+      return false;
+   }
+   uint32_t n;
+   memcpy( &n, obj.via.ext.data(), sizeof(n) );
+   count = ntohl( n );
+   return true;
+}
+
+};
+
+namespace msgpack {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+// A blob passed as a descriptor is an ext with the big endian index of the descriptor in the frame
+// (32 bits) and the size of the blob (64 bits)
+template <>
+struct pack<rpc::blob>
+{
+   template <typename Stream>
+   msgpack::packer<Stream>& operator()(msgpack::packer<Stream>& o, const rpc::blob & v) const
+   {
+      int const index = rpc::blob_sink::pass( v );
+      if( index < 0 )
+      {
+         o.pack_bin( static_cast<uint32_t>( v.size() ) );
+         o.pack_bin_body( v.data(), static_cast<uint32_t>( v.size() ) );
+         return o;
+      }
+
+      char ref[12];
+      uint32_t const i = htonl( static_cast<uint32_t>( index ) );
+      uint32_t const high = htonl( static_cast<uint32_t>( static_cast<uint64_t>( v.size() ) >> 32 ) );
+      uint32_t const low = htonl( static_cast<uint32_t>( v.size() ) );
+      memcpy( ref, &i, 4 );
+      memcpy( ref + 4, &high, 4 );
+      memcpy( ref + 8, &low, 4 );
+      o.pack_ext( sizeof(ref), rpc::blob::ext_type );
+      o.pack_ext_body( ref, sizeof(ref) );
+      return o;
+   }
+};
+
+template <>
+struct convert<rpc::blob>
+{
+   msgpack::object const& operator()(msgpack::object const& o, rpc::blob& v) const
+   {
+      if( o.type == msgpack::type::BIN )
+      {
+         v = rpc::blob( o.via.bin.ptr, o.via.bin.size );
+      }
+      else if( (o.type == msgpack::type::EXT) && (o.via.ext.type() == rpc::blob::ext_type) && (o.via.ext.size == 12) )
+      {
+         uint32_t i, high, low;
+         memcpy( &i, o.via.ext.data(), 4 );
+         memcpy( &high, o.via.ext.data() + 4, 4 );
+         memcpy( &low, o.via.ext.data() + 8, 4 );
+         v = rpc::blob_source::map( ntohl( i ), static_cast<size_t>( (static_cast<uint64_t>( ntohl( high ) ) << 32) | ntohl( low ) ) );
+      }
+      else
+      {
+         throw msgpack::type_error();
+      }
+      return o;
+   }
+};
+
+} // namespace adaptor
+} // MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS)
+} // namespace msgpack
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <msgpack.hpp>
+#include <msgpack/fbuffer.hpp>
+
+namespace rpc
+{
+
+// Capture files are a stream of msgpack objects: the header
+// ["rpc-capture", version], then one [ns, connection, frame] array per request
+// received, where ns counts from the start of the capture, connection numbers
+// the client connections in the order they were first seen, and frame is the
+// request exactly as it came off the wire, as bin.
+constexpr char const * capture_magic = "rpc-capture";
+constexpr uint32_t capture_version = 1;
+
+struct capture_record
+{
+   uint64_t ns;
+   uint32_t connection;
+   char const * data;   // Points into the mapped file
+   size_t size;
+};
+
+// Appends frames to a capture file, through a buffered msgpack::fbuffer
+class capture_writer
+{
+public:
+   explicit capture_writer( char const * path ) : _file( fopen( path, "wb" ) ), _buffer( _file ), _packer( _buffer )
+   {
+      if( _file == nullptr )
+      {
+         throw std::system_error( errno, std::generic_category(), std::string( "capture: cannot open " ) + path );
+      }
+
+      _packer.pack_array( 2 );
+      _packer.pack( std::string( capture_magic ) );
+      _packer.pack( capture_version );
+   }
+
+   capture_writer( capture_writer const & ) = delete;
+   capture_writer& operator=( capture_writer const & ) = delete;
+
+   ~capture_writer()
+   {
+      if( _file != nullptr )
+      {
+         fclose( _file );
+      }
+   }
+
+   void write( uint64_t const ns, uint32_t const connection, char const * data, size_t const size )
+   {
+      _packer.pack_array( 3 );
+      _packer.pack( ns );
+      _packer.pack( connection );
+      _packer.pack_bin( static_cast<uint32_t>( size ) );
+      _packer.pack_bin_body( data, static_cast<uint32_t>( size ) );
+      ++_frames;
+   }
+
+   uint64_t frames() const
+   {
+      return _frames;
+   }
+
+private:
+   FILE * _file;
+   msgpack::fbuffer _buffer;
+   msgpack::packer<msgpack::fbuffer> _packer;
+   uint64_t _frames = 0;
+};
+
+// Maps a capture file and walks its records. Frames are not copied, they point into the mapping
+class capture_reader
+{
+public:
+   explicit capture_reader( char const * path )
+   {
+      int const fd = open( path, O_RDONLY | O_CLOEXEC );
+      if( fd == -1 )
+      {
+         throw std::system_error( errno, std::generic_category(), std::string( "capture: cannot open " ) + path );
+      }
+
+      struct stat st;
+      if( fstat( fd, &st ) == -1 )
+      {
+         int const err = errno;
+         close( fd );
+         throw std::system_error( err, std::generic_category(), "capture: fstat" );
+      }
+
+      _size = static_cast<size_t>( st.st_size );
+      if( _size != 0 )
+      {
+         void * const addr = mmap( nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0 );
+         if( addr == MAP_FAILED )
+         {
+            int const err = errno;
+            close( fd );
+            throw std::system_error( err, std::generic_category(), "capture: mmap" );
+         }
+         _data = static_cast<char const *>( addr );
+         madvise( const_cast<char*>( _data ), _size, MADV_SEQUENTIAL );
+      }
+      close( fd );
+
+      msgpack::object_handle const header = unpack_next();
+      std::tuple<std::string, uint32_t> fields;
+      header.get().convert( fields );
+      if( (std::get<0>(fields) != capture_magic) || (std::get<1>(fields) != capture_version) )
+      {
+         throw std::runtime_error( std::string( "capture: " ) + path + " is not a capture file" );
+      }
+   }
+
+   capture_reader( capture_reader const & ) = delete;
+   capture_reader& operator=( capture_reader const & ) = delete;
+
+   ~capture_reader()
+   {
+      if( _data != nullptr )
+      {
+         munmap( const_cast<char*>( _data ), _size );
+      }
+   }
+
+   // Returns false at the end of the file. A record cut short (the server died while capturing) ends it too
+   bool next( capture_record & rec )
+   {
+      if( _offset >= _size )
+      {
+         return false;
+      }
+
+      msgpack::object_handle hndl;
+      try
+      {
+         hndl = unpack_next();
+      }
+      catch( msgpack::insufficient_bytes const & )
+      {
+         _offset = _size;
+         return false;
+      }
+
+      msgpack::object const & obj = hndl.get();
+      if( (obj.type != msgpack::type::ARRAY) || (obj.via.array.size != 3) || (obj.via.array.ptr[2].type != msgpack::type::BIN) )
+      {
+         throw std::runtime_error( "capture: malformed record" );
+      }
+
+      rec.ns = obj.via.array.ptr[0].as<uint64_t>();
+      rec.connection = obj.via.array.ptr[1].as<uint32_t>();
+      rec.data = obj.via.array.ptr[2].via.bin.ptr;
+      rec.size = obj.via.array.ptr[2].via.bin.size;
+      return true;
+   }
+
+   void rewind()
+   {
+      _offset = 0;
+      unpack_next();
+   }
+
+private:
+   char const * _data = nullptr;
+   size_t _size = 0;
+   size_t _offset = 0;
+
+   msgpack::object_handle unpack_next()
+   {
+      // Referencing bin objects keeps frames in the mapping instead of copying them to the zone
+      return msgpack::unpack( _data, _size, _offset, []( msgpack::type::object_type type, std::size_t, void* ){ return type == msgpack::type::BIN; } );
+   }
+};
+
+};
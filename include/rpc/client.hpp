@@ -2,10 +2,15 @@
 
 #include <utility>
 #include <future>
+#include <thread>
+#include <mutex>
 #include <unordered_map>
 #include "msgpack.hpp"
 #include "transport_defs.hpp"
+#include "endpoint.hpp"
 #include "tcp_socket_client.hpp"
+#include "priority.hpp"
+#include "log.hpp"
 
 namespace rpc
 {
@@ -13,7 +18,12 @@ namespace rpc
 class client
 {
 public:
-   client() : _conn( "127.0.0.1", 20000 ),
+   client( char const * addr = "127.0.0.1", uint16_t const port = 20000 ) : client( endpoint::tcp( addr, port ) )
+   {
+   }
+
+   // e.g. endpoint::unix_domain( "/run/app.sock" ) for a server on the same host
+   explicit client( endpoint const & server ) : _conn( server ),
               _message_processor_thrd( &client::message_processor, this ),
               _msgid_counter( 0 )
    {
@@ -29,15 +39,97 @@ public:
 
    template< class ret_t, class... Args >
    std::future<ret_t> async_call( std::string const & method, Args&&... args )
+   {
+      return async_call_impl<ret_t>( nullptr, nullptr, method, std::forward<Args>(args)... );
+   }
+
+   // Same as above, but the call is scheduled on the server with prio instead of the method's own priority
+   template< class ret_t, class... Args >
+   std::future<ret_t> async_call( priority const prio, std::string const & method, Args&&... args )
+   {
+      return async_call_impl<ret_t>( &prio, nullptr, method, std::forward<Args>(args)... );
+   }
+
+   template< class ret_t, class... Args >
+   ret_t call( std::string const & method, Args&&... args )
+   {
+      auto result = async_call<ret_t>( method, std::forward<Args>(args)... );
+      //result.wait();
+      return result.get();
+   }
+
+   template< class ret_t, class... Args >
+   ret_t call( priority const prio, std::string const & method, Args&&... args )
+   {
+      return async_call<ret_t>( prio, method, std::forward<Args>(args)... ).get();
+   }
+
+   // rpc::blob arguments from this size on go to the server as memfd descriptors instead of bytes,
+   // see rpc/blob.hpp. 0 (the default) always sends bytes. Unix socket endpoints only, and the server
+   // must have a threshold set too, or it refuses the descriptors
+   void set_blob_fd_threshold( size_t const bytes )
+   {
+      _conn.set_blob_fd_threshold( bytes );
+   }
+
+   // Requests from this size on (64 KiB by default) are sent with MSG_ZEROCOPY, 0 always copies
+   void set_zerocopy_threshold( size_t const bytes )
+   {
+      _conn.set_zerocopy_threshold( bytes );
+   }
+
+   // False once the server closed the connection. Calls waiting for a response then fail, and new
+   // ones throw
+   bool connected() const
+   {
+      return _conn.connected();
+   }
+
+private:
+   friend class pooled_client;
+
+   using done_type = std::function< void ( bool /*failed*/ ) >;
+
+   bool _keep_running = true;
+   tcp_socket_client _conn;
+   std::thread _message_processor_thrd;
+   std::atomic_uint32_t _msgid_counter;
+
+   using notifier_type = std::function< void ( std::exception_ptr &, std::vector<char> const &, fd_list const * ) >;
+   std::mutex _waiting_mutex;
+   std::unordered_map<uint32_t, notifier_type> _waiting_response;
+   bool _disconnected = false;   // Guarded by _waiting_mutex
+
+   // done, if set, is called once the call completed or failed, before the future is ready. Usually on
+   // the thread that receives the response
+   template< class ret_t, class... Args >
+   std::future<ret_t> async_call_impl( priority const * prio, done_type done, std::string const & method, Args&&... args )
    {
       auto parameters = std::make_tuple( std::forward<Args>(args)... );
       pack_buffer buffer;
-      msgpack::pack(buffer, parameters);
+      {
+         rpc::blob_sink sink( _conn.blob_fd_threshold() );
+         msgpack::pack(buffer, parameters);
+         buffer.fds = sink.take();
+      }
 
       std::shared_ptr<std::promise<ret_t>> result_promise( new std::promise<ret_t>()) ;
       uint32_t const msgid = _msgid_counter++;
-      _waiting_response.emplace( msgid, [result_promise]( std::exception_ptr & error, std::vector<char> const & result ) mutable -> void
+      std::unique_lock<std::mutex> lck(_waiting_mutex);
+      if( _disconnected )
+      {
+         if( done )
+         {
+            done( true );
+         }
+         throw std::runtime_error( "Server closed connection" );
+      }
+      _waiting_response.emplace( msgid, [result_promise, done]( std::exception_ptr & error, std::vector<char> const & result, fd_list const * fds ) mutable -> void
       {
+         if( done )
+         {
+            done( static_cast<bool>( error ) );
+         }
          if( error )
          {
             result_promise->set_exception( error );
@@ -48,6 +140,7 @@ public:
             {
                msgpack::object_handle const hndl = msgpack::unpack( result.data(), result.size() );
                msgpack::object const obj = hndl.get();
+               blob_source const source( fds );
                result_promise->set_value( obj.as<ret_t>() );
             }
             catch(...)
@@ -56,37 +149,59 @@ public:
             }
          }
       } );
+      lck.unlock();
 
-      post_message( rpc_message::request, msgid, method, buffer );
+      try
+      {
+         post_message( rpc_message::request, msgid, method, buffer, prio );
+      }
+      catch(...)
+      {  // Unless the connection went down in between, and the call already failed
+         lck.lock();
+         if( _waiting_response.erase( msgid ) && done )
+         {
+            done( true );
+         }
+         throw;
+      }
 
       return result_promise->get_future();
    }
 
-   template< class ret_t, class... Args >
-   ret_t call( std::string const & method, Args&&... args )
+   void post_message( rpc_message const & type, uint32_t const msgid, std::string const & method, pack_buffer const & params, priority const * prio = nullptr )
    {
-      auto result = async_call<ret_t>( method, std::forward<Args>(args)... );
-      //result.wait();
-      return result.get();
-   }
-
-private:
-   bool _keep_running = true;
-   tcp_socket_client _conn;
-   std::thread _message_processor_thrd;
-   std::atomic_uint32_t _msgid_counter;
+      pack_buffer message_buffer;
+      if( params.fds )
+      {
+         pack_fds_marker( message_buffer, params.fds );
+      }
+      if( prio != nullptr )
+      {
+         msgpack::pack(message_buffer, std::make_tuple( type, msgid, method, static_cast<std::vector<char>>(params), *prio ));
+      }
+      else
+      {
+         msgpack::pack(message_buffer, std::make_tuple( type, msgid, method, static_cast<std::vector<char>>(params) ));
+      }
 
-   using notifier_type = std::function< void ( std::exception_ptr &, std::vector<char> const & ) >;
-   std::unordered_map<uint32_t, notifier_type> _waiting_response;
+      _conn.post( std::move(message_buffer) );
+   }
 
-   void post_message( rpc_message const & type, uint32_t const msgid, std::string const & method, pack_buffer const & params )
+   // No response will come for the calls waiting, nor for later ones
+   void fail_waiting()
    {
-      auto message = std::make_tuple( type, msgid, method, static_cast<std::vector<char>>(params) );
-
-      pack_buffer message_buffer;
-      msgpack::pack(message_buffer, message);
+      std::unordered_map<uint32_t, notifier_type> waiting;
+      {
+         std::unique_lock<std::mutex> lck(_waiting_mutex);
+         _disconnected = true;
+         waiting.swap( _waiting_response );
+      }
 
-      _conn.post( message_buffer );
+      std::exception_ptr error = std::make_exception_ptr( std::runtime_error( "Server closed connection" ) );
+      for( auto& it : waiting )
+      {
+         it.second( error, std::vector<char>(), nullptr );
+      }
    }
 
    void message_processor()
@@ -95,14 +210,19 @@ private:
       {
          if( ! _conn._message_queue.empty_blocking() )
          {
-            msgpack::object_handle const recv_msg = _conn._message_queue.pop_back();
+            tcp_socket_client::message const recv_msg = _conn._message_queue.pop_back();
+            if( recv_msg.data.get().type == msgpack::type::NIL )
+            {  // The connection is gone
+               fail_waiting();
+               continue;
+            }
 
             // deserialized object is valid during the msgpack::object_handle instance is alive.
-            msgpack::object const msg_obj = recv_msg.get();
+            msgpack::object const msg_obj = recv_msg.data.get();
 
             if( msg_obj.via.array.size == 3 )
             {
-               std::cout << "NOTIFICATION NOT IMPLEMENTED" << std::endl;
+               RPC_LOG( warning, "Notifications are not implemented" );
             }
             else if( msg_obj.via.array.size == 4 )
             {
@@ -120,20 +240,29 @@ private:
                   error = std::make_exception_ptr( std::runtime_error( obj.as<std::string>() ) );
                }
 
-               auto it = _waiting_response.find( std::get<1>(msg_fields) );
-               if( it != _waiting_response.end() )
+               notifier_type notifier;
+               {
+                  std::unique_lock<std::mutex> lck(_waiting_mutex);
+                  auto it = _waiting_response.find( std::get<1>(msg_fields) );
+                  if( it != _waiting_response.end() )
+                  {
+                     notifier = std::move( it->second );
+                     _waiting_response.erase( it );
+                  }
+               }
+
+               if( notifier )
                {
-                  it->second( error, std::get<3>(msg_fields) );
-                  _waiting_response.erase( std::get<1>(msg_fields) );
+                  notifier( error, std::get<3>(msg_fields), recv_msg.fds.get() );
                }
                else
                {
-                  std::cout << "Could not find message with id " << std::get<1>(msg_fields) << std::endl;
+                  RPC_LOG( warning, "Could not find message with id %u", std::get<1>(msg_fields) );
                }
             }
             else
             {
-               std::cout << "INVALID MESSAGE FORMAT" << std::endl;
+               RPC_LOG( error, "Invalid message format" );
             }
          }
       }
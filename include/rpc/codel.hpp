@@ -0,0 +1,101 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include "rpc/histogram.hpp"
+
+namespace rpc
+{
+
+struct codel_options
+{
+   bool enabled = false;
+   std::chrono::microseconds target{ 5000 };      // Acceptable standing queue delay
+   std::chrono::microseconds interval{ 100000 };  // How long the delay must stay above target
+};
+
+struct codel_stats
+{
+   bool overloaded = false;
+   uint64_t dequeued = 0;
+   uint64_t shed = 0;
+   latency_histogram sojourn;
+};
+
+// Overload detector based on request sojourn time, following CoDel (RFC 8289)
+// as it is usually adapted for RPC servers: the queue is overloaded when the
+// minimum standing delay seen over a whole interval stays above target, i.e.
+// there is a standing queue rather than a burst. While overloaded, anything
+// that waited longer than twice the target is shed, and the owner is expected
+// to serve the queue newest-first so fresh requests still complete in time.
+//
+// The standing delay is the age of the oldest request still queued, not the
+// sojourn of the one served: served newest-first, that one is always fresh and
+// would end the overload while the queue keeps growing behind it.
+//
+// Not thread safe, the owning queue calls it under its own lock.
+class codel
+{
+public:
+   using clock = std::chrono::steady_clock;
+
+   explicit codel( codel_options const & opts = codel_options() ) : _opts( opts ) {}
+
+   bool overloaded() const
+   {
+      return _overloaded;
+   }
+
+   // Sojourn beyond which requests are shed while overloaded
+   clock::duration shed_after() const
+   {
+      return 2 * _opts.target;
+   }
+
+   // Accounts for a dequeued request, standing is the age of the oldest request left queued (or
+   // sojourn if that is older). Returns true if the request must be shed.
+   bool on_dequeue( clock::time_point const now, clock::duration const sojourn, clock::duration const standing )
+   {
+      ++_stats.dequeued;
+      _stats.sojourn.record( sojourn );
+
+      if( !_opts.enabled )
+      {
+         return false;
+      }
+
+      if( now >= _interval_end )
+      {
+         _overloaded   = _min_delay > _opts.target;
+         _min_delay    = standing;
+         _interval_end = now + _opts.interval;
+      }
+      else if( standing < _min_delay )
+      {
+         _min_delay = standing;
+      }
+
+      if( _overloaded && (sojourn > shed_after()) )
+      {
+         ++_stats.shed;
+         return true;
+      }
+      return false;
+   }
+
+   codel_stats stats() const
+   {
+      codel_stats ret( _stats );
+      ret.overloaded = _overloaded;
+      return ret;
+   }
+
+private:
+   codel_options _opts;
+   bool _overloaded = false;
+   clock::duration _min_delay = clock::duration::zero();
+   clock::time_point _interval_end;
+   codel_stats _stats;
+};
+
+};
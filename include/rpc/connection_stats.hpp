@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <msgpack.hpp>
+
+namespace rpc
+{
+
+// Kernel view of a TCP connection, from getsockopt( TCP_INFO ) and ioctl( SIOCOUTQ )
+struct tcp_sample
+{
+   uint32_t rtt_us = 0;         // Smoothed round trip time
+   uint32_t rttvar_us = 0;
+   uint32_t snd_cwnd = 0;       // Congestion window, in segments
+   uint32_t unacked = 0;        // Segments sent and not acknowledged yet
+   uint32_t retransmits = 0;    // Over the lifetime of the connection
+   uint32_t lost = 0;
+   uint64_t unsent_bytes = 0;   // In the kernel send queue, sent and unacknowledged ones included
+
+   MSGPACK_DEFINE_MAP( rtt_us, rttvar_us, snd_cwnd, unacked, retransmits, lost, unsent_bytes );
+};
+
+// One client connection of a server. A slow client shows up as a growing
+// queue: in our output queue (queued_*) while the kernel buffer is full, with
+// unacked segments and a small window if the network is the problem, or with
+// a large unsent_bytes but few unacked segments and no retransmits if the
+// client does not read
+struct connection_stats
+{
+   int fd = -1;
+   std::string peer;            // address:port
+   uint64_t bytes_in = 0;
+   uint64_t bytes_out = 0;
+   uint64_t frames_in = 0;
+   uint64_t frames_out = 0;
+   uint64_t queued_frames = 0;  // Responses waiting for the socket to become writable
+   uint64_t queued_bytes = 0;
+   uint32_t max_rtt_us = 0;     // Highest rtt_us sampled
+   tcp_sample tcp;              // As last sampled
+
+   MSGPACK_DEFINE_MAP( fd, peer, bytes_in, bytes_out, frames_in, frames_out, queued_frames, queued_bytes, max_rtt_us, tcp );
+};
+
+// Every connection of a server, and their totals. Returned by the built-in
+// "__connections" method: client.call<rpc::transport_stats>( "__connections" )
+struct transport_stats
+{
+   uint64_t connections = 0;
+   uint64_t bytes_in = 0;
+   uint64_t bytes_out = 0;
+   uint64_t frames_in = 0;
+   uint64_t frames_out = 0;
+   uint64_t queued_frames = 0;
+   uint64_t queued_bytes = 0;
+   uint64_t unsent_bytes = 0;
+   uint64_t retransmits = 0;
+   uint32_t mean_rtt_us = 0;
+   uint32_t max_rtt_us = 0;
+   std::vector<connection_stats> per_connection;
+
+   void add( connection_stats const & c )
+   {
+      ++connections;
+      bytes_in += c.bytes_in;
+      bytes_out += c.bytes_out;
+      frames_in += c.frames_in;
+      frames_out += c.frames_out;
+      queued_frames += c.queued_frames;
+      queued_bytes += c.queued_bytes;
+      unsent_bytes += c.tcp.unsent_bytes;
+      retransmits += c.tcp.retransmits;
+      mean_rtt_us = static_cast<uint32_t>( (uint64_t(mean_rtt_us) * (connections - 1) + c.tcp.rtt_us) / connections );
+      max_rtt_us = std::max( max_rtt_us, c.max_rtt_us );
+      per_connection.push_back( c );
+   }
+
+   MSGPACK_DEFINE_MAP( connections, bytes_in, bytes_out, frames_in, frames_out, queued_frames, queued_bytes, unsent_bytes,
+                       retransmits, mean_rtt_us, max_rtt_us, per_connection );
+};
+
+};
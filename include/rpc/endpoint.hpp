@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace rpc
+{
+
+// Where a server listens and a client connects to: a TCP address and port, or
+// a Unix domain socket. Clients on the same host as the server should use the
+// latter, which skips the TCP stack altogether.
+//
+// Unix socket paths starting with '@' name a socket in the abstract namespace
+// (Linux only): nothing is created in the file system, and the name goes away
+// with the last socket using it.
+//
+// A shared_memory endpoint is a Unix socket too, but only to set connections
+// up: frames then go through rings in memory both processes map (see
+// rpc/shared_memory.hpp), with no system call while both sides keep up.
+//
+// udp endpoints take notifications and small calls one datagram each, see
+// server::listen_udp() and rpc::udp_client.
+class endpoint
+{
+public:
+   enum class family
+   {
+      tcp,
+      unix_domain,
+      shared_memory,
+      udp
+   };
+
+   static endpoint tcp( char const * addr = "127.0.0.1", uint16_t const port = 20000 )
+   {
+      return endpoint( family::tcp, addr, port );
+   }
+
+   static endpoint unix_domain( std::string const & path )
+   {
+      if( path.empty() || (path.size() >= sizeof(sockaddr_un::sun_path)) )
+      {
+         throw std::invalid_argument( "Invalid Unix socket path" );
+      }
+      return endpoint( family::unix_domain, path, 0 );
+   }
+
+   static endpoint udp( char const * addr = "127.0.0.1", uint16_t const port = 20000 )
+   {
+      return endpoint( family::udp, addr, port );
+   }
+
+   // path is the Unix socket connections are set up through
+   static endpoint shared_memory( std::string const & path )
+   {
+      endpoint ret = unix_domain( path );
+      ret._family = family::shared_memory;
+      return ret;
+   }
+
+   // "unix:/path/to/socket", "unix:@abstract-name", "shm:" followed by either, "udp:address:port" or "address:port"
+   static endpoint parse( std::string const & text )
+   {
+      if( text.compare( 0, 4, "udp:" ) == 0 )
+      {
+         endpoint ret = parse( text.substr( 4 ) );
+         if( !ret.is_tcp() )
+         {
+            throw std::invalid_argument( "Invalid endpoint " + text );
+         }
+         ret._family = family::udp;
+         return ret;
+      }
+      if( text.compare( 0, 5, "unix:" ) == 0 )
+      {
+         return unix_domain( text.substr( 5 ) );
+      }
+      if( text.compare( 0, 4, "shm:" ) == 0 )
+      {
+         return shared_memory( text.substr( 4 ) );
+      }
+
+      size_t const colon = text.rfind( ':' );
+      if( (colon == std::string::npos) || (colon + 1 == text.size()) )
+      {
+         throw std::invalid_argument( "Invalid endpoint " + text );
+      }
+      char const * const digits = text.c_str() + colon + 1;
+      char * end;
+      unsigned long const port = std::strtoul( digits, &end, 10 );
+      if( (*digits < '0') || (*digits > '9') || (*end != '\0') || (port > 65535) )
+      {  // strtoul would take "abc" as 0, and wrap "70000" once narrowed
+         throw std::invalid_argument( "Invalid port in endpoint " + text );
+      }
+      return tcp( text.substr( 0, colon ).c_str(), static_cast<uint16_t>( port ) );
+   }
+
+   family kind() const
+   {
+      return _family;
+   }
+
+   bool is_tcp() const
+   {
+      return _family == family::tcp;
+   }
+
+   // TCP or UDP, with an IP address and port
+   bool is_ip() const
+   {
+      return (_family == family::tcp) || (_family == family::udp);
+   }
+
+   // In the abstract namespace, so there is no file to create or remove
+   bool is_abstract() const
+   {
+      return !is_ip() && (_address[0] == '@');
+   }
+
+   // IP address, or Unix socket path
+   std::string const & address() const
+   {
+      return _address;
+   }
+
+   uint16_t port() const
+   {
+      return _port;
+   }
+
+   // Same format as parse()
+   std::string to_string() const
+   {
+      switch( _family )
+      {
+         case family::tcp:           return _address + ":" + std::to_string( _port );
+         case family::unix_domain:   return "unix:" + _address;
+         case family::shared_memory: return "shm:" + _address;
+         case family::udp:           return "udp:" + _address + ":" + std::to_string( _port );
+      }
+      return std::string();
+   }
+
+   int socket_family() const
+   {
+      return is_ip() ? AF_INET : AF_UNIX;
+   }
+
+   // Fills addr for bind() or connect(), returns its length
+   socklen_t to_sockaddr( struct sockaddr_storage & addr ) const
+   {
+      memset( &addr, 0, sizeof(addr) );
+      if( is_ip() )
+      {
+         struct sockaddr_in & in = reinterpret_cast<struct sockaddr_in &>( addr );
+         in.sin_family = AF_INET;
+         in.sin_port = htons( _port );
+         if( inet_pton( AF_INET, _address.c_str(), &in.sin_addr ) != 1 )
+         {
+            throw std::invalid_argument( "Invalid address" );
+         }
+         return sizeof(in);
+      }
+
+      struct sockaddr_un & un = reinterpret_cast<struct sockaddr_un &>( addr );
+      un.sun_family = AF_UNIX;
+      memcpy( un.sun_path, _address.data(), _address.size() );
+      if( is_abstract() )
+      {  // Abstract names start with a null byte, and are as long as the address length says
+         un.sun_path[0] = '\0';
+         return static_cast<socklen_t>( offsetof( struct sockaddr_un, sun_path ) + _address.size() );
+      }
+      return sizeof(un);
+   }
+
+private:
+   endpoint( family const f, std::string address, uint16_t const port ) :
+      _family( f ), _address( std::move(address) ), _port( port )
+   {
+   }
+
+   family _family;
+   std::string _address;
+   uint16_t _port;
+};
+
+};
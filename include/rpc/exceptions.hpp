@@ -15,6 +15,13 @@ public:
    explicit bad_call(const char* what_arg) : std::runtime_error(what_arg) {}
 };
 
+class server_overloaded : public std::runtime_error
+{
+public:
+   explicit server_overloaded(const std::string& what_arg) : std::runtime_error(what_arg) {}
+   explicit server_overloaded(const char* what_arg) : std::runtime_error(what_arg) {}
+};
+
 class illegal_bind : public std::runtime_error
 {
 public:
@@ -0,0 +1,492 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "rpc/request_queue.hpp"
+#include "rpc/placement.hpp"
+#include "rpc/log.hpp"
+#include "rpc/trace.hpp"
+
+namespace rpc
+{
+
+// Number of workers of a pool. With min < max the pool is elastic: it starts
+// with min workers, adds one whenever all of them are busy (or blocked) while
+// requests wait longer than grow_after, and workers above min retire after
+// being idle for idle_timeout.
+struct pool_size
+{
+   pool_size( size_t n ) : min( n ), max( n ) {}
+   pool_size( size_t lo, size_t hi ) : min( lo ), max( hi < lo ? lo : hi ) {}
+
+   size_t min;
+   size_t max;
+   std::chrono::microseconds grow_after{ 1000 };
+   std::chrono::milliseconds idle_timeout{ 10000 };
+};
+
+// Names a dedicated pool of worker threads (a bulkhead). Methods bound to it
+// are queued and run only there, so a slow method can exhaust its own workers
+// and queue, but not everybody else's.
+struct executor
+{
+   executor( std::string n, pool_size t, size_t q = 0 ) : name( std::move(n) ), threads( t ), max_queue( q ) {}
+
+   std::string name;
+   pool_size threads;
+   size_t max_queue;   // Requests beyond this are rejected right away. 0 for unbounded
+};
+
+struct executor_stats
+{
+   std::string name;
+   size_t threads = 0;
+   size_t idle = 0;
+   size_t blocked = 0;
+   size_t queue_depth = 0;
+   size_t max_queue = 0;
+   uint64_t executed = 0;
+   uint64_t rejected = 0;
+   uint64_t spawned = 0;
+   uint64_t retired = 0;
+   double utilization = 0.0;   // Fraction of the workers' time spent running requests since the previous call
+   codel_stats load_shedding;
+};
+
+namespace detail
+{
+
+// Lets blocking_section find the pool the calling thread works for
+class blocking_aware
+{
+public:
+   virtual ~blocking_aware() = default;
+   virtual void begin_blocking() = 0;
+   virtual void end_blocking() = 0;
+
+   static blocking_aware *& current()
+   {
+      static thread_local blocking_aware * pool = nullptr;
+      return pool;
+   }
+};
+
+}
+
+// Marks a region where a handler blocks (disk, downstream calls, ...). While
+// inside, the worker does not count as available, so an elastic pool starts
+// another one if requests are waiting. Does nothing outside of worker threads.
+class blocking_section
+{
+public:
+   blocking_section() : _pool( detail::blocking_aware::current() )
+   {
+      if( _pool != nullptr )
+      {
+         detail::blocking_aware::current() = nullptr;   // Nested sections count once
+         _pool->begin_blocking();
+      }
+   }
+
+   ~blocking_section()
+   {
+      if( _pool != nullptr )
+      {
+         _pool->end_blocking();
+         detail::blocking_aware::current() = _pool;
+      }
+   }
+
+   blocking_section( blocking_section const & ) = delete;
+   blocking_section& operator=( blocking_section const & ) = delete;
+
+private:
+   detail::blocking_aware * _pool;
+};
+
+// Worker threads plus the request queue feeding them
+template< class T >
+class worker_pool : private detail::blocking_aware
+{
+public:
+   using clock = std::chrono::steady_clock;
+   using pop_status = typename request_queue<T>::pop_status;
+   using handler_type = std::function< void ( T &, bool /*shed*/ ) >;
+
+   explicit worker_pool( executor const & config ) : _config( config ), _stats_time( clock::now() )
+   {
+      _queue.set_max_size( config.max_queue );
+   }
+
+   worker_pool( worker_pool const & ) = delete;
+   worker_pool& operator=( worker_pool const & ) = delete;
+
+   ~worker_pool()
+   {
+      stop();
+   }
+
+   executor const & config() const
+   {
+      return _config;
+   }
+
+   // Only before start()/run()
+   void set_size( pool_size const & size )
+   {
+      _config.threads = size;
+   }
+
+   // CPUs the workers are pinned to, one each in turn. Only before start()/run(), which also pins
+   // the calling thread
+   void set_cpus( std::vector<int> cpus )
+   {
+      _cpus = std::move( cpus );
+   }
+
+   // Every running worker and the CPUs it may run on
+   std::vector<placed_thread> placement()
+   {
+      std::unique_lock<std::mutex> lck(_threads_mutex);
+      std::vector<placed_thread> ret;
+      for( auto const & it : _placed )
+      {
+         ret.push_back( it.second );
+      }
+      return ret;
+   }
+
+   request_queue<T> & queue()
+   {
+      return _queue;
+   }
+
+   // Returns false if the request was rejected because the queue is full
+   bool push( priority const prio, T && item )
+   {
+      if( !_queue.emplace_back( prio, std::move(item) ) )
+      {
+         ++_rejected;
+         return false;
+      }
+
+      maybe_grow();
+      return true;
+   }
+
+   // Starts the pool's own threads
+   void start( handler_type handler )
+   {
+      _keep_running = true;
+      _handler = std::move( handler );
+
+      for( size_t i = 0; i < _config.threads.min; ++i )
+      {
+         spawn();
+      }
+      start_watcher();
+   }
+
+   // Serves requests in the calling thread until stop() is called. The pool
+   // grows with threads of its own above that one if it is elastic
+   void run( handler_type handler )
+   {
+      _keep_running = true;
+      _handler = std::move( handler );
+
+      {
+         std::unique_lock<std::mutex> lck(_threads_mutex);
+         ++_running;
+         ++_idle;
+      }
+      start_watcher();
+      work( false );
+   }
+
+   void stop()
+   {
+      {
+         std::unique_lock<std::mutex> lck(_watcher_mutex);
+         _keep_running = false;
+      }
+      _watcher_cv.notify_all();
+      _queue.notify_all();
+      if( _watcher.joinable() )
+      {
+         _watcher.join();
+      }
+
+      for( ;; )
+      {
+         std::list<std::thread> threads;
+         {
+            std::unique_lock<std::mutex> lck(_threads_mutex);
+            threads.swap( _threads );
+            _retired_ids.clear();
+         }
+
+         if( threads.empty() )
+         {
+            break;
+         }
+
+         for( auto& it : threads )
+         {
+            if( it.joinable() )
+            {
+               it.join();
+            }
+         }
+      }
+   }
+
+   executor_stats stats()
+   {
+      executor_stats ret;
+      ret.name = _config.name;
+      ret.threads = _running;
+      ret.idle = _idle;
+      ret.blocked = _blocked;
+      ret.queue_depth = _queue.size();
+      ret.max_queue = _config.max_queue;
+      ret.executed = _executed;
+      ret.rejected = _rejected;
+      ret.spawned = _spawned;
+      ret.retired = _retired;
+      ret.load_shedding = _queue.load_shedding_stats();
+
+      std::unique_lock<std::mutex> lck(_stats_mutex);
+      clock::time_point const now = clock::now();
+      uint64_t const busy = _busy_ns;
+      double const window = std::chrono::duration<double, std::nano>( now - _stats_time ).count() * (ret.threads ? ret.threads : 1);
+      ret.utilization = (window > 0) ? (busy - _stats_busy_ns) / window : 0.0;
+      _stats_time = now;
+      _stats_busy_ns = busy;
+
+      return ret;
+   }
+
+private:
+   executor _config;
+   request_queue<T> _queue;
+   handler_type _handler;
+   std::atomic<bool> _keep_running{ false };
+
+   std::mutex _threads_mutex;
+   std::list<std::thread> _threads;
+   std::vector<std::thread::id> _retired_ids;   // Exited, waiting to be joined
+   std::vector<int> _cpus;
+   size_t _next_cpu = 0;
+   std::unordered_map<int, placed_thread> _placed;   // By tid
+
+   std::atomic<size_t> _running{ 0 };
+   std::atomic<size_t> _idle{ 0 };
+   std::atomic<size_t> _blocked{ 0 };
+   std::atomic<uint64_t> _executed{ 0 };
+   std::atomic<uint64_t> _rejected{ 0 };
+   std::atomic<uint64_t> _spawned{ 0 };
+   std::atomic<uint64_t> _retired{ 0 };
+   std::atomic<uint64_t> _busy_ns{ 0 };
+
+   std::thread _watcher;
+   std::mutex _watcher_mutex;
+   std::condition_variable _watcher_cv;
+
+   std::mutex _stats_mutex;
+   clock::time_point _stats_time;
+   uint64_t _stats_busy_ns = 0;
+
+   void begin_blocking() override
+   {
+      ++_blocked;
+      maybe_grow();
+   }
+
+   void end_blocking() override
+   {
+      --_blocked;
+   }
+
+   // Adds a worker if nobody is free to take the queued requests and they are either piling up, or
+   // some workers are stuck in a blocking_section
+   void maybe_grow()
+   {
+      if( (_running >= _config.threads.max) || !_keep_running || _queue.empty() )
+      {
+         return;
+      }
+
+      if( _running == 0 )
+      {  // A pool with a minimum of 0, nobody else would ever serve the request
+         spawn();
+         return;
+      }
+
+      if( _idle != 0 )
+      {
+         return;
+      }
+
+      if( (_blocked == 0) && (_queue.head_sojourn() < _config.threads.grow_after) )
+      {
+         return;
+      }
+
+      spawn();
+   }
+
+   // Requests queued while every worker is busy only wait long enough to warrant another worker some
+   // time later, when there may be no push or pop to notice. Elastic pools check every so often
+   void start_watcher()
+   {
+      if( _config.threads.min < _config.threads.max )
+      {
+         _watcher = std::thread( &worker_pool::watch, this );
+      }
+   }
+
+   void watch()
+   {
+      std::chrono::microseconds const period = std::min( std::max( _config.threads.grow_after, std::chrono::microseconds( 1000 ) ),
+                                                         std::chrono::microseconds( 100000 ) );
+      std::unique_lock<std::mutex> lck(_watcher_mutex);
+      while( _keep_running )
+      {
+         _watcher_cv.wait_for( lck, period );
+         lck.unlock();
+         maybe_grow();
+         lck.lock();
+      }
+   }
+
+   void spawn()
+   {
+      std::unique_lock<std::mutex> lck(_threads_mutex);
+      if( !_keep_running || (_running >= _config.threads.max) )
+      {
+         return;
+      }
+
+      reap_retired();
+
+      // Counted as idle right away, so that concurrent callers of maybe_grow() do not start more
+      ++_running;
+      ++_idle;
+      ++_spawned;
+      _threads.emplace_back( &worker_pool::work, this, true );
+   }
+
+   // Must be called with _threads_mutex held
+   void reap_retired()
+   {
+      for( auto const & id : _retired_ids )
+      {
+         for( auto it = _threads.begin(); it != _threads.end(); ++it )
+         {
+            if( it->get_id() == id )
+            {
+               it->join();
+               _threads.erase( it );
+               break;
+            }
+         }
+      }
+      _retired_ids.clear();
+   }
+
+   // Whether an idle worker may exit. Only threads owned by the pool do, and never below the minimum
+   bool try_retire()
+   {
+      std::unique_lock<std::mutex> lck(_threads_mutex);
+      if( _running <= _config.threads.min )
+      {
+         return false;
+      }
+
+      --_running;
+      --_idle;
+      ++_retired;
+      _retired_ids.push_back( std::this_thread::get_id() );
+      _placed.erase( current_tid() );
+      return true;
+   }
+
+   // Pins the calling worker to the next CPU of the set, before it allocates anything, and records
+   // where it ended up. Returns its tid
+   int place()
+   {
+      std::unique_lock<std::mutex> lck(_threads_mutex);
+      if( !_cpus.empty() )
+      {
+         pin_thread( pthread_self(), std::vector<int>( 1, _cpus[_next_cpu++ % _cpus.size()] ) );
+      }
+      int const tid = current_tid();
+      _placed[tid] = describe_thread( _config.name, pthread_self(), tid );
+      return tid;
+   }
+
+   void work( bool const own_thread )
+   {
+      detail::blocking_aware::current() = this;
+      if( own_thread )
+      {
+         tracer::set_thread_name( _config.name.c_str() );
+      }
+      int const tid = place();
+      clock::time_point idle_since = clock::now();
+
+      for( ;; )
+      {
+         if( !_keep_running )
+         {
+            std::unique_lock<std::mutex> lck(_threads_mutex);
+            --_running;
+            --_idle;
+            _placed.erase( tid );
+            break;
+         }
+
+         T item;
+         pop_status const status = _queue.pop( item );
+         if( status == pop_status::empty )
+         {
+            if( own_thread && ((clock::now() - idle_since) >= _config.threads.idle_timeout) && try_retire() )
+            {
+               break;
+            }
+            continue;
+         }
+
+         --_idle;
+         maybe_grow();
+
+         clock::time_point const begin = clock::now();
+         try
+         {
+            _handler( item, status == pop_status::shed );
+         }
+         catch( std::exception const & e )
+         {  // Losing one request beats losing the process
+            RPC_LOG( error, "worker_pool %s: request dropped (%s)", _config.name.c_str(), e.what() );
+         }
+         idle_since = clock::now();
+         _busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>( idle_since - begin ).count();
+         ++_executed;
+
+         ++_idle;
+      }
+
+      detail::blocking_aware::current() = nullptr;
+   }
+};
+
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+namespace rpc
+{
+
+// Log-linear histogram of non-negative integer values (usually nanoseconds).
+// Each power of two is split into 2^sub_bucket_bits linear sub-buckets, so any
+// recorded value is known within ~3% (the same idea as HdrHistogram).
+//
+// record() is meant to be called by a single writer at a time (the owning
+// thread, or under a lock). It uses relaxed loads/stores instead of atomic
+// read-modify-write, so it costs the same as plain increments while still
+// allowing other threads to copy or merge a live histogram.
+class latency_histogram
+{
+public:
+   static constexpr unsigned sub_bucket_bits = 5;
+   static constexpr unsigned max_value_bits  = 40;   // ~18 minutes, when counting ns
+   static constexpr size_t   sub_buckets     = size_t(1) << sub_bucket_bits;
+   static constexpr size_t   bucket_count    = (max_value_bits - sub_bucket_bits + 1) * sub_buckets;
+   static constexpr uint64_t max_value       = (uint64_t(1) << max_value_bits) - 1;
+
+   latency_histogram()
+   {
+      reset();
+   }
+
+   latency_histogram( latency_histogram const & other )
+   {
+      reset();
+      merge( other );
+   }
+
+   latency_histogram& operator=( latency_histogram const & other )
+   {
+      if( this != &other )
+      {
+         reset();
+         merge( other );
+      }
+      return *this;
+   }
+
+   void record( uint64_t value )
+   {
+      if( value > max_value )
+      {
+         value = max_value;
+      }
+
+      increment( _buckets[index_of(value)], 1 );
+      increment( _count, 1 );
+      increment( _sum, value );
+      if( value > _max.load( std::memory_order_relaxed ) )
+      {
+         _max.store( value, std::memory_order_relaxed );
+      }
+   }
+
+   template< class Rep, class Period >
+   void record( std::chrono::duration<Rep, Period> const & value )
+   {
+      auto const ns = std::chrono::duration_cast<std::chrono::nanoseconds>( value ).count();
+      record( ns > 0 ? static_cast<uint64_t>(ns) : 0 );
+   }
+
+   // Not atomic as a whole, but each counter is read only once, so merging a
+   // histogram that is being written to yields a slightly stale but sane view.
+   void merge( latency_histogram const & other )
+   {
+      for( size_t i = 0; i < bucket_count; ++i )
+      {
+         uint64_t const n = other._buckets[i].load( std::memory_order_relaxed );
+         if( n != 0 )
+         {
+            increment( _buckets[i], n );
+         }
+      }
+      increment( _count, other._count.load( std::memory_order_relaxed ) );
+      increment( _sum, other._sum.load( std::memory_order_relaxed ) );
+      uint64_t const other_max = other._max.load( std::memory_order_relaxed );
+      if( other_max > _max.load( std::memory_order_relaxed ) )
+      {
+         _max.store( other_max, std::memory_order_relaxed );
+      }
+   }
+
+   void reset()
+   {
+      for( auto& b : _buckets )
+      {
+         b.store( 0, std::memory_order_relaxed );
+      }
+      _count.store( 0, std::memory_order_relaxed );
+      _sum.store( 0, std::memory_order_relaxed );
+      _max.store( 0, std::memory_order_relaxed );
+   }
+
+   uint64_t count() const { return _count.load( std::memory_order_relaxed ); }
+   uint64_t sum() const   { return _sum.load( std::memory_order_relaxed ); }
+   uint64_t max() const   { return _max.load( std::memory_order_relaxed ); }
+
+   double mean() const
+   {
+      uint64_t const n = count();
+      return n ? static_cast<double>( sum() ) / n : 0.0;
+   }
+
+   // Value below which the given percentage (0-100) of the samples fall,
+   // reported as the upper edge of the containing bucket.
+   uint64_t percentile( double p ) const
+   {
+      uint64_t const total = count();
+      if( total == 0 )
+      {
+         return 0;
+      }
+
+      uint64_t target = static_cast<uint64_t>( (p / 100.0) * total + 0.5 );
+      if( target < 1 )
+      {
+         target = 1;
+      }
+
+      uint64_t seen = 0;
+      for( size_t i = 0; i < bucket_count; ++i )
+      {
+         seen += _buckets[i].load( std::memory_order_relaxed );
+         if( seen >= target )
+         {
+            uint64_t const high = highest_of( i );
+            uint64_t const top  = max();
+            return high < top ? high : top;
+         }
+      }
+      return max();
+   }
+
+private:
+   std::array<std::atomic<uint64_t>, bucket_count> _buckets;
+   std::atomic<uint64_t> _count;
+   std::atomic<uint64_t> _sum;
+   std::atomic<uint64_t> _max;
+
+   static inline void increment( std::atomic<uint64_t> & counter, uint64_t n )
+   {
+      counter.store( counter.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+   }
+
+   static inline size_t index_of( uint64_t value )
+   {
+      if( value < sub_buckets )
+      {
+         return static_cast<size_t>( value );
+      }
+
+      unsigned const msb   = 63 - __builtin_clzll( value );
+      unsigned const shift = msb - sub_bucket_bits;
+      return (shift + 1) * sub_buckets + static_cast<size_t>( (value >> shift) - sub_buckets );
+   }
+
+   static inline uint64_t highest_of( size_t index )
+   {
+      if( index < sub_buckets )
+      {
+         return index;
+      }
+
+      unsigned const shift = static_cast<unsigned>( index / sub_buckets ) - 1;
+      uint64_t const sub   = (index % sub_buckets) + sub_buckets;
+      return ((sub + 1) << shift) - 1;
+   }
+};
+
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// The io_uring backend needs the multishot recv and provided buffer ring definitions of Linux 6.0
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_FEAT_EXT_ARG)
+#define RPC_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifndef RPC_HAVE_IO_URING
+#define RPC_HAVE_IO_URING 0
+#endif
+
+namespace rpc
+{
+
+// How a transport waits for its sockets. io_uring falls back to poll when the
+// kernel (or a seccomp policy) does not support it
+enum class io_backend
+{
+   poll,
+   io_uring
+};
+
+#if RPC_HAVE_IO_URING
+
+// Just enough of io_uring for the transports, on the raw system calls so that
+// liburing is not needed. Not thread safe: one thread submits and reaps.
+class uring
+{
+public:
+   explicit uring( unsigned const entries )
+   {
+      struct io_uring_params params;
+      memset( &params, 0, sizeof(params) );
+      params.flags = IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL;   // Submit whole chains even if one fails early
+
+      _fd = static_cast<int>( syscall( __NR_io_uring_setup, entries, &params ) );
+      if( _fd < 0 )
+      {
+         throw std::system_error( errno, std::generic_category(), "io_uring_setup" );
+      }
+
+      unsigned const required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+      if( (params.features & required) != required )
+      {
+         close( _fd );
+         throw std::runtime_error( "io_uring: kernel lacks required features" );
+      }
+
+      _ring_size = std::max( params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                             params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) );
+      _ring = mmap( nullptr, _ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING );
+      _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+      void * sqes = mmap( nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES );
+      if( (_ring == MAP_FAILED) || (sqes == MAP_FAILED) )
+      {
+         int const err = errno;
+         if( _ring != MAP_FAILED ) munmap( _ring, _ring_size );
+         if( sqes != MAP_FAILED ) munmap( sqes, _sqes_size );
+         close( _fd );
+         throw std::system_error( err, std::generic_category(), "io_uring: mmap" );
+      }
+
+      char * base = static_cast<char *>( _ring );
+      _sq_head = reinterpret_cast<unsigned *>( base + params.sq_off.head );
+      _sq_tail = reinterpret_cast<unsigned *>( base + params.sq_off.tail );
+      _sq_mask = *reinterpret_cast<unsigned *>( base + params.sq_off.ring_mask );
+      _sq_entries = params.sq_entries;
+      _sq_array = reinterpret_cast<unsigned *>( base + params.sq_off.array );
+      _sqes = static_cast<struct io_uring_sqe *>( sqes );
+      _cq_head = reinterpret_cast<unsigned *>( base + params.cq_off.head );
+      _cq_tail = reinterpret_cast<unsigned *>( base + params.cq_off.tail );
+      _cq_mask = *reinterpret_cast<unsigned *>( base + params.cq_off.ring_mask );
+      _cqes = reinterpret_cast<struct io_uring_cqe *>( base + params.cq_off.cqes );
+
+      for( unsigned i = 0; i < _sq_entries; ++i )
+      {  // SQEs are always used in ring order
+         _sq_array[i] = i;
+      }
+      _sqe_tail = *_sq_tail;
+   }
+
+   uring( uring const & ) = delete;
+   uring& operator=( uring const & ) = delete;
+
+   ~uring()
+   {
+      munmap( _sqes, _sqes_size );
+      munmap( _ring, _ring_size );
+      close( _fd );
+   }
+
+   int fd() const
+   {
+      return _fd;
+   }
+
+   // Whether the kernel knows opcode
+   bool supports( uint8_t const opcode ) const
+   {
+      size_t const size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+      std::unique_ptr<char[]> buffer( new char[size]() );
+      auto probe = reinterpret_cast<struct io_uring_probe *>( buffer.get() );
+      if( syscall( __NR_io_uring_register, _fd, IORING_REGISTER_PROBE, probe, 256 ) < 0 )
+      {
+         return false;
+      }
+      return (opcode <= probe->last_op) && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+   }
+
+   // Free submission slots
+   unsigned space() const
+   {
+      return _sq_entries - (_sqe_tail - __atomic_load_n( _sq_head, __ATOMIC_ACQUIRE ));
+   }
+
+   // A zeroed submission, or nullptr if the queue is full
+   struct io_uring_sqe * get_sqe()
+   {
+      if( space() == 0 )
+      {
+         return nullptr;
+      }
+      struct io_uring_sqe * sqe = &_sqes[_sqe_tail & _sq_mask];
+      memset( sqe, 0, sizeof(*sqe) );
+      ++_sqe_tail;
+      return sqe;
+   }
+
+   // Submits what was queued and waits for at least wait_nr completions, or until timeout_ms.
+   // Returns false on timeout or signal, throws on errors
+   bool submit_and_wait( unsigned const wait_nr, int const timeout_ms = -1 )
+   {
+      unsigned const to_submit = _sqe_tail - __atomic_load_n( _sq_tail, __ATOMIC_RELAXED );
+      __atomic_store_n( _sq_tail, _sqe_tail, __ATOMIC_RELEASE );
+
+      unsigned flags = (wait_nr != 0) ? IORING_ENTER_GETEVENTS : 0;
+      struct __kernel_timespec ts;
+      struct io_uring_getevents_arg arg;
+      memset( &arg, 0, sizeof(arg) );
+      arg.sigmask_sz = _NSIG / 8;
+      if( (wait_nr != 0) && (timeout_ms >= 0) )
+      {
+         ts.tv_sec = timeout_ms / 1000;
+         ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+         arg.ts = reinterpret_cast<uint64_t>( &ts );
+      }
+      flags |= IORING_ENTER_EXT_ARG;
+
+      if( syscall( __NR_io_uring_enter, _fd, to_submit, wait_nr, flags, &arg, sizeof(arg) ) < 0 )
+      {
+         if( (errno == ETIME) || (errno == EINTR) || (errno == EBUSY) || (errno == EAGAIN) )
+         {  // EBUSY and EAGAIN: completions to reap first
+            return false;
+         }
+         throw std::system_error( errno, std::generic_category(), "io_uring_enter" );
+      }
+      return true;
+   }
+
+   // Calls handler( io_uring_cqe const & ) for every completion available
+   template< class Handler >
+   unsigned for_each_cqe( Handler && handler )
+   {
+      unsigned head = *_cq_head;
+      unsigned const tail = __atomic_load_n( _cq_tail, __ATOMIC_ACQUIRE );
+      unsigned count = 0;
+      for( ; head != tail; ++head, ++count )
+      {
+         handler( _cqes[head & _cq_mask] );
+      }
+      __atomic_store_n( _cq_head, head, __ATOMIC_RELEASE );
+      return count;
+   }
+
+private:
+   int _fd;
+   void * _ring;
+   size_t _ring_size;
+   size_t _sqes_size;
+   unsigned * _sq_head;
+   unsigned * _sq_tail;
+   unsigned _sq_mask;
+   unsigned _sq_entries;
+   unsigned * _sq_array;
+   struct io_uring_sqe * _sqes;
+   unsigned _sqe_tail;
+   unsigned * _cq_head;
+   unsigned * _cq_tail;
+   unsigned _cq_mask;
+   struct io_uring_cqe * _cqes;
+};
+
+// Receive buffers the kernel picks from as data arrives (IOSQE_BUFFER_SELECT),
+// so that idle connections do not each hold a buffer of their own
+class buffer_ring
+{
+public:
+   // count must be a power of two
+   buffer_ring( uring & ring, uint16_t const group, unsigned const count, size_t const size ) :
+      _ring_fd( ring.fd() ), _group( group ), _count( count ), _size( size )
+   {
+      _ring_bytes = count * sizeof(struct io_uring_buf);
+      void * mem = mmap( nullptr, _ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+      if( mem == MAP_FAILED )
+      {
+         throw std::system_error( errno, std::generic_category(), "io_uring: buffer ring mmap" );
+      }
+      _bufs = static_cast<struct io_uring_buf_ring *>( mem );
+      memset( mem, 0, _ring_bytes );
+
+      struct io_uring_buf_reg reg;
+      memset( &reg, 0, sizeof(reg) );
+      reg.ring_addr = reinterpret_cast<uint64_t>( _bufs );
+      reg.ring_entries = count;
+      reg.bgid = group;
+      if( syscall( __NR_io_uring_register, _ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+      {
+         int const err = errno;
+         munmap( mem, _ring_bytes );
+         throw std::system_error( err, std::generic_category(), "io_uring: register buffer ring" );
+      }
+
+      _data.reset( new char[count * size] );
+      for( unsigned i = 0; i < count; ++i )
+      {
+         add( static_cast<uint16_t>( i ) );
+      }
+      publish();
+   }
+
+   buffer_ring( buffer_ring const & ) = delete;
+   buffer_ring& operator=( buffer_ring const & ) = delete;
+
+   ~buffer_ring()
+   {
+      struct io_uring_buf_reg reg;
+      memset( &reg, 0, sizeof(reg) );
+      reg.bgid = _group;
+      syscall( __NR_io_uring_register, _ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1 );
+      munmap( _bufs, _ring_bytes );
+   }
+
+   uint16_t group() const
+   {
+      return _group;
+   }
+
+   char const * buffer( uint16_t const id ) const
+   {
+      return &_data[static_cast<size_t>( id ) * _size];
+   }
+
+   // Hands a buffer the kernel filled back to it
+   void recycle( uint16_t const id )
+   {
+      add( id );
+      publish();
+   }
+
+private:
+   int _ring_fd;
+   uint16_t _group;
+   unsigned _count;
+   size_t _size;
+   size_t _ring_bytes;
+   struct io_uring_buf_ring * _bufs;
+   std::unique_ptr<char[]> _data;
+   uint16_t _tail = 0;
+
+   void add( uint16_t const id )
+   {
+      // Not _bufs->bufs: in C++ the flexible array of the kernel header comes after an empty struct of size one
+      struct io_uring_buf & buf = reinterpret_cast<struct io_uring_buf *>( _bufs )[_tail & (_count - 1)];
+      buf.addr = reinterpret_cast<uint64_t>( &_data[static_cast<size_t>( id ) * _size] );
+      buf.len = static_cast<uint32_t>( _size );
+      buf.bid = id;
+      ++_tail;
+   }
+
+   void publish()
+   {
+      __atomic_store_n( &_bufs->tail, _tail, __ATOMIC_RELEASE );
+   }
+};
+
+#endif
+
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "rpc/histogram.hpp"
+#include "rpc/tsc.hpp"
+
+namespace rpc
+{
+
+// Points a request goes through on the server, in order
+enum class stage : uint8_t
+{
+   received      = 0,   // Unpacked by the transport thread
+   enqueued      = 1,   // Pushed to its executor's queue
+   dequeued      = 2,   // Picked up by a worker
+   handler_start = 3,   // Envelope and arguments unpacked, handler called
+   handler_end   = 4,   // Handler returned (or threw)
+   serialized    = 5,   // Response packed
+   sent          = 6    // Last byte of the response written to the socket
+};
+
+constexpr size_t stage_count = 7;
+constexpr size_t interval_count = stage_count - 1;
+
+// Name of the interval ending at stage index + 1
+inline char const * interval_name( size_t const index )
+{
+   static char const * const names[interval_count] = { "dispatch", "queue", "decode", "handler", "serialize", "send" };
+   return index < interval_count ? names[index] : "unknown";
+}
+
+// tsc_clock ticks of every stage a request went through, 0 for the ones it did not
+struct request_timestamps
+{
+   std::array<uint64_t, stage_count> ticks{};
+   bool sampled = false;   // Keep a per-request breakdown of this one
+
+   inline void stamp( stage const s )
+   {
+      ticks[static_cast<size_t>(s)] = tsc_clock::ticks();
+   }
+
+   inline uint64_t at( stage const s ) const
+   {
+      return ticks[static_cast<size_t>(s)];
+   }
+
+   // Nanoseconds spent in the interval ending at stage index + 1
+   inline uint64_t interval_ns( size_t const index ) const
+   {
+      return tsc_clock::elapsed_ns( ticks[index], ticks[index + 1] );
+   }
+};
+
+// Where the time of one sampled request went
+struct request_breakdown
+{
+   std::string method;
+   uint32_t msgid = 0;
+   std::array<uint64_t, interval_count> ns{};   // Indexed like interval_name()
+};
+
+// Time spent in each interval, over all requests served
+struct stage_stats
+{
+   std::array<latency_histogram, interval_count> intervals;
+};
+
+};
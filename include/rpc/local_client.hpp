@@ -0,0 +1,228 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
+#include "msgpack.hpp"
+#include "rpc/server.hpp"
+
+namespace rpc
+{
+
+// Calls the methods bound to a server in the same process, on the caller's thread, with the same
+// interface as rpc::client. Modules that are deployed either together or apart talk the same way in
+// both cases, and tests and benchmarks get a baseline without any network in the way.
+//
+// mode::direct hands the C++ arguments to the bound function as they are, nothing is serialized.
+// That needs the decayed argument and result types to be exactly those the method was bound with
+// (a string literal is not a std::string, an int is not an unsigned). Calls that don't match, and
+// bind_batch() methods, are serialized instead.
+// mode::serialized always packs arguments and results like a remote call would, which checks the
+// msgpack adaptors of a service without sockets.
+//
+// Exceptions thrown by a method come back as std::runtime_error, as from a remote server. Calls
+// count in the server metrics and the profiler, but skip request queues and executors, so the
+// priority is ignored.
+class local_client
+{
+public:
+   enum class mode
+   {
+      direct,
+      serialized
+   };
+
+   explicit local_client( server & srv, mode const m = mode::direct ) : _server( srv ), _mode( m )
+   {
+   }
+
+   // The future is ready on return
+   template< class ret_t, class... Args >
+   std::future<ret_t> async_call( std::string const & method, Args&&... args )
+   {
+      std::promise<ret_t> result;
+      try
+      {
+         fulfil( result, [&]() { return call<ret_t>( method, std::forward<Args>(args)... ); } );
+      }
+      catch(...)
+      {
+         result.set_exception( std::current_exception() );
+      }
+      return result.get_future();
+   }
+
+   template< class ret_t, class... Args >
+   std::future<ret_t> async_call( priority const, std::string const & method, Args&&... args )
+   {
+      return async_call<ret_t>( method, std::forward<Args>(args)... );
+   }
+
+   template< class ret_t, class... Args >
+   ret_t call( std::string const & method, Args&&... args )
+   {
+      using params_type = std::tuple<typename std::decay<Args>::type...>;
+      using direct_type = std::function< ret_t ( params_type & ) >;
+
+      server::method_entry const & entry = find( method );
+      if( (_mode == mode::direct) && (entry.direct_type != nullptr) && (*entry.direct_type == typeid(direct_type)) )
+      {
+         params_type params( std::forward<Args>(args)... );
+         return call_direct( entry, *static_cast<direct_type const *>( entry.direct.get() ), params );
+      }
+      return call_serialized<ret_t>( entry, std::make_tuple( std::forward<Args>(args)... ) );
+   }
+
+   template< class ret_t, class... Args >
+   ret_t call( priority const, std::string const & method, Args&&... args )
+   {
+      return call<ret_t>( method, std::forward<Args>(args)... );
+   }
+
+private:
+   server & _server;
+   mode const _mode;
+
+   // Accounts for one call the way the server does for remote ones
+   class call_scope
+   {
+   public:
+      call_scope( server & srv, server::method_entry const & entry, size_t const bytes_in ) :
+         _server( srv ), _entry( entry ), _bytes_in( bytes_in ),
+         _begin( std::chrono::steady_clock::now() ),
+         _accounting( srv._resource_accounting ),
+         _usage_before( _accounting ? resource_usage::current() : resource_usage() ),
+         _profiled( entry.name.c_str() )
+      {
+      }
+
+      call_scope( call_scope const & ) = delete;
+      call_scope& operator=( call_scope const & ) = delete;
+
+      ~call_scope()
+      {
+         if( _accounting )
+         {
+            _server._metrics.record_usage( _entry.metrics_index, resource_usage::current() - _usage_before );
+         }
+         auto const elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - _begin ).count();
+         _server._metrics.record( _entry.metrics_index, failed, _bytes_in, bytes_out, elapsed > 0 ? elapsed : 0 );
+      }
+
+      bool failed = false;
+      size_t bytes_out = 0;
+
+   private:
+      server & _server;
+      server::method_entry const & _entry;
+      size_t const _bytes_in;
+      std::chrono::steady_clock::time_point const _begin;
+      bool const _accounting;
+      resource_usage const _usage_before;
+      profiler::method_scope const _profiled;
+   };
+
+   server::method_entry const & find( std::string const & method ) const
+   {
+      auto const it = _server._binded_funcs.find( method );
+      if( it == _server._binded_funcs.end() )
+      {
+         throw std::runtime_error( "Method " + method + " not bound" );
+      }
+      return it->second;
+   }
+
+   template< class ret_t, class Params >
+   ret_t call_direct( server::method_entry const & entry, std::function< ret_t ( Params & ) > const & func, Params & params )
+   {
+      call_scope scope( _server, entry, 0 );
+      try
+      {
+         return func( params );
+      }
+      catch( std::exception const & e )
+      {  // Callers must not depend on the exception type, they could not with a remote server
+         scope.failed = true;
+         throw std::runtime_error( e.what() );
+      }
+      catch(...)
+      {
+         scope.failed = true;
+         throw;
+      }
+   }
+
+   template< class ret_t, class Params >
+   ret_t call_serialized( server::method_entry const & entry, Params const & params )
+   {
+      pack_buffer request;
+      msgpack::pack( request, params );
+      msgpack::object_handle const params_hndl = msgpack::unpack( request.data(), request.size() );
+
+      pack_buffer error_data;
+      pack_buffer result_data;
+      {
+         call_scope scope( _server, entry, request.size() );
+         if( entry.batch_caller )
+         {
+            std::vector<server::batch_call> calls( 1 );
+            calls[0].params = params_hndl.get();
+            entry.batch_caller( calls );
+            error_data = std::move( calls[0].error );
+            result_data = std::move( calls[0].result );
+         }
+         else
+         {
+            try
+            {
+               result_data = entry.caller( params_hndl.get() );
+            }
+            catch(...)
+            {
+               error_data = _server.handle_exception( std::current_exception() );
+            }
+         }
+         scope.failed = !error_data.empty();
+         scope.bytes_out = error_data.size() + result_data.size();
+      }
+
+      if( !error_data.empty() )
+      {
+         msgpack::object_handle const hndl = msgpack::unpack( error_data.data(), error_data.size() );
+         throw std::runtime_error( hndl.get().as<std::string>() );
+      }
+      return unpack_result<ret_t>( result_data );
+   }
+
+   template< class ret_t >
+   static typename std::enable_if< !std::is_void<ret_t>::value, ret_t >::type unpack_result( pack_buffer const & result )
+   {
+      msgpack::object_handle const hndl = msgpack::unpack( result.data(), result.size() );
+      return hndl.get().as<ret_t>();
+   }
+
+   template< class ret_t >
+   static typename std::enable_if< std::is_void<ret_t>::value >::type unpack_result( pack_buffer const & )
+   {
+   }
+
+   template< class ret_t, class Fn >
+   static void fulfil( std::promise<ret_t> & result, Fn && fn )
+   {
+      result.set_value( fn() );
+   }
+
+   template< class Fn >
+   static void fulfil( std::promise<void> & result, Fn && fn )
+   {
+      fn();
+      result.set_value();
+   }
+};
+
+};
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "rpc/tsc.hpp"
+
+// Messages below this level are compiled out: 0 trace, 1 debug, 2 info, 3 warning, 4 error
+#ifndef RPC_LOG_MIN_LEVEL
+#define RPC_LOG_MIN_LEVEL 1
+#endif
+
+namespace rpc
+{
+
+enum class log_level : uint8_t
+{
+   trace   = 0,
+   debug   = 1,
+   info    = 2,
+   warning = 3,
+   error   = 4,
+   off     = 5
+};
+
+inline char const * log_level_name( log_level const level )
+{
+   static char const * const names[] = { "trace", "debug", "info", "warning", "error", "off" };
+   return names[static_cast<size_t>(level) < 6 ? static_cast<size_t>(level) : 5];
+}
+
+// Rate limiting state of one logging statement, see RPC_LOG
+struct log_site
+{
+   std::atomic<uint64_t> window{ 0 };      // Second the count below belongs to
+   std::atomic<uint32_t> count{ 0 };
+   std::atomic<uint32_t> suppressed{ 0 };
+};
+
+// Logging that never blocks the caller. Messages are formatted into a ring of
+// the calling thread and written to the sink by a background thread, so a fault
+// storm on many threads does not serialize them on a stream lock. If a ring is
+// full the message is dropped and counted instead. Every logging statement
+// passes at most max_per_second messages per second, the rest are counted and
+// reported with the next one that gets through.
+class logger
+{
+public:
+   using sink_type = std::function< void ( log_level, char const * ) >;
+
+   static constexpr size_t ring_capacity = 256;     // Messages per thread
+   static constexpr size_t max_message = 240;       // Longer ones are truncated
+
+   static void set_level( log_level const level )
+   {
+      instance().level.store( level, std::memory_order_relaxed );
+   }
+
+   static bool enabled( log_level const level )
+   {
+      return level >= instance().level.load( std::memory_order_relaxed );
+   }
+
+   // Called from the background thread only, one message at a time. Defaults to stderr
+   static void set_sink( sink_type sink )
+   {
+      shared_state & st = instance();
+      std::unique_lock<std::mutex> lck(st.drain_mutex);
+      st.sink = std::move( sink );
+   }
+
+   static void set_max_per_second( uint32_t const n )
+   {
+      instance().max_per_second.store( n, std::memory_order_relaxed );
+   }
+
+   // Messages lost to full rings so far
+   static uint64_t dropped()
+   {
+      return instance().dropped.load( std::memory_order_relaxed );
+   }
+
+   // Writes out everything logged so far. Blocks, meant for shutdown and tests
+   static void flush()
+   {
+      drain( instance() );
+   }
+
+   static void write( log_site & site, log_level const level, char const * format, ... ) __attribute__(( format( printf, 3, 4 ) ))
+   {
+      shared_state & st = instance();
+      if( !enabled( level ) )
+      {
+         return;
+      }
+
+      uint32_t const suppressed = rate_limit( st, site );
+      if( suppressed == UINT32_MAX )
+      {
+         return;
+      }
+
+      ring * r = local_ring();
+      uint64_t const head = r->head.load( std::memory_order_relaxed );
+      if( head - r->tail.load( std::memory_order_acquire ) >= ring_capacity )
+      {
+         st.dropped.fetch_add( 1, std::memory_order_relaxed );
+         return;
+      }
+
+      entry & e = r->entries[head % ring_capacity];
+      e.level = level;
+      e.ticks = tsc_clock::ticks();
+
+      va_list args;
+      va_start( args, format );
+      int len = vsnprintf( e.text, sizeof(e.text), format, args );
+      va_end( args );
+
+      if( (suppressed != 0) && (len >= 0) && (static_cast<size_t>(len) < sizeof(e.text)) )
+      {
+         snprintf( e.text + len, sizeof(e.text) - len, " (%u similar messages suppressed)", suppressed );
+      }
+
+      r->head.store( head + 1, std::memory_order_release );
+   }
+
+private:
+   struct entry
+   {
+      uint64_t ticks;
+      log_level level;
+      char text[max_message];
+   };
+
+   // Single producer (the owning thread), single consumer (whoever holds drain_mutex)
+   struct ring
+   {
+      std::atomic<uint64_t> head{ 0 };
+      std::atomic<uint64_t> tail{ 0 };
+      std::atomic<bool> in_use{ true };
+      entry entries[ring_capacity];
+   };
+
+   struct shared_state
+   {
+      std::atomic<log_level> level{ log_level::info };
+      std::atomic<uint32_t> max_per_second{ 10 };
+      std::atomic<uint64_t> dropped{ 0 };
+
+      std::mutex rings_mutex;
+      std::vector<ring*> rings;   // Never freed, a thread that exits hands its ring over to the next new one
+
+      std::mutex drain_mutex;
+      sink_type sink;
+   };
+
+   struct ring_owner
+   {
+      ring * r = nullptr;
+
+      ~ring_owner()
+      {
+         if( r != nullptr )
+         {
+            r->in_use.store( false, std::memory_order_release );
+         }
+      }
+   };
+
+   // Never destroyed, so that logging from static destructors still works. What is pending at exit
+   // gets written by an atexit() handler
+   static shared_state & instance()
+   {
+      static shared_state * st = start();
+      return *st;
+   }
+
+   static shared_state * start()
+   {
+      shared_state * st = new shared_state();
+      st->sink = []( log_level level, char const * text )
+      {
+         fprintf( stderr, "[rpc %s] %s\n", log_level_name( level ), text );
+      };
+
+      std::thread( [st]()
+      {
+         for( ;; )
+         {
+            std::this_thread::sleep_for( std::chrono::milliseconds(10) );
+            drain( *st );
+         }
+      } ).detach();
+
+      std::atexit( []{ logger::flush(); } );
+      return st;
+   }
+
+   static ring * local_ring()
+   {
+      static thread_local ring_owner owner;
+      if( owner.r == nullptr )
+      {
+         shared_state & st = instance();
+         std::unique_lock<std::mutex> lck(st.rings_mutex);
+         for( auto it : st.rings )
+         {
+            bool expected = false;
+            if( it->in_use.compare_exchange_strong( expected, true ) )
+            {  // Whatever the previous owner left is still drained in order
+               owner.r = it;
+               return it;
+            }
+         }
+         owner.r = new ring();
+         st.rings.push_back( owner.r );
+      }
+      return owner.r;
+   }
+
+   // Returns how many messages of the site were suppressed before this one, or UINT32_MAX to
+   // suppress this one too
+   static uint32_t rate_limit( shared_state & st, log_site & site )
+   {
+      uint32_t const limit = st.max_per_second.load( std::memory_order_relaxed );
+      if( limit == 0 )
+      {
+         return 0;
+      }
+
+      uint64_t const second = tsc_clock::monotonic_ns() / 1000000000u;
+      uint64_t window = site.window.load( std::memory_order_relaxed );
+      if( (window != second) && site.window.compare_exchange_strong( window, second, std::memory_order_relaxed ) )
+      {
+         site.count.store( 0, std::memory_order_relaxed );
+      }
+
+      if( site.count.fetch_add( 1, std::memory_order_relaxed ) >= limit )
+      {
+         site.suppressed.fetch_add( 1, std::memory_order_relaxed );
+         return UINT32_MAX;
+      }
+      return site.suppressed.exchange( 0, std::memory_order_relaxed );
+   }
+
+   static void drain( shared_state & st )
+   {
+      std::unique_lock<std::mutex> drain_lck(st.drain_mutex);
+
+      std::vector<ring*> rings;
+      {
+         std::unique_lock<std::mutex> lck(st.rings_mutex);
+         rings = st.rings;
+      }
+
+      // Merged by time, so that messages of different threads come out in order
+      std::vector<std::pair<uint64_t, entry const *>> pending;
+      std::vector<std::pair<ring*, uint64_t>> consumed;
+      for( auto r : rings )
+      {
+         uint64_t const tail = r->tail.load( std::memory_order_relaxed );
+         uint64_t const head = r->head.load( std::memory_order_acquire );
+         for( uint64_t i = tail; i < head; ++i )
+         {
+            entry const & e = r->entries[i % ring_capacity];
+            pending.emplace_back( e.ticks, &e );
+         }
+         consumed.emplace_back( r, head );
+      }
+
+      std::stable_sort( pending.begin(), pending.end(), []( std::pair<uint64_t, entry const *> const & a, std::pair<uint64_t, entry const *> const & b )
+      {
+         return a.first < b.first;
+      } );
+
+      for( auto const & it : pending )
+      {
+         if( st.sink )
+         {
+            st.sink( it.second->level, it.second->text );
+         }
+      }
+
+      for( auto const & it : consumed )
+      {
+         it.first->tail.store( it.second, std::memory_order_release );
+      }
+   }
+};
+
+};
+
+// Logs a printf-style message at the given level (without the log_level:: prefix), e.g.
+// RPC_LOG( warning, "poll timeout on fd %d", fd ). Compiled out below RPC_LOG_MIN_LEVEL
+#define RPC_LOG( level, ... )                                                                      \
+   do                                                                                              \
+   {                                                                                               \
+      if( static_cast<int>( rpc::log_level::level ) >= RPC_LOG_MIN_LEVEL )                         \
+      {                                                                                            \
+         static rpc::log_site rpc_log_site_;                                                       \
+         rpc::logger::write( rpc_log_site_, rpc::log_level::level, __VA_ARGS__ );                  \
+      }                                                                                            \
+   } while( false )
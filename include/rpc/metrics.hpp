@@ -0,0 +1,267 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <msgpack.hpp>
+#include "rpc/histogram.hpp"
+#include "rpc/lifecycle.hpp"
+#include "rpc/resources.hpp"
+
+namespace rpc
+{
+
+// Counters of one bound method, merged over all threads
+struct method_stats
+{
+   std::string method;
+   uint64_t calls = 0;
+   uint64_t errors = 0;         // Answered with an exception, rejected and shed calls included
+   uint64_t bytes_in = 0;       // Packed arguments
+   uint64_t bytes_out = 0;      // Packed result or exception
+   latency_histogram latency;   // From a worker picking up the call to its response being posted, in ns
+
+   // Only counted while server::set_resource_accounting( true ), for the calls in accounted_calls
+   uint64_t accounted_calls = 0;
+   uint64_t cpu_ns = 0;         // On-CPU time of the handler calls, packing their results included
+   uint64_t alloc_bytes = 0;    // Allocated by the handler calls, see allocation_counter
+   uint64_t allocs = 0;
+};
+
+// Wire form of method_stats, returned by the built-in "__stats" method:
+// client.call<std::vector<rpc::method_summary>>( "__stats" )
+struct method_summary
+{
+   method_summary() = default;
+   explicit method_summary( method_stats const & s ) :
+      method( s.method ), calls( s.calls ), errors( s.errors ), bytes_in( s.bytes_in ), bytes_out( s.bytes_out ),
+      mean_ns( static_cast<uint64_t>( s.latency.mean() ) ), p50_ns( s.latency.percentile( 50 ) ), p90_ns( s.latency.percentile( 90 ) ),
+      p99_ns( s.latency.percentile( 99 ) ), p999_ns( s.latency.percentile( 99.9 ) ), max_ns( s.latency.max() ),
+      accounted_calls( s.accounted_calls ), cpu_ns( s.cpu_ns ), alloc_bytes( s.alloc_bytes ), allocs( s.allocs ) {}
+
+   std::string method;
+   uint64_t calls = 0;
+   uint64_t errors = 0;
+   uint64_t bytes_in = 0;
+   uint64_t bytes_out = 0;
+   uint64_t mean_ns = 0;
+   uint64_t p50_ns = 0;
+   uint64_t p90_ns = 0;
+   uint64_t p99_ns = 0;
+   uint64_t p999_ns = 0;
+   uint64_t max_ns = 0;
+   uint64_t accounted_calls = 0;
+   uint64_t cpu_ns = 0;
+   uint64_t alloc_bytes = 0;
+   uint64_t allocs = 0;
+
+   MSGPACK_DEFINE_MAP( method, calls, errors, bytes_in, bytes_out, mean_ns, p50_ns, p90_ns, p99_ns, p999_ns, max_ns,
+                       accounted_calls, cpu_ns, alloc_bytes, allocs );
+};
+
+// Per-method counters and request lifecycle intervals, sharded by thread.
+// Every thread that records gets a shard of its own, on its own cache lines,
+// and only ever writes to it, so the hot path takes no lock and does no atomic
+// read-modify-write. Readers merge all shards, which may be slightly behind
+// the writers.
+class metrics_registry
+{
+public:
+   static constexpr size_t cache_line = 64;
+
+   metrics_registry() : _id( next_id() ) {}
+   metrics_registry( metrics_registry const & ) = delete;
+   metrics_registry& operator=( metrics_registry const & ) = delete;
+
+   // Returns the index to record() the method with
+   size_t add_method( std::string name )
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      _names.push_back( std::move(name) );
+      return _names.size() - 1;
+   }
+
+   void record( size_t const method, bool const error, uint64_t const bytes_in, uint64_t const bytes_out, uint64_t const latency_ns )
+   {
+      counters & c = local_counters( method );
+      increment( c.calls, 1 );
+      increment( c.errors, error ? 1 : 0 );
+      increment( c.bytes_in, bytes_in );
+      increment( c.bytes_out, bytes_out );
+      c.latency.record( latency_ns );
+   }
+
+   // Adds the resources used by calls calls of the method, e.g. a whole batch
+   void record_usage( size_t const method, resource_usage const & used, uint64_t const calls = 1 )
+   {
+      counters & c = local_counters( method );
+      increment( c.accounted_calls, calls );
+      increment( c.cpu_ns, used.cpu_ns );
+      increment( c.alloc_bytes, used.alloc_bytes );
+      increment( c.allocs, used.allocs );
+   }
+
+   void record_interval( size_t const index, uint64_t const ns )
+   {
+      local_shard().intervals[index].record( ns );
+   }
+
+   stage_stats stages() const
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      stage_stats ret;
+      for( auto const & it : _shards )
+      {
+         for( size_t i = 0; i < interval_count; ++i )
+         {
+            ret.intervals[i].merge( it.second->intervals[i] );
+         }
+      }
+      return ret;
+   }
+
+   std::vector<method_stats> snapshot() const
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      std::vector<method_stats> ret( _names.size() );
+      for( size_t i = 0; i < _names.size(); ++i )
+      {
+         ret[i].method = _names[i];
+      }
+
+      for( auto const & it : _shards )
+      {
+         shard const & s = *it.second;
+         for( size_t i = 0; i < s.methods.size(); ++i )
+         {
+            counters const & c = s.methods[i];
+            ret[i].calls += c.calls.load( std::memory_order_relaxed );
+            ret[i].errors += c.errors.load( std::memory_order_relaxed );
+            ret[i].bytes_in += c.bytes_in.load( std::memory_order_relaxed );
+            ret[i].bytes_out += c.bytes_out.load( std::memory_order_relaxed );
+            ret[i].latency.merge( c.latency );
+            ret[i].accounted_calls += c.accounted_calls.load( std::memory_order_relaxed );
+            ret[i].cpu_ns += c.cpu_ns.load( std::memory_order_relaxed );
+            ret[i].alloc_bytes += c.alloc_bytes.load( std::memory_order_relaxed );
+            ret[i].allocs += c.allocs.load( std::memory_order_relaxed );
+         }
+      }
+      return ret;
+   }
+
+private:
+   struct counters
+   {
+      std::atomic<uint64_t> calls{ 0 };
+      std::atomic<uint64_t> errors{ 0 };
+      std::atomic<uint64_t> bytes_in{ 0 };
+      std::atomic<uint64_t> bytes_out{ 0 };
+      latency_histogram latency;
+      std::atomic<uint64_t> accounted_calls{ 0 };
+      std::atomic<uint64_t> cpu_ns{ 0 };
+      std::atomic<uint64_t> alloc_bytes{ 0 };
+      std::atomic<uint64_t> allocs{ 0 };
+   };
+
+   struct alignas(cache_line) shard
+   {
+      std::deque<counters> methods;   // Grown by the owning thread only, under _mutex. Elements never move
+      std::array<latency_histogram, interval_count> intervals;
+
+      // Plain new ignores extended alignment before C++17
+      static void * operator new( size_t size )
+      {
+         void * ptr = nullptr;
+         if( posix_memalign( &ptr, cache_line, size ) != 0 )
+         {
+            throw std::bad_alloc();
+         }
+         return ptr;
+      }
+
+      static void operator delete( void * ptr )
+      {
+         free( ptr );
+      }
+   };
+
+   uint64_t const _id;
+   mutable std::mutex _mutex;
+   std::vector<std::string> _names;
+   std::vector<std::pair<std::thread::id, std::unique_ptr<shard>>> _shards;   // Outlive their threads, so counts are kept
+
+   static uint64_t next_id()
+   {
+      static std::atomic<uint64_t> id{ 0 };
+      return ++id;
+   }
+
+   static inline void increment( std::atomic<uint64_t> & counter, uint64_t const n )
+   {
+      counter.store( counter.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+   }
+
+   counters & local_counters( size_t const method )
+   {
+      shard & s = local_shard();
+      if( method >= s.methods.size() )
+      {  // Method added after this thread's shard was created
+         std::unique_lock<std::mutex> lck(_mutex);
+         while( s.methods.size() < _names.size() )
+         {
+            s.methods.emplace_back();
+         }
+      }
+      return s.methods[method];
+   }
+
+   // Remembers the last registry the thread recorded to. Registries are told apart by id rather
+   // than address, as a new one may be allocated where a destroyed one was
+   shard & local_shard()
+   {
+      struct cache
+      {
+         uint64_t registry = 0;
+         shard * s = nullptr;
+      };
+      static thread_local cache tls;
+
+      if( tls.registry != _id )
+      {
+         tls.s = find_shard( std::this_thread::get_id() );
+         tls.registry = _id;
+      }
+      return *tls.s;
+   }
+
+   shard * find_shard( std::thread::id const id )
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      for( auto const & it : _shards )
+      {
+         if( it.first == id )
+         {  // Either this thread switched registries, or it reuses the id of one that exited
+            return it.second.get();
+         }
+      }
+
+      std::unique_ptr<shard> s( new shard() );
+      for( size_t i = 0; i < _names.size(); ++i )
+      {
+         s->methods.emplace_back();
+      }
+      _shards.emplace_back( id, std::move(s) );
+      return _shards.back().second.get();
+   }
+};
+
+};
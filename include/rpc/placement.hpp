@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "msgpack.hpp"
+#include "rpc/log.hpp"
+
+namespace rpc
+{
+
+// NUMA nodes of the machine and their online CPUs, as sysfs shows them. A kernel without NUMA
+// shows a single node 0 with every online CPU
+struct cpu_topology
+{
+   struct node
+   {
+      int id = 0;
+      std::vector<int> cpus;
+
+      MSGPACK_DEFINE_MAP( id, cpus );
+   };
+
+   std::vector<node> nodes;
+
+   MSGPACK_DEFINE_MAP( nodes );
+
+   static cpu_topology detect()
+   {
+      cpu_topology ret;
+      if( DIR * dir = opendir( "/sys/devices/system/node" ) )
+      {
+         while( struct dirent const * entry = readdir( dir ) )
+         {
+            int id;
+            char tail;
+            if( sscanf( entry->d_name, "node%d%c", &id, &tail ) != 1 )
+            {
+               continue;
+            }
+            node n;
+            n.id = id;
+            n.cpus = parse_list( read_line( "/sys/devices/system/node/" + std::string( entry->d_name ) + "/cpulist" ) );
+            if( !n.cpus.empty() )
+            {  // Memory-only nodes have no CPU to run anything on
+               ret.nodes.push_back( std::move(n) );
+            }
+         }
+         closedir( dir );
+      }
+
+      if( ret.nodes.empty() )
+      {
+         node n;
+         n.cpus = parse_list( read_line( "/sys/devices/system/cpu/online" ) );
+         ret.nodes.push_back( std::move(n) );
+      }
+      std::sort( ret.nodes.begin(), ret.nodes.end(), []( node const & a, node const & b ){ return a.id < b.id; } );
+      return ret;
+   }
+
+   // Empty if there is no such node
+   std::vector<int> cpus_of( int const node_id ) const
+   {
+      for( auto const & n : nodes )
+      {
+         if( n.id == node_id )
+         {
+            return n.cpus;
+         }
+      }
+      return std::vector<int>();
+   }
+
+   // -1 if the CPU is not online
+   int node_of( int const cpu ) const
+   {
+      for( auto const & n : nodes )
+      {
+         if( std::find( n.cpus.begin(), n.cpus.end(), cpu ) != n.cpus.end() )
+         {
+            return n.id;
+         }
+      }
+      return -1;
+   }
+
+   // Parses the "0-3,8,10-11" form of sysfs and taskset
+   static std::vector<int> parse_list( std::string const & list )
+   {
+      std::vector<int> ret;
+      char const * p = list.c_str();
+      while( *p != '\0' )
+      {
+         char * end;
+         long const first = std::strtol( p, &end, 10 );
+         if( end == p )
+         {
+            break;
+         }
+         long last = first;
+         p = end;
+         if( *p == '-' )
+         {
+            last = std::strtol( p + 1, &end, 10 );
+            p = end;
+         }
+         for( long cpu = first; cpu <= last; ++cpu )
+         {
+            ret.push_back( static_cast<int>( cpu ) );
+         }
+         if( *p == ',' )
+         {
+            ++p;
+         }
+      }
+      return ret;
+   }
+
+private:
+   static std::string read_line( std::string const & path )
+   {
+      std::string ret;
+      if( FILE * f = fopen( path.c_str(), "r" ) )
+      {
+         char line[4096];
+         if( fgets( line, sizeof(line), f ) != nullptr )
+         {
+            ret = line;
+         }
+         fclose( f );
+      }
+      return ret;
+   }
+};
+
+// Where the threads of a server run, see server::set_placement(). Empty sets leave threads where
+// the scheduler puts them. Workers are pinned one CPU each, taking the CPUs of their set in turn.
+//
+// Memory comes from the node a thread runs on when the thread first touches it, so pinned threads
+// get node-local buffers, and with the transport and the workers on one node every request is read,
+// unpacked, handled and answered without crossing sockets.
+struct thread_placement
+{
+   std::vector<int> transport;   // CPUs of the transport thread
+   std::vector<int> workers;     // CPUs of the default workers
+   std::unordered_map<std::string, std::vector<int>> executors;   // CPUs of the workers of named executors
+   int numa_node = -1;           // If set, the sets left empty above get every CPU of this node
+};
+
+// A thread as actually placed. The kernel may have refused some CPUs (offline, or outside the
+// cpuset of the process), this is what it settled on
+struct placed_thread
+{
+   std::string name;   // "transport", or the name of the executor of a worker
+   int tid = 0;
+   std::vector<int> cpus;
+   std::vector<int> nodes;
+
+   MSGPACK_DEFINE_MAP( name, tid, cpus, nodes );
+};
+
+// Returned by server::placement(), and by the built-in "__placement" method
+struct placement_report
+{
+   cpu_topology topology;
+   std::vector<placed_thread> threads;
+
+   MSGPACK_DEFINE_MAP( topology, threads );
+};
+
+// Restricts thread to cpus. Returns false, leaving it as it was, if the kernel refused all of them
+inline bool pin_thread( pthread_t const thread, std::vector<int> const & cpus )
+{
+   cpu_set_t set;
+   CPU_ZERO( &set );
+   for( int const cpu : cpus )
+   {
+      if( (cpu >= 0) && (cpu < CPU_SETSIZE) )
+      {
+         CPU_SET( cpu, &set );
+      }
+   }
+   int const err = pthread_setaffinity_np( thread, sizeof(set), &set );
+   if( err != 0 )
+   {
+      RPC_LOG( warning, "placement: CPU affinity refused (%d)", err );
+      return false;
+   }
+   return true;
+}
+
+// The CPUs thread may run on, and their nodes
+inline placed_thread describe_thread( std::string name, pthread_t const thread, int const tid )
+{
+   placed_thread ret;
+   ret.name = std::move( name );
+   ret.tid = tid;
+
+   cpu_set_t set;
+   CPU_ZERO( &set );
+   if( pthread_getaffinity_np( thread, sizeof(set), &set ) == 0 )
+   {
+      cpu_topology const topology = cpu_topology::detect();
+      for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+      {
+         if( !CPU_ISSET( cpu, &set ) )
+         {
+            continue;
+         }
+         ret.cpus.push_back( cpu );
+         int const node = topology.node_of( cpu );
+         if( (node >= 0) && (std::find( ret.nodes.begin(), ret.nodes.end(), node ) == ret.nodes.end()) )
+         {
+            ret.nodes.push_back( node );
+         }
+      }
+   }
+   return ret;
+}
+
+inline int current_tid()
+{
+   return static_cast<int>( syscall( SYS_gettid ) );
+}
+
+};
@@ -0,0 +1,417 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "rpc/client.hpp"
+#include "rpc/endpoint.hpp"
+#include "rpc/priority.hpp"
+#include "rpc/trace.hpp"
+#include "rpc/log.hpp"
+
+namespace rpc
+{
+
+struct pool_options
+{
+   // What makes one connection better than another
+   enum class balance
+   {
+      in_flight,   // Fewer calls waiting for their response
+      latency      // Lower moving average of the response time
+   };
+
+   size_t connections_per_endpoint = 2;
+   balance by = balance::in_flight;
+   double latency_weight = 0.2;                         // Of the latest call in the moving average
+   std::chrono::milliseconds health_interval{ 1000 };   // Between background checks, 0 for none
+   std::chrono::milliseconds health_timeout{ 500 };     // Connections slower to answer get no calls until the next check
+   std::chrono::milliseconds retry_after{ 1000 };       // Before connecting again after a connection was lost or refused
+};
+
+// One connection of a pooled_client
+struct pool_connection_stats
+{
+   std::string endpoint;
+   bool connected = false;
+   bool healthy = true;
+   uint32_t in_flight = 0;
+   uint64_t latency_us = 0;   // Moving average
+   uint64_t calls = 0;
+   uint64_t failures = 0;
+};
+
+// Spreads calls over K connections to each of N servers, with the same interface as rpc::client.
+// Each call goes to the better of two connections picked at random (power of two choices), which
+// keeps the load even without tracking every connection, and steers calls away from a connection
+// stuck behind a slow request.
+//
+// Connections are opened on their first call. A background thread sends "__ping" on the open ones
+// every health_interval: those that do not answer within health_timeout get no calls until they do,
+// and those the server closed are dropped, then opened again after retry_after. Calls in flight on a
+// dropped connection fail, the pool does not retry them.
+class pooled_client
+{
+public:
+   using clock = std::chrono::steady_clock;
+
+   explicit pooled_client( std::vector<endpoint> const & servers, pool_options const & opts = pool_options() ) :
+      _options( opts ), _rng( std::random_device()() )
+   {
+      if( servers.empty() || (opts.connections_per_endpoint == 0) )
+      {
+         throw std::invalid_argument( "pooled_client: no connection to make" );
+      }
+      for( auto const & it : servers )
+      {
+         for( size_t i = 0; i < opts.connections_per_endpoint; ++i )
+         {
+            _slots.emplace_back( new slot( it ) );
+         }
+      }
+
+      if( opts.health_interval.count() > 0 )
+      {
+         _health_thrd = std::thread( &pooled_client::health_checker, this );
+      }
+   }
+
+   pooled_client( pooled_client const & ) = delete;
+   pooled_client& operator=( pooled_client const & ) = delete;
+
+   ~pooled_client()
+   {
+      {
+         std::unique_lock<std::mutex> lck(_health_mutex);
+         _keep_running = false;
+      }
+      _health_cv.notify_all();
+      if( _health_thrd.joinable() )
+      {
+         _health_thrd.join();
+      }
+   }
+
+   // Throws std::runtime_error if no server can be reached
+   template< class ret_t, class... Args >
+   std::future<ret_t> async_call( std::string const & method, Args&&... args )
+   {
+      return async_call_impl<ret_t>( nullptr, method, std::forward<Args>(args)... );
+   }
+
+   template< class ret_t, class... Args >
+   std::future<ret_t> async_call( priority const prio, std::string const & method, Args&&... args )
+   {
+      return async_call_impl<ret_t>( &prio, method, std::forward<Args>(args)... );
+   }
+
+   template< class ret_t, class... Args >
+   ret_t call( std::string const & method, Args&&... args )
+   {
+      return async_call<ret_t>( method, std::forward<Args>(args)... ).get();
+   }
+
+   template< class ret_t, class... Args >
+   ret_t call( priority const prio, std::string const & method, Args&&... args )
+   {
+      return async_call<ret_t>( prio, method, std::forward<Args>(args)... ).get();
+   }
+
+   // Every connection of the pool, K in a row for each server
+   std::vector<pool_connection_stats> stats()
+   {
+      std::vector<pool_connection_stats> ret;
+      for( auto const & s : _slots )
+      {
+         pool_connection_stats st;
+         st.endpoint = s->server.to_string();
+         {
+            std::unique_lock<std::mutex> lck(s->mutex);
+            st.connected = s->conn && s->conn->connected();
+         }
+         st.healthy = s->healthy;
+         st.in_flight = s->in_flight;
+         st.latency_us = s->latency_ns / 1000;
+         st.calls = s->calls;
+         st.failures = s->failures;
+         ret.push_back( st );
+      }
+      return ret;
+   }
+
+private:
+   struct slot
+   {
+      explicit slot( endpoint const & e ) : server( e ) {}
+
+      endpoint const server;
+      std::mutex mutex;                  // Guards conn and connecting
+      std::condition_variable connected_cv;
+      std::shared_ptr<client> conn;      // Not connected yet, or dropped, if null
+      bool connecting = false;           // A call is opening conn, without the lock
+      std::atomic<clock::rep> retry_at{ 0 };
+      std::atomic<bool> healthy{ true };
+      std::atomic<uint32_t> in_flight{ 0 };
+      std::atomic<uint64_t> latency_ns{ 0 };
+      std::atomic<uint64_t> calls{ 0 };
+      std::atomic<uint64_t> failures{ 0 };
+   };
+
+   pool_options const _options;
+   std::vector<std::unique_ptr<slot>> _slots;
+   std::mutex _rng_mutex;
+   std::minstd_rand _rng;
+
+   std::mutex _health_mutex;
+   std::condition_variable _health_cv;
+   bool _keep_running = true;
+   std::thread _health_thrd;
+
+   template< class ret_t, class... Args >
+   std::future<ret_t> async_call_impl( priority const * prio, std::string const & method, Args&&... args )
+   {
+      // A connection that cannot be opened is skipped until retry_after, so this ends
+      for( ;; )
+      {
+         slot * const s = pick();
+         if( s == nullptr )
+         {
+            throw std::runtime_error( "pooled_client: no server available for " + method );
+         }
+         std::shared_ptr<client> const conn = connection( *s );
+         if( !conn )
+         {
+            continue;
+         }
+
+         ++s->in_flight;
+         ++s->calls;
+         clock::time_point const begin = clock::now();
+         double const weight = _options.latency_weight;
+         client::done_type done = [s, begin, weight]( bool const failed )
+         {
+            --s->in_flight;
+            if( failed )
+            {
+               ++s->failures;
+               return;
+            }
+            double const sample = static_cast<double>( std::chrono::duration_cast<std::chrono::nanoseconds>( clock::now() - begin ).count() );
+            double const average = static_cast<double>( s->latency_ns.load( std::memory_order_relaxed ) );
+            s->latency_ns.store( static_cast<uint64_t>( (average == 0) ? sample : average + weight * (sample - average) ), std::memory_order_relaxed );
+         };
+         return conn->async_call_impl<ret_t>( prio, std::move(done), method, std::forward<Args>(args)... );
+      }
+   }
+
+   // The better of two connections picked at random among the healthy ones that may be used now,
+   // or among those that may be used at all if none is healthy. Null if none may be used
+   slot * pick()
+   {
+      clock::rep const now = clock::now().time_since_epoch().count();
+      std::vector<slot *> usable;
+      std::vector<slot *> healthy;
+      for( auto const & s : _slots )
+      {
+         if( s->retry_at.load( std::memory_order_relaxed ) <= now )
+         {
+            usable.push_back( s.get() );
+            if( s->healthy )
+            {
+               healthy.push_back( s.get() );
+            }
+         }
+      }
+
+      std::vector<slot *> const & candidates = healthy.empty() ? usable : healthy;
+      if( candidates.size() < 2 )
+      {
+         return candidates.empty() ? nullptr : candidates[0];
+      }
+
+      size_t first;
+      size_t second;
+      {
+         std::unique_lock<std::mutex> lck(_rng_mutex);
+         first = _rng() % candidates.size();
+         second = _rng() % (candidates.size() - 1);
+      }
+      if( second >= first )
+      {  // Two different ones
+         ++second;
+      }
+      return better( *candidates[first], *candidates[second] ) ? candidates[first] : candidates[second];
+   }
+
+   bool better( slot const & a, slot const & b ) const
+   {
+      uint32_t const a_in_flight = a.in_flight;
+      uint32_t const b_in_flight = b.in_flight;
+      uint64_t const a_latency = a.latency_ns;
+      uint64_t const b_latency = b.latency_ns;
+      if( _options.by == pool_options::balance::latency )
+      {
+         return (a_latency != b_latency) ? (a_latency < b_latency) : (a_in_flight <= b_in_flight);
+      }
+      return (a_in_flight != b_in_flight) ? (a_in_flight < b_in_flight) : (a_latency <= b_latency);
+   }
+
+   // The connection of s, opened if needed. Null if that failed
+   std::shared_ptr<client> connection( slot & s )
+   {
+      std::shared_ptr<client> lost;   // Destroyed without the lock, it waits for its thread
+      {
+         std::unique_lock<std::mutex> lck(s.mutex);
+         // Concurrent calls wait for the one opening the connection rather than open one each
+         s.connected_cv.wait( lck, [&s](){ return !s.connecting; } );
+         if( s.conn && s.conn->connected() )
+         {
+            return s.conn;
+         }
+         if( s.retry_at.load( std::memory_order_relaxed ) > clock::now().time_since_epoch().count() )
+         {  // The call waited for failed to connect
+            return nullptr;
+         }
+         lost.swap( s.conn );
+         s.connecting = true;
+      }
+      lost.reset();
+
+      // Connecting may block, without the lock stats() and the health checks go on meanwhile
+      std::shared_ptr<client> fresh;
+      std::string error;
+      try
+      {
+         fresh = std::make_shared<client>( s.server );
+      }
+      catch( std::exception const & e )
+      {
+         error = e.what();
+      }
+
+      {
+         std::unique_lock<std::mutex> lck(s.mutex);
+         s.conn = fresh;
+         s.connecting = false;
+      }
+      s.connected_cv.notify_all();
+
+      if( !fresh )
+      {
+         RPC_LOG( warning, "pooled_client: cannot connect to %s (%s)", s.server.to_string().c_str(), error.c_str() );
+         retry_later( s );
+         return nullptr;
+      }
+      s.healthy = true;
+      s.latency_ns = 0;
+      return fresh;
+   }
+
+   void retry_later( slot & s )
+   {
+      s.retry_at = (clock::now() + _options.retry_after).time_since_epoch().count();
+   }
+
+   void drop( slot & s )
+   {
+      std::shared_ptr<client> lost;
+      {
+         std::unique_lock<std::mutex> lck(s.mutex);
+         lost.swap( s.conn );
+      }
+      if( lost )
+      {
+         RPC_LOG( warning, "pooled_client: lost a connection to %s", s.server.to_string().c_str() );
+         retry_later( s );
+      }
+   }
+
+   void health_checker()
+   {
+      tracer::set_thread_name( "rpc-pool-health" );
+      std::unique_lock<std::mutex> lck(_health_mutex);
+      while( _keep_running )
+      {
+         _health_cv.wait_for( lck, _options.health_interval );
+         if( _keep_running )
+         {
+            lck.unlock();
+            check_health();
+            lck.lock();
+         }
+      }
+   }
+
+   // Pings every open connection at once, so that a slow server does not hold up checking the others
+   void check_health()
+   {
+      std::vector<std::pair<slot *, std::future<bool>>> pings;
+      for( auto const & s : _slots )
+      {
+         std::shared_ptr<client> conn;
+         {
+            std::unique_lock<std::mutex> lck(s->mutex);
+            conn = s->conn;
+         }
+         if( !conn )
+         {  // Opened on its first call
+            continue;
+         }
+
+         try
+         {
+            pings.emplace_back( s.get(), conn->async_call<bool>( priority::critical, "__ping" ) );
+         }
+         catch( std::exception const & )
+         {
+            drop( *s );
+         }
+      }
+
+      clock::time_point const deadline = clock::now() + _options.health_timeout;
+      for( auto& it : pings )
+      {
+         slot & s = *it.first;
+         bool answered = it.second.wait_until( deadline ) == std::future_status::ready;
+         if( answered )
+         {  // A ping that failed is no answer
+            try
+            {
+               it.second.get();
+            }
+            catch( std::exception const & )
+            {
+               answered = false;
+            }
+         }
+         std::shared_ptr<client> conn;
+         {
+            std::unique_lock<std::mutex> lck(s.mutex);
+            conn = s.conn;
+         }
+         if( conn && !conn->connected() )
+         {
+            conn.reset();
+            drop( s );
+            continue;
+         }
+
+         if( answered != s.healthy )
+         {
+            RPC_LOG( warning, "pooled_client: a connection to %s is %s", s.server.to_string().c_str(), answered ? "healthy again" : "not answering" );
+         }
+         s.healthy = answered;
+      }
+   }
+};
+
+};
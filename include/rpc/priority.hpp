@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <msgpack.hpp>
+
+namespace rpc
+{
+
+// Scheduling class of a method (or of a single call). Lower values are served first.
+enum class priority : uint8_t
+{
+   critical = 0,   // Health checks and the like. Never shed by the load shedder
+   high     = 1,   // Latency sensitive calls
+   normal   = 2,   // Default
+   low      = 3    // Bulk work (exports, reports, ...)
+};
+
+constexpr size_t priority_levels = 4;
+
+inline size_t priority_index( priority const prio )
+{
+   size_t const idx = static_cast<size_t>( prio );
+   return idx < priority_levels ? idx : priority_levels - 1;
+}
+
+};
+
+MSGPACK_ADD_ENUM(rpc::priority);
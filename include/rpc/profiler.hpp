@@ -0,0 +1,285 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <signal.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <cxxabi.h>
+#include <sys/time.h>
+
+namespace rpc
+{
+
+// Sampling CPU profiler. While running, an ITIMER_PROF timer interrupts
+// whichever thread is burning CPU roughly hz times per second, and the signal
+// handler records its call stack together with the method the thread is
+// serving, if any (see method_scope). folded() turns the samples into the
+// "frame;frame;frame count" lines flamegraph.pl and speedscope read, each
+// stack rooted at the method name.
+//
+// Function names come from dladdr(), so executables need to be linked with
+// -rdynamic for their own functions to show up by name rather than as
+// module+offset.
+class profiler
+{
+public:
+   static constexpr size_t max_depth = 48;
+   static constexpr size_t max_samples = 16384;   // Further samples are counted as dropped
+
+   // Tags the samples taken on this thread with method until the scope ends
+   class method_scope
+   {
+   public:
+      explicit method_scope( char const * method ) : _previous( current() )
+      {
+         current() = method;
+      }
+
+      method_scope( method_scope const & ) = delete;
+      method_scope& operator=( method_scope const & ) = delete;
+
+      ~method_scope()
+      {
+         current() = _previous;
+      }
+
+   private:
+      char const * _previous;
+   };
+
+   // Returns false if the profiler is already running
+   static bool start( unsigned const hz = 99 )
+   {
+      shared_state & st = state();
+      std::unique_lock<std::mutex> lck(st.mutex);
+      if( st.running || (hz == 0) )
+      {
+         return false;
+      }
+
+      if( !st.samples )
+      {  // Kept for good once allocated, a late signal may still be writing into it after stop()
+         st.samples.reset( new sample[max_samples] );
+      }
+      for( size_t i = 0; i < max_samples; ++i )
+      {
+         st.samples[i].ready.store( false, std::memory_order_relaxed );
+      }
+      st.next.store( 0, std::memory_order_relaxed );
+      st.dropped.store( 0, std::memory_order_relaxed );
+
+      // The first backtrace() loads the unwinder, which must not happen in the signal handler
+      void * pcs[2];
+      backtrace( pcs, 2 );
+
+      struct sigaction sa;
+      memset( &sa, 0, sizeof(sa) );
+      sa.sa_handler = &on_signal;
+      sa.sa_flags = SA_RESTART;
+      sigemptyset( &sa.sa_mask );
+      sigaction( SIGPROF, &sa, &st.previous_action );
+
+      long const usec = (hz >= 1000000) ? 1 : static_cast<long>( 1000000 / hz );
+      struct itimerval timer;
+      timer.it_interval.tv_sec = usec / 1000000;
+      timer.it_interval.tv_usec = usec % 1000000;
+      timer.it_value = timer.it_interval;
+      setitimer( ITIMER_PROF, &timer, nullptr );
+
+      st.running = true;
+      return true;
+   }
+
+   // Stops sampling, the samples stay available to folded() until the next start()
+   static void stop()
+   {
+      shared_state & st = state();
+      std::unique_lock<std::mutex> lck(st.mutex);
+      if( !st.running )
+      {
+         return;
+      }
+
+      struct itimerval timer;
+      memset( &timer, 0, sizeof(timer) );
+      setitimer( ITIMER_PROF, &timer, nullptr );
+
+      // A SIGPROF may still be pending, or on its way to another thread. The default action would
+      // terminate the process, ignore it instead. A handler of the application's own is restored
+      struct sigaction after = st.previous_action;
+      if( !(after.sa_flags & SA_SIGINFO) && (after.sa_handler == SIG_DFL) )
+      {
+         after.sa_handler = SIG_IGN;
+      }
+      sigaction( SIGPROF, &after, nullptr );
+      st.running = false;
+   }
+
+   static bool running()
+   {
+      shared_state & st = state();
+      std::unique_lock<std::mutex> lck(st.mutex);
+      return st.running;
+   }
+
+   // Samples that did not fit since start()
+   static uint64_t dropped()
+   {
+      return state().dropped.load( std::memory_order_relaxed );
+   }
+
+   // One "method;outermost;...;innermost count" line per distinct stack. Samples taken outside
+   // any method_scope are rooted at "(no method)"
+   static std::string folded()
+   {
+      shared_state & st = state();
+      std::unique_lock<std::mutex> lck(st.mutex);
+      if( !st.samples )
+      {
+         return std::string();
+      }
+
+      std::unordered_map<void *, std::string> symbols;
+      std::map<std::string, uint64_t> stacks;
+      uint64_t const taken = st.next.load( std::memory_order_acquire );
+      size_t const count = (taken < max_samples) ? static_cast<size_t>( taken ) : max_samples;
+      for( size_t i = 0; i < count; ++i )
+      {
+         sample const & s = st.samples[i];
+         if( !s.ready.load( std::memory_order_acquire ) )
+         {
+            continue;
+         }
+
+         std::string stack = (s.method[0] != '\0') ? s.method : "(no method)";
+         for( int frame = s.depth - 1; frame >= skipped_frames; --frame )
+         {
+            auto it = symbols.find( s.pcs[frame] );
+            if( it == symbols.end() )
+            {
+               it = symbols.emplace( s.pcs[frame], symbolize( s.pcs[frame] ) ).first;
+            }
+            stack += ';';
+            stack += it->second;
+         }
+         ++stacks[stack];
+      }
+
+      std::string ret;
+      for( auto const & it : stacks )
+      {
+         ret += it.first;
+         ret += ' ';
+         ret += std::to_string( it.second );
+         ret += '\n';
+      }
+      return ret;
+   }
+
+   static bool write_folded( char const * path )
+   {
+      FILE * file = fopen( path, "w" );
+      if( file == nullptr )
+      {
+         return false;
+      }
+
+      std::string const text = folded();
+      bool const ok = fwrite( text.data(), 1, text.size(), file ) == text.size();
+      return (fclose( file ) == 0) && ok;
+   }
+
+private:
+   static constexpr int skipped_frames = 2;   // on_signal() and the signal trampoline
+
+   struct sample
+   {
+      std::atomic<bool> ready{ false };
+      int depth = 0;
+      char method[48] = {};
+      void * pcs[max_depth];
+   };
+
+   struct shared_state
+   {
+      std::mutex mutex;
+      bool running = false;
+      struct sigaction previous_action;
+      std::unique_ptr<sample[]> samples;
+      std::atomic<uint64_t> next{ 0 };
+      std::atomic<uint64_t> dropped{ 0 };
+   };
+
+   static shared_state & state()
+   {
+      static shared_state st;
+      return st;
+   }
+
+   static char const *& current()
+   {
+      static thread_local char const * method = nullptr;
+      return method;
+   }
+
+   static void on_signal( int )
+   {
+      int const saved_errno = errno;
+      shared_state & st = state();
+      uint64_t const slot = st.next.fetch_add( 1, std::memory_order_relaxed );
+      if( slot >= max_samples )
+      {
+         st.dropped.fetch_add( 1, std::memory_order_relaxed );
+      }
+      else
+      {
+         sample & s = st.samples[slot];
+         char const * method = current();
+         if( method != nullptr )
+         {
+            size_t const n = strnlen( method, sizeof(s.method) - 1 );
+            memcpy( s.method, method, n );
+            s.method[n] = '\0';
+         }
+         else
+         {
+            s.method[0] = '\0';
+         }
+         s.depth = backtrace( s.pcs, max_depth );
+         s.ready.store( true, std::memory_order_release );
+      }
+      errno = saved_errno;
+   }
+
+   static std::string symbolize( void * pc )
+   {
+      Dl_info info;
+      memset( &info, 0, sizeof(info) );
+      if( (dladdr( pc, &info ) != 0) && (info.dli_sname != nullptr) )
+      {
+         int status = 0;
+         char * demangled = abi::__cxa_demangle( info.dli_sname, nullptr, nullptr, &status );
+         std::string ret = (status == 0) && (demangled != nullptr) ? demangled : info.dli_sname;
+         free( demangled );
+         return ret;
+      }
+
+      char buffer[64];
+      char const * module = (info.dli_fname != nullptr) ? strrchr( info.dli_fname, '/' ) : nullptr;
+      module = (module != nullptr) ? module + 1 : (info.dli_fname != nullptr ? info.dli_fname : "?");
+      snprintf( buffer, sizeof(buffer), "+0x%lx", static_cast<unsigned long>( reinterpret_cast<uintptr_t>( pc ) - reinterpret_cast<uintptr_t>( info.dli_fbase ) ) );
+      return std::string( module ) + buffer;
+   }
+};
+
+};
@@ -0,0 +1,335 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "rpc/codel.hpp"
+#include "rpc/priority.hpp"
+
+namespace rpc
+{
+
+// Queue of incoming requests, with one FIFO per priority class.
+//
+// Consumers are served from the most important non-empty class, except that a
+// class which has been passed over starvation_limit times in a row while it had
+// requests waiting gets the next turn, so bulk work keeps making progress.
+//
+// Every request is stamped when it is pushed, so that the consumer side can
+// apply CoDel-style load shedding: while the queue is overloaded each class is
+// served LIFO, and the requests that are already too old are taken from the
+// front of their class first and handed back as "shed", so the server fails
+// them fast and the queue stays bounded. Critical requests are never shed.
+//
+// With set_spin(), a consumer finding the queue empty spins for a while before it sleeps on the
+// condition variable, and producers skip waking anybody while a spinner is there to take the
+// request. That saves the futex wakeup on each request, at the cost of a busy core per spinner.
+template< class T >
+class request_queue
+{
+public:
+   using clock = codel::clock;
+
+   static constexpr unsigned starvation_limit = 8;
+
+   enum class pop_status
+   {
+      empty,   // Woken up without any request (notify_all or spurious wakeup)
+      ok,      // Request must be served
+      shed     // Request waited too long and must be rejected
+   };
+
+   request_queue() = default;
+   request_queue( request_queue const & ) = delete;
+   request_queue& operator=( request_queue const & ) = delete;
+
+   void set_load_shedding( codel_options const & opts )
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      _codel = codel( opts );
+   }
+
+   codel_stats load_shedding_stats() const
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      return _codel.stats();
+   }
+
+   // Maximum number of queued requests, 0 for unbounded
+   void set_max_size( size_t const max_size )
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      _max_size = max_size;
+   }
+
+   // How long pop() spins on an empty queue before sleeping, 0 (the default) to sleep right away
+   void set_spin( std::chrono::nanoseconds const window )
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      _spin = window;
+   }
+
+   void notify_all()
+   {
+      _cv.notify_all();
+   }
+
+   size_t size() const
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      return _size;
+   }
+
+   size_t size( priority const prio ) const
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      return _levels[priority_index(prio)].size();
+   }
+
+   bool empty() const
+   {
+      return size() == 0;
+   }
+
+   // How long the oldest queued request has been waiting
+   clock::duration head_sojourn() const
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      return oldest_waiting( clock::now(), false );
+   }
+
+   // Returns false, without queueing anything, if the queue is full
+   template< class... Args >
+   bool emplace_back( priority const prio, Args&&... args )
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      if( (_max_size != 0) && (_size >= _max_size) )
+      {
+         return false;
+      }
+
+      _levels[priority_index(prio)].emplace_back( clock::now(), std::forward<Args>(args)... );
+      ++_size;
+      _pushed.fetch_add( 1, std::memory_order_release );
+      if( _batch_waiters != 0 )
+      {  // A batching consumer may ignore this request, make sure a regular one gets it too
+         _cv.notify_all();
+      }
+      else if( _size > _spinners )
+      {  // Otherwise a spinning consumer takes it, it checks the queue again before sleeping
+         _cv.notify_one();
+      }
+      return true;
+   }
+
+   // Waits for a request and moves it into value. Gives up after a while even if nobody calls
+   // notify_all(), so consumers get to check whether they should stop
+   pop_status pop( T & value )
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      if( (_size == 0) && (_spin.count() > 0) )
+      {
+         spin( lck );
+      }
+      if( _size == 0 )
+      {
+         _cv.wait_for( lck, std::chrono::milliseconds(100) );
+         if( _size == 0 )
+         {
+            return pop_status::empty;
+         }
+      }
+
+      clock::time_point const now = clock::now();
+      if( _codel.overloaded() )
+      {  // Served newest-first, the stale requests would never leave the queue otherwise
+         for( size_t level = 0; level < _levels.size(); ++level )
+         {
+            std::deque<entry> & fifo = _levels[level];
+            if( (level != priority_index(priority::critical)) && !fifo.empty() && (now - fifo.front().enqueued > _codel.shed_after()) )
+            {
+               entry e = std::move( fifo.front() );
+               fifo.pop_front();
+               --_size;
+               value = std::move( e.value );
+               return dequeued( now, now - e.enqueued ) ? pop_status::shed : pop_status::ok;
+            }
+         }
+      }
+
+      size_t const level = next_level();
+      std::deque<entry> & fifo = _levels[level];
+
+      bool const lifo = _codel.overloaded();
+      entry e = std::move( lifo ? fifo.back() : fifo.front() );
+      if( lifo )
+      {
+         fifo.pop_back();
+      }
+      else
+      {
+         fifo.pop_front();
+      }
+      --_size;
+
+      value = std::move( e.value );
+      if( level == priority_index(priority::critical) )
+      {  // Never shed, so kept out of CoDel's state and counters altogether
+         return pop_status::ok;
+      }
+      return dequeued( now, now - e.enqueued ) ? pop_status::shed : pop_status::ok;
+   }
+
+   // Moves up to max_count queued requests for which pred is true into out, waiting up to max_wait for
+   // more of them to arrive. Used to serve several requests with a single call. They go through CoDel
+   // like those pop() returns, and those it sheds go to shed instead, still counting towards max_count
+   template< class Pred >
+   void pop_matching( Pred pred, size_t const max_count, clock::duration const max_wait, std::vector<T> & out, std::vector<T> & shed )
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      clock::time_point const deadline = clock::now() + max_wait;
+      size_t taken = 0;
+
+      for( ;; )
+      {
+         clock::time_point const now = clock::now();
+         for( size_t level = 0; level < _levels.size(); ++level )
+         {
+            std::deque<entry> & fifo = _levels[level];
+            for( auto it = fifo.begin(); (it != fifo.end()) && (taken < max_count); /*no increment*/ )
+            {
+               if( pred( it->value ) )
+               {
+                  bool const drop = (level != priority_index(priority::critical)) && dequeued( now, now - it->enqueued );
+                  (drop ? shed : out).push_back( std::move(it->value) );
+                  it = fifo.erase( it );
+                  --_size;
+                  ++taken;
+               }
+               else
+               {
+                  ++it;
+               }
+            }
+         }
+
+         if( (taken >= max_count) || (now >= deadline) )
+         {
+            break;
+         }
+
+         ++_batch_waiters;
+         _cv.wait_until( lck, deadline );
+         --_batch_waiters;
+      }
+   }
+
+private:
+   struct entry
+   {
+      template< class... Args >
+      entry( clock::time_point t, Args&&... args ) : enqueued(t), value( std::forward<Args>(args)... ) {}
+      clock::time_point enqueued;
+      T value;
+   };
+
+   mutable std::mutex _mutex;
+   std::condition_variable _cv;
+   std::array<std::deque<entry>, priority_levels> _levels;
+   std::array<unsigned, priority_levels> _skipped{};
+   size_t _size = 0;
+   size_t _max_size = 0;
+   size_t _batch_waiters = 0;
+   size_t _spinners = 0;
+   std::chrono::nanoseconds _spin{ 0 };
+   std::atomic<uint64_t> _pushed{ 0 };   // Watched by spinners without the lock
+   codel _codel;
+
+   // Age of the oldest request queued, critical ones included or not
+   clock::duration oldest_waiting( clock::time_point const now, bool const skip_critical ) const
+   {
+      clock::time_point oldest = clock::time_point::max();
+      for( size_t level = 0; level < _levels.size(); ++level )
+      {
+         std::deque<entry> const & fifo = _levels[level];
+         if( !(skip_critical && (level == priority_index(priority::critical))) && !fifo.empty() && (fifo.front().enqueued < oldest) )
+         {
+            oldest = fifo.front().enqueued;
+         }
+      }
+      return (oldest == clock::time_point::max()) ? clock::duration::zero() : now - oldest;
+   }
+
+   // CoDel accounting of a non-critical request just taken out of the queue. True if it must be shed
+   bool dequeued( clock::time_point const now, clock::duration const sojourn )
+   {
+      clock::duration const left = oldest_waiting( now, true );
+      return _codel.on_dequeue( now, sojourn, (left > sojourn) ? left : sojourn );
+   }
+
+   // Waits for a request without sleeping, for up to _spin. Must be called with lck held, returns with
+   // it held again
+   void spin( std::unique_lock<std::mutex> & lck )
+   {
+      ++_spinners;
+      clock::time_point const deadline = clock::now() + _spin;
+      for( bool expired = false; (_size == 0) && !expired; /*no increment*/ )
+      {
+         uint64_t const seen = _pushed.load( std::memory_order_acquire );
+         lck.unlock();
+         for( unsigned i = 1; _pushed.load( std::memory_order_acquire ) == seen; ++i )
+         {
+            if( ((i & 63) == 0) && (clock::now() >= deadline) )
+            {
+               expired = true;
+               break;
+            }
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+         }
+         lck.lock();
+      }
+      --_spinners;
+   }
+
+   // Picks the class to serve next. Must be called with the lock held and at least one request queued
+   size_t next_level()
+   {
+      size_t chosen = priority_levels;
+      for( size_t i = 0; i < priority_levels; ++i )
+      {
+         if( _levels[i].empty() )
+         {
+            continue;
+         }
+
+         if( chosen == priority_levels )
+         {
+            chosen = i;
+         }
+         else if( _skipped[i] >= starvation_limit )
+         {  // Waited long enough behind more important work
+            chosen = i;
+            break;
+         }
+      }
+
+      for( size_t i = chosen + 1; i < priority_levels; ++i )
+      {
+         if( !_levels[i].empty() )
+         {
+            ++_skipped[i];
+         }
+      }
+      _skipped[chosen] = 0;
+
+      return chosen;
+   }
+};
+
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <time.h>
+
+namespace rpc
+{
+
+// Allocations made by the calling thread, as counted by the operator new
+// replacements below. They only count once one translation unit of the
+// program defines RPC_COUNT_ALLOCATIONS before including this header, e.g.
+//
+//   #define RPC_COUNT_ALLOCATIONS
+//   #include "rpc/resources.hpp"
+//
+// Otherwise the counts stay at zero. Programs that replace operator new
+// themselves can call allocation_counter::add() from their own.
+class allocation_counter
+{
+public:
+   static inline void add( size_t const size )
+   {
+      counts & c = local();
+      c.bytes += size;
+      ++c.count;
+   }
+
+   static uint64_t bytes()
+   {
+      return local().bytes;
+   }
+
+   static uint64_t count()
+   {
+      return local().count;
+   }
+
+private:
+   struct counts
+   {
+      uint64_t bytes;
+      uint64_t count;
+   };
+
+   static counts & local()
+   {
+      static thread_local counts c = { 0, 0 };
+      return c;
+   }
+};
+
+// What the calling thread has used so far. The difference of two readings is
+// what the thread used in between
+struct resource_usage
+{
+   uint64_t cpu_ns = 0;
+   uint64_t alloc_bytes = 0;
+   uint64_t allocs = 0;
+
+   static resource_usage current()
+   {
+      resource_usage ret;
+      struct timespec ts;
+      if( clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts ) == 0 )
+      {
+         ret.cpu_ns = static_cast<uint64_t>( ts.tv_sec ) * 1000000000u + static_cast<uint64_t>( ts.tv_nsec );
+      }
+      ret.alloc_bytes = allocation_counter::bytes();
+      ret.allocs = allocation_counter::count();
+      return ret;
+   }
+
+   resource_usage operator-( resource_usage const & other ) const
+   {
+      resource_usage ret;
+      ret.cpu_ns = cpu_ns - other.cpu_ns;
+      ret.alloc_bytes = alloc_bytes - other.alloc_bytes;
+      ret.allocs = allocs - other.allocs;
+      return ret;
+   }
+};
+
+};
+
+#ifdef RPC_COUNT_ALLOCATIONS
+
+// None inlined, or GCC pairs the malloc() and free() inside with the new and delete expressions,
+// or new[] with the scalar new it calls, and warns about the mismatch
+__attribute__(( noinline )) void * operator new( size_t size )
+{
+   rpc::allocation_counter::add( size );
+   void * ptr = malloc( size != 0 ? size : 1 );
+   if( ptr == nullptr )
+   {
+      throw std::bad_alloc();
+   }
+   return ptr;
+}
+
+__attribute__(( noinline )) void * operator new[]( size_t size )
+{
+   return operator new( size );
+}
+
+__attribute__(( noinline )) void * operator new( size_t size, std::nothrow_t const & ) noexcept
+{
+   rpc::allocation_counter::add( size );
+   return malloc( size != 0 ? size : 1 );
+}
+
+__attribute__(( noinline )) void * operator new[]( size_t size, std::nothrow_t const & ) noexcept
+{
+   return operator new( size, std::nothrow );
+}
+
+__attribute__(( noinline )) void operator delete( void * ptr ) noexcept
+{
+   free( ptr );
+}
+
+__attribute__(( noinline )) void operator delete[]( void * ptr ) noexcept
+{
+   free( ptr );
+}
+
+#endif
@@ -1,13 +1,29 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <iostream>
+#include <deque>
+#include <memory>
 #include <unordered_map>
 #include <functional>
+#include <typeinfo>
 
 #include "exceptions.hpp"
 #include "rpc/transport_defs.hpp"
+#include "rpc/endpoint.hpp"
 #include "rpc/tcp_socket_server.hpp"
+#include "rpc/udp_socket_server.hpp"
+#include "rpc/request_queue.hpp"
+#include "rpc/priority.hpp"
+#include "rpc/executor.hpp"
+#include "rpc/placement.hpp"
+#include "rpc/metrics.hpp"
+#include "rpc/lifecycle.hpp"
+#include "rpc/tsc.hpp"
+#include "rpc/trace.hpp"
+#include "rpc/log.hpp"
+#include "rpc/profiler.hpp"
 
 #include "rpc/call.h"
 #include "rpc/func_traits.h"
@@ -15,10 +31,74 @@
 namespace rpc
 {
 
+// Per-method settings for server::bind(). Implicitly built from a priority and/or an executor, so that
+// server.bind( "report", fn, rpc::executor("slow", 4) ) or server.bind( "ping", fn, rpc::priority::critical ) just work
+struct method_options
+{
+   method_options( priority p = priority::normal ) : prio( p ), exec( "", 0 ) {}
+   method_options( executor e, priority p = priority::normal ) : prio( p ), exec( std::move(e) ) {}
+
+   priority prio;
+   executor exec;   // Empty name for the server's default workers
+};
+
+// How bind_batch() groups concurrent requests. A worker that picks up a request for a batched method
+// also takes every other request for it already queued (from any connection), up to max_batch, and
+// waits up to window for more before calling the handler once for all of them
+struct batch_options
+{
+   batch_options( size_t max = 64, std::chrono::microseconds w = std::chrono::microseconds(0) ) : max_batch( max ), window( w ) {}
+
+   size_t max_batch;
+   std::chrono::microseconds window;
+};
+
 class server
 {
 public:
-   server() : _conn( "127.0.0.1", 20000 ) {}
+   // With io_backend::io_uring the transport uses io_uring if the kernel supports it, poll otherwise
+   server( char const * addr = "127.0.0.1", uint16_t const port = 20000, io_backend const backend = io_backend::poll ) :
+      server( endpoint::tcp( addr, port ), backend )
+   {
+   }
+
+   // e.g. endpoint::unix_domain( "@app" ) to serve clients on the same host without going through TCP
+   explicit server( endpoint const & listen_on, io_backend const backend = io_backend::poll ) :
+      _default_pool( executor( "default", 1 ) ),
+      _conn( listen_on, [this]( tcp_socket_server::message && msg ){ enqueue( std::move(msg) ); }, backend )
+   {
+      tsc_clock::calibrate();
+
+      // Answers the health checks of rpc::pooled_client
+      bind( "__ping", [](){ return true; }, priority::critical );
+
+      // Reserved, so that any client can ask a running server how it is doing
+      bind( "__stats", [this]()
+      {
+         std::vector<method_summary> ret;
+         for( auto const & it : methods_stats() )
+         {
+            ret.emplace_back( it );
+         }
+         return ret;
+      }, priority::critical );
+
+      // Writes the trace rings to the path set with tracer::set_dump_path() and returns it
+      bind( "__trace_dump", []()
+      {
+         if( !tracer::dump( tracer::dump_path() ) )
+         {
+            throw bad_call( "Trace dump failed, is a dump path set?" );
+         }
+         return std::string( tracer::dump_path() );
+      }, priority::critical );
+
+      // Per-connection counters and TCP_INFO, to tell a slow network from a slow client from a slow server
+      bind( "__connections", [this](){ return connections_stats(); }, priority::critical );
+
+      // NUMA nodes of the host and the CPUs every server thread runs on, see set_placement()
+      bind( "__placement", [this](){ return placement(); }, priority::critical );
+   }
 
    ~server()
    {
@@ -31,25 +111,26 @@ public:
    template< class Callable,
              typename std::enable_if< std::is_void< typename detail::func_traits<Callable>::result_type >::value >::type* = nullptr ,
              typename std::enable_if< detail::is_zero_arg<Callable>::value >::type* = nullptr>
-   void bind ( const std::string & method, Callable func )
+   void bind ( const std::string & method, Callable func, method_options const & opts = method_options() )
    {
       enforce_method_uniqueness( method );
-      _binded_funcs.emplace( method, [func](msgpack::object const & params_obj) -> pack_buffer
+      add_method( method, opts, [func](msgpack::object const & params_obj) -> pack_buffer
       {
          enforce_arg_count( 0, params_obj.via.array.size );
          func();
          return pack_buffer();
       });
+      add_direct( method, func );
    }
 
    // Specialization for functions of type ret_t (void)
    template< class Callable,
              typename std::enable_if< !std::is_void< typename detail::func_traits<Callable>::result_type >::value >::type* = nullptr,
              typename std::enable_if< detail::is_zero_arg<Callable>::value >::type* = nullptr>
-   void bind ( const std::string & method, Callable func )
+   void bind ( const std::string & method, Callable func, method_options const & opts = method_options() )
    {
       enforce_method_uniqueness( method );
-      _binded_funcs.emplace( method, [func](msgpack::object const & params_obj) -> pack_buffer
+      add_method( method, opts, [func](msgpack::object const & params_obj) -> pack_buffer
       {
          enforce_arg_count( 0, params_obj.via.array.size );
 
@@ -57,19 +138,20 @@ public:
          msgpack::pack( buffer, func() );
          return buffer;
       });
+      add_direct( method, func );
    }
 
    // Specialization for functions of type void (...)
    template< class Callable,
              typename std::enable_if< std::is_void< typename detail::func_traits<Callable>::result_type >::value >::type* = nullptr ,
              typename std::enable_if< !detail::is_zero_arg<Callable>::value >::type* = nullptr>
-   void bind ( const std::string & method, Callable func )
+   void bind ( const std::string & method, Callable func, method_options const & opts = method_options() )
    {
       using args_type = typename detail::func_traits<Callable>::args_type;
       constexpr int args_count = std::tuple_size<args_type>::value;
 
       enforce_method_uniqueness( method );
-      _binded_funcs.emplace( method, [func](msgpack::object const & params_obj) -> pack_buffer
+      add_method( method, opts, [func](msgpack::object const & params_obj) -> pack_buffer
       {
          enforce_arg_count( args_count, params_obj.via.array.size );
 
@@ -79,19 +161,20 @@ public:
          detail::call(func, params);
          return pack_buffer();
       });
+      add_direct( method, func );
    }
 
    // Specialization for functions of type ret_t (...)
    template< class Callable,
              typename std::enable_if< !std::is_void< typename detail::func_traits<Callable>::result_type >::value >::type* = nullptr,
              typename std::enable_if< !detail::is_zero_arg<Callable>::value >::type* = nullptr>
-   void bind ( const std::string & method, Callable func )
+   void bind ( const std::string & method, Callable func, method_options const & opts = method_options() )
    {
       using args_type = typename detail::func_traits<Callable>::args_type;
       constexpr int args_count = std::tuple_size<args_type>::value;
 
       enforce_method_uniqueness( method );
-      _binded_funcs.emplace( method, [func](msgpack::object const & params_obj) -> pack_buffer
+      add_method( method, opts, [func](msgpack::object const & params_obj) -> pack_buffer
       {
          enforce_arg_count( args_count, params_obj.via.array.size );
 
@@ -102,9 +185,82 @@ public:
          msgpack::pack( buffer, detail::call(func, params) );
          return buffer;
       });
+      add_direct( method, func );
    }
 
 
+   // Binds a method whose single argument is served in bulk. Callable takes a std::vector of the
+   // arguments of several calls and returns a std::vector with one result per argument, in order.
+   // Clients call it as usual, e.g. client.call<Value>( "get", key )
+   template< class Callable >
+   void bind_batch ( const std::string & method, Callable func, batch_options const & batch = batch_options(), method_options const & opts = method_options() )
+   {
+      using args_type = typename detail::func_traits<Callable>::args_type;
+      static_assert( std::tuple_size<args_type>::value == 1, "bind_batch expects a function taking a std::vector of arguments" );
+      using keys_type = typename std::tuple_element<0, args_type>::type;
+      using key_type = typename keys_type::value_type;
+
+      enforce_method_uniqueness( method );
+      if( batch.max_batch == 0 )
+      {
+         throw illegal_bind( "Method " + method + " must have a batch size of at least one" );
+      }
+
+      add_method( method, opts, caller_type() );
+      method_entry & entry = _binded_funcs.find( method )->second;
+      entry.batch = batch;
+      entry.batch_caller = [this, func]( std::vector<batch_call> & calls )
+      {
+         keys_type keys;
+         std::vector<batch_call*> valid;
+         keys.reserve( calls.size() );
+         valid.reserve( calls.size() );
+
+         for( auto& call : calls )
+         {
+            try
+            {
+               enforce_arg_count( 1, call.params.via.array.size );
+               blob_source const source( call.fds );
+               keys.push_back( call.params.via.array.ptr[0].as<key_type>() );
+               valid.push_back( &call );
+            }
+            catch(...)
+            {  // Only this caller sent bad arguments
+               call.error = handle_exception( std::current_exception() );
+            }
+         }
+
+         if( keys.empty() )
+         {
+            return;
+         }
+
+         try
+         {
+            auto const results = func( keys );
+            if( results.size() != keys.size() )
+            {
+               throw bad_call( "Batch handler returned " + std::to_string(results.size()) + " results for " + std::to_string(keys.size()) + " requests" );
+            }
+
+            for( size_t i = 0; i < valid.size(); ++i )
+            {
+               msgpack::pack( valid[i]->result, results[i] );
+            }
+         }
+         catch(...)
+         {
+            pack_buffer const error_data = handle_exception( std::current_exception() );
+            for( auto call : valid )
+            {
+               call->error = error_data;
+               call->result.clear();
+            }
+         }
+      };
+   }
+
    /*template< class ret_t, class... Args >
    void bind( std::string const & method, ret_t (*func)(Args...) )
    {
@@ -126,43 +282,438 @@ public:
       });
    }*/
 
+   // Methods must all be bound before, the method table is read without locking once serving
    void run()
    {
-      keep_running_ = true;
-      runner_thread();
+      _serving = true;
+      start_pools();
+      _conn.start();
+      _default_pool.run( [this]( request & req, bool shed ){ runner_thread( req, shed ); } );
    }
 
-   void async_run( size_t worker_threads = 1 )
+   // Serves requests on worker threads of its own. Pass a pool_size( min, max ) for an elastic pool
+   void async_run( pool_size const & worker_threads = pool_size( 1 ) )
    {
-      keep_running_ = true;
-      for( size_t i = 0; i < worker_threads; ++i )
+      if( worker_threads.max == 0 )
       {
-         threads_.emplace_back( &server::runner_thread, this );
+         throw std::invalid_argument( "async_run: the workers must have at least one thread" );
       }
+      _serving = true;
+      start_pools();
+      _default_pool.set_size( worker_threads );
+      _default_pool.start( [this]( request & req, bool shed ){ runner_thread( req, shed ); } );
+      _conn.start();
    }
 
-   void stop()
+   // Also serves the bound methods over UDP, one datagram per notification or call (see rpc::udp_client),
+   // with receivers threads bound to the port with SO_REUSEPORT. Methods run right on those threads,
+   // not on workers or executors, which suits the short ones UDP is meant for. Reserved methods ("__"
+   // prefix) are not served, and responses are at most udp_socket_server::max_amplification times
+   // the size of their request. Returns the port bound
+   uint16_t listen_udp( endpoint const & listen_on, size_t const receivers = 1 )
+   {
+      _serving = true;   // Datagrams are served from now on
+      _udp.emplace_back( new udp_socket_server( listen_on, receivers, [this]( msgpack::object const & frame, size_t const max_reply, pack_buffer & reply )
+      {
+         process_datagram( frame, max_reply, reply );
+      } ) );
+      return _udp.back()->port();
+   }
+
+   // Enables/configures CoDel-style shedding of requests that sat in the queue for too long.
+   // Applies to the default workers as well as to every executor
+   void set_load_shedding( codel_options const & opts )
+   {
+      _load_shedding = opts;
+      _default_pool.queue().set_load_shedding( opts );
+      for( auto& it : _pools )
+      {
+         it.second->queue().set_load_shedding( opts );
+      }
+   }
+
+   // For latency on dedicated cores: workers with nothing to do spin on their queue for window before
+   // sleeping, and the transport thread keeps polling sockets for as long after traffic, with
+   // SO_BUSY_POLL on TCP connections accepted from then on. Saves the futex and poll() wakeups on each
+   // request, but every spinning thread keeps a core busy, so it only pays with a core to spare for
+   // each of them. 0 (the default) turns it off
+   void set_busy_poll( std::chrono::microseconds const window )
+   {
+      _busy_poll = window;
+      _conn.set_busy_poll( window );
+      _default_pool.queue().set_spin( window );
+      for( auto& it : _pools )
+      {
+         it.second->queue().set_spin( window );
+      }
+   }
+
+   // Pins the transport thread and the workers to CPUs, see thread_placement. Call before run() or
+   // async_run(), workers started earlier stay where they are. Throws std::invalid_argument for a NUMA node without CPUs
+   void set_placement( thread_placement const & where )
+   {
+      thread_placement resolved = where;
+      if( where.numa_node >= 0 )
+      {
+         std::vector<int> const node_cpus = cpu_topology::detect().cpus_of( where.numa_node );
+         if( node_cpus.empty() )
+         {
+            throw std::invalid_argument( "No CPU on NUMA node " + std::to_string( where.numa_node ) );
+         }
+         for( std::vector<int> * cpus : { &resolved.transport, &resolved.workers } )
+         {
+            if( cpus->empty() )
+            {
+               *cpus = node_cpus;
+            }
+         }
+      }
+
+      _placement = resolved;
+      if( !resolved.transport.empty() )
+      {
+         _conn.set_cpus( resolved.transport );
+      }
+      _default_pool.set_cpus( resolved.workers );
+      for( auto& it : _pools )
+      {
+         it.second->set_cpus( cpus_of( it.first ) );
+      }
+   }
+
+   // The topology of the host and where every thread of the server actually runs. Also served
+   // remotely as "__placement"
+   placement_report placement()
    {
-      keep_running_ = false;
-      _conn._message_queue.notify_all();
-      for( auto& it : threads_ )
+      placement_report ret;
+      ret.topology = cpu_topology::detect();
+      ret.threads.push_back( _conn.placement() );
+      for( auto const & it : _default_pool.placement() )
       {
-         if( it.joinable() )
+         ret.threads.push_back( it );
+      }
+      for( auto& pool : _pools )
+      {
+         for( auto const & it : pool.second->placement() )
          {
-            it.join();
+            ret.threads.push_back( it );
          }
       }
+      return ret;
+   }
+
+   codel_stats load_shedding_stats()
+   {
+      return _default_pool.queue().load_shedding_stats();
+   }
+
+   // Queue depth and utilization of the default workers followed by every executor
+   std::vector<executor_stats> executors_stats()
+   {
+      std::vector<executor_stats> ret;
+      ret.push_back( _default_pool.stats() );
+      for( auto& it : _pools )
+      {
+         ret.push_back( it.second->stats() );
+      }
+      return ret;
+   }
+
+   // Calls, errors, bytes and latency of every bound method. Also served remotely as "__stats"
+   std::vector<method_stats> methods_stats() const
+   {
+      return _metrics.snapshot();
+   }
+
+   // Time requests spent in each stage, from being received to their response being written
+   stage_stats stages_stats() const
+   {
+      return _metrics.stages();
+   }
+
+   // Keeps a per-stage breakdown of one in every one_in requests (0, the default, for none).
+   // sampled_requests() returns the latest max_samples of them
+   void set_lifecycle_sampling( uint32_t const one_in )
+   {
+      _sample_one_in = one_in;
+   }
+
+   std::vector<request_breakdown> sampled_requests() const
+   {
+      std::unique_lock<std::mutex> lck(_samples_mutex);
+      return std::vector<request_breakdown>( _samples.begin(), _samples.end() );
+   }
+
+   // Measures the on-CPU time and the allocations of every handler call, see method_stats. Costs a
+   // clock_gettime() system call before and after each call, hence off by default
+   void set_resource_accounting( bool const on )
+   {
+      _resource_accounting = on;
+   }
+
+   // The one in use, which may be poll even though io_uring was asked for
+   io_backend backend() const
+   {
+      return _conn.backend();
+   }
+
+   // Traffic, output queues and the latest TCP_INFO sample of every client connection.
+   // Also served remotely as "__connections"
+   transport_stats connections_stats()
+   {
+      return _conn.stats();
+   }
+
+   // Results with rpc::blob values from this size on go to clients as memfd descriptors instead of
+   // bytes, see rpc/blob.hpp. 0 (the default) always sends bytes, and refuses descriptors from clients
+   // as well. Unix socket endpoints with the poll backend only
+   void set_blob_fd_threshold( size_t const bytes )
+   {
+      _conn.set_blob_fd_threshold( bytes );
+   }
+
+   // How often TCP_INFO is sampled, once a second by default. 0 stops sampling
+   void set_tcp_sampling_interval( std::chrono::milliseconds const interval )
+   {
+      _conn.set_tcp_sampling_interval( interval );
+   }
+
+   // Responses from this size on (64 KiB by default) are sent with MSG_ZEROCOPY, which saves copying
+   // them into the kernel. 0 always copies
+   void set_zerocopy_threshold( size_t const bytes )
+   {
+      _conn.set_zerocopy_threshold( bytes );
+   }
+
+   // Lets clients take a sampling CPU profile of the whole process, attributed to the methods being
+   // served: "__profile_start" (hz) installs a SIGPROF handler, "__profile_stop" removes it and returns
+   // folded stacks, ready for flamegraph.pl. Off by default, since it affects the whole process.
+   // Call before serving, like bind()
+   void enable_profiling()
+   {
+      bind( "__profile_start", []( unsigned hz ){ return profiler::start( hz ); }, priority::critical );
+      bind( "__profile_stop", []()
+      {
+         profiler::stop();
+         return profiler::folded();
+      }, priority::critical );
+   }
+
+   // Records incoming requests to a file that tools/rpc_replay can play back against a server
+   void start_capture( char const * path )
+   {
+      _conn.start_capture( path );
+   }
+
+   // Returns the number of requests captured
+   uint64_t stop_capture()
+   {
+      return _conn.stop_capture();
+   }
+
+   void stop()
+   {
+      _udp.clear();
+      _default_pool.stop();
+      for( auto& it : _pools )
+      {
+         it.second->stop();
+      }
    }
 
 private:
+   friend class local_client;
+
+   static constexpr size_t max_samples = 1024;
+
    using caller_type = std::function< pack_buffer ( msgpack::object const & ) >;
-   std::unordered_map<std::string, caller_type> _binded_funcs;
+
+   struct batch_call
+   {
+      msgpack::object params;
+      fd_list const * fds = nullptr;   // Received with the request, for blob arguments
+      pack_buffer error;
+      pack_buffer result;
+   };
+
+   using batch_caller_type = std::function< void ( std::vector<batch_call> & ) >;
+
+   struct request;
+
+   struct method_entry
+   {
+      std::string name;
+      caller_type caller;
+      batch_caller_type batch_caller;   // Set instead of caller for bind_batch() methods
+      std::shared_ptr<void> direct;     // std::function<result_type ( args_type & )> for local_client, not set for bind_batch()
+      std::type_info const * direct_type = nullptr;
+      batch_options batch;
+      priority prio;
+      worker_pool<request> * pool;
+      size_t metrics_index;
+   };
+
+   struct request
+   {
+      request() : prio( priority::normal ), msgid( 0 ), method( nullptr ) {}
+      request( tcp_socket_server::message && m, priority p, uint32_t id, method_entry const * e ) : msg( std::move(m) ), prio( p ), msgid( id ), method( e )
+      {
+         timestamps.ticks[static_cast<size_t>(stage::received)] = msg.received;
+      }
+      tcp_socket_server::message msg;
+      priority prio;
+      uint32_t msgid;                // For tracing, 0 if the envelope is malformed
+      method_entry const * method;   // nullptr if the method is not bound
+      request_timestamps timestamps;
+   };
+
+   using envelope_type = std::tuple< rpc_message, uint32_t, std::string, std::vector<char> >;
+
+   std::unordered_map<std::string, method_entry> _binded_funcs;
+   codel_options _load_shedding;
+   std::chrono::microseconds _busy_poll{ 0 };
+   thread_placement _placement;
+   metrics_registry _metrics;
+   std::atomic<uint32_t> _sample_one_in{ 0 };
+   std::atomic<bool> _resource_accounting{ false };
+   uint32_t _sample_counter = 0;   // Transport thread only
+   mutable std::mutex _samples_mutex;
+   std::deque<request_breakdown> _samples;
+   worker_pool<request> _default_pool;
+   std::unordered_map<std::string, std::unique_ptr<worker_pool<request>>> _pools;
    tcp_socket_server _conn;
-   bool  keep_running_;
-   std::vector<std::thread> threads_;
+   std::vector<std::unique_ptr<udp_socket_server>> _udp;
+   std::atomic<bool> _serving{ false };   // _binded_funcs is frozen
+
+   void add_method( std::string const & method, method_options const & opts, caller_type caller )
+   {
+      method_entry entry;
+      entry.name = method;
+      entry.caller = std::move( caller );
+      entry.prio = opts.prio;
+      entry.pool = pool_for( opts.exec );
+      entry.metrics_index = _metrics.add_method( method );
+      _binded_funcs.emplace( method, std::move(entry) );
+   }
+
+   // Keeps func callable with C++ arguments too, see local_client
+   template< class Callable >
+   void add_direct( std::string const & method, Callable func )
+   {
+      using args_type = typename detail::func_traits<Callable>::args_type;
+      using direct_type = std::function< typename detail::func_traits<Callable>::result_type ( args_type & ) >;
+
+      method_entry & entry = _binded_funcs.find( method )->second;
+      entry.direct = std::make_shared<direct_type>( [func]( args_type & params ){ return detail::call( func, params ); } );
+      entry.direct_type = &typeid(direct_type);
+   }
+
+   worker_pool<request> * pool_for( executor const & exec )
+   {
+      if( exec.name.empty() || (exec.name == _default_pool.config().name) )
+      {
+         return &_default_pool;
+      }
+
+      auto it = _pools.find( exec.name );
+      if( it == _pools.end() )
+      {
+         if( exec.threads.max == 0 )
+         {
+            throw illegal_bind( "Executor " + exec.name + " must have at least one thread" );
+         }
+
+         std::unique_ptr<worker_pool<request>> pool( new worker_pool<request>( exec ) );
+         pool->queue().set_load_shedding( _load_shedding );
+         pool->queue().set_spin( _busy_poll );
+         pool->set_cpus( cpus_of( exec.name ) );
+         it = _pools.emplace( exec.name, std::move(pool) ).first;
+      }
+      else if( (it->second->config().threads.min != exec.threads.min) ||
+               (it->second->config().threads.max != exec.threads.max) ||
+               (it->second->config().max_queue != exec.max_queue) )
+      {
+         throw illegal_bind( "Executor " + exec.name + " already defined with different parameters" );
+      }
+
+      return it->second.get();
+   }
+
+   // CPUs of the workers of an executor: its own set, or every CPU of the NUMA node
+   std::vector<int> cpus_of( std::string const & executor_name ) const
+   {
+      auto const it = _placement.executors.find( executor_name );
+      if( it != _placement.executors.end() )
+      {
+         return it->second;
+      }
+      return (_placement.numa_node >= 0) ? cpu_topology::detect().cpus_of( _placement.numa_node ) : std::vector<int>();
+   }
+
+   void start_pools()
+   {
+      for( auto& it : _pools )
+      {
+         it.second->start( [this]( request & req, bool shed ){ runner_thread( req, shed ); } );
+      }
+   }
+
+   // Runs on the transport thread. Routes the request to the workers of its method, and classifies it
+   // either by the priority carried in the envelope ([type, msgid, method, params, priority]) or by
+   // the one the method was bound with
+   void enqueue( tcp_socket_server::message && msg )
+   {
+      priority prio = priority::normal;
+      worker_pool<request> * pool = &_default_pool;
+      method_entry const * method = nullptr;
+      uint32_t msgid = 0;
+
+      msgpack::object const & msg_obj = msg.msgpack_data.get();
+      if( (msg_obj.type == msgpack::type::ARRAY) && (msg_obj.via.array.size >= 4) )
+      {
+         if( msg_obj.via.array.ptr[1].type == msgpack::type::POSITIVE_INTEGER )
+         {
+            msgid = static_cast<uint32_t>( msg_obj.via.array.ptr[1].via.u64 );
+         }
+
+         msgpack::object const & method_obj = msg_obj.via.array.ptr[2];
+         if( method_obj.type == msgpack::type::STR )
+         {
+            const auto& it = _binded_funcs.find( std::string( method_obj.via.str.ptr, method_obj.via.str.size ) );
+            if( it != _binded_funcs.end() )
+            {
+               method = &it->second;
+               prio = method->prio;
+               pool = method->pool;
+            }
+         }
+
+         if( (msg_obj.via.array.size >= 5) && (msg_obj.via.array.ptr[4].type == msgpack::type::POSITIVE_INTEGER) )
+         {
+            uint64_t const requested = msg_obj.via.array.ptr[4].via.u64;
+            prio = static_cast<priority>( requested < priority_levels ? requested : priority_levels - 1 );
+         }
+      }
+
+      int const client = msg.fd();
+      request req( std::move(msg), prio, msgid, method );
+      uint32_t const one_in = _sample_one_in;
+      req.timestamps.sampled = (one_in != 0) && ((_sample_counter++ % one_in) == 0);
+      req.timestamps.stamp( stage::enqueued );
+      tracer::record( trace_event::request_queued, client, msgid, static_cast<uint64_t>(prio) );
+      if( !pool->push( prio, std::move(req) ) )
+      {  // The executor is saturated. Tell the client right away instead of letting it wait
+         tracer::record( trace_event::queue_full, client, msgid );
+         process_message( req, "Server overloaded, executor queue full" );
+      }
+   }
 
    void enforce_method_uniqueness( std::string const & method ) const
    {
+      if( _serving )
+      {  // The transport and UDP threads look methods up without locking
+         throw illegal_bind( "Method " + method + " bound after the server started serving" );
+      }
       const auto& it = _binded_funcs.find( method );
       if( it != _binded_funcs.end() )
       {
@@ -197,57 +748,358 @@ private:
       return error_data;
    }
 
-   void runner_thread()
+   void runner_thread( request & req, bool const shed )
    {
-      while( keep_running_ )
+      req.timestamps.stamp( stage::dequeued );
+      if( shed )
       {
-         if( ! _conn._message_queue.empty_blocking() )
-         {
-            tcp_socket_server::message const recv_msg = _conn._message_queue.pop_back();
+         tracer::record( trace_event::request_shed, req.msg.fd(), req.msgid );
+      }
 
-            // deserialized object is valid during the msgpack::object_handle instance is alive.
-            msgpack::object const msg_obj = recv_msg.msgpack_data.get();
+      if( !shed && (req.method != nullptr) && req.method->batch_caller )
+      {
+         process_batch( req );
+      }
+      else
+      {
+         process_message( req, shed ? "Server overloaded, request shed" : nullptr );
+      }
+   }
 
-            if( msg_obj.via.array.size == 3 )
-            {
-               std::cout << "NOTIFICATION NOT IMPLEMENTED" << std::endl;
-            }
-            else if( msg_obj.via.array.size == 4 )
+   // Runs the request, or just fails it with reject_reason when that is not null
+   void process_message( request & req, char const * reject_reason )
+   {
+      std::chrono::steady_clock::time_point const begin = std::chrono::steady_clock::now();
+
+      // deserialized object is valid during the msgpack::object_handle instance is alive.
+      msgpack::object const msg_obj = req.msg.msgpack_data.get();
+
+      if( msg_obj.type != msgpack::type::ARRAY )
+      {
+         RPC_LOG( error, "Invalid message format from fd %d", req.msg.fd() );
+      }
+      else if( msg_obj.via.array.size == 3 )
+      {
+         RPC_LOG( warning, "Notifications are not implemented" );
+      }
+      else if( (msg_obj.via.array.size == 4) || (msg_obj.via.array.size == 5) )
+      {
+         // convert msgpack::object instance into the original type.
+         // if the type is mismatched, it throws msgpack::type_error exception.
+         // The optional 5th element (priority) was already taken into account by enqueue()
+         envelope_type msg_fields;
+         try
+         {
+            msg_obj.convert(msg_fields);
+         }
+         catch( std::exception const & e )
+         {  // Anyone may send anything, that must not take the server down
+            RPC_LOG( error, "Invalid message format from fd %d (%s)", req.msg.fd(), e.what() );
+            return;
+         }
+         pack_buffer error_data;
+         pack_buffer result_data;
+
+         if( reject_reason != nullptr )
+         {  // Fail fast, the client is better off retrying elsewhere than waiting even longer
+            error_data = handle_exception( std::make_exception_ptr( server_overloaded( reject_reason ) ) );
+         }
+         else
+         {
+            if( req.method != nullptr )
             {
-               // convert msgpack::object instance into the original type.
-               // if the type is mismatched, it throws msgpack::type_error exception.
-               std::tuple< rpc_message, uint32_t, std::string, std::vector<char>> msg_fields;
-               msg_obj.convert(msg_fields);
-               msgpack::object_handle const params_hndl = msgpack::unpack( std::get<3>(msg_fields).data(), std::get<3>(msg_fields).size() );
-               pack_buffer error_data;
-               pack_buffer result_data;
-
-               const auto& it = _binded_funcs.find( std::get<2>(msg_fields) );
-               if( it != _binded_funcs.end() )
+               req.timestamps.stamp( stage::handler_start );
+               tracer::record( trace_event::handler_begin, req.msg.fd(), req.msgid, 1 );
+               bool const accounting = _resource_accounting;
+               resource_usage const usage_before = accounting ? resource_usage::current() : resource_usage();
+               try
                {
-                  try
-                  {
-                     result_data = it->second( params_hndl.get() );
-                  }
-                  catch(...)
-                  {
-                     error_data = handle_exception( std::current_exception() );
-                  }
+                  profiler::method_scope const scope( req.method->name.c_str() );
+                  // Malformed parameters fail this call like a bad argument would
+                  msgpack::object_handle const params_hndl = msgpack::unpack( std::get<3>(msg_fields).data(), std::get<3>(msg_fields).size() );
+                  blob_source const source( req.msg.fds.get() );
+                  blob_sink sink( _conn.blob_fd_threshold() );
+                  result_data = req.method->caller( params_hndl.get() );
+                  result_data.fds = sink.take();
                }
+               catch(...)
+               {
+                  error_data = handle_exception( std::current_exception() );
+               }
+               if( accounting )
+               {
+                  _metrics.record_usage( req.method->metrics_index, resource_usage::current() - usage_before );
+               }
+               req.timestamps.stamp( stage::handler_end );
+               tracer::record( trace_event::handler_end, req.msg.fd(), req.msgid );
+            }
+         }
 
-               auto response_fields = std::make_tuple( rpc_message::response, std::get<1>(msg_fields), static_cast<std::vector<char>>(error_data), static_cast<std::vector<char>>(result_data) );
+         send_response( req, std::get<1>(msg_fields), error_data, result_data );
+
+         if( req.method != nullptr )
+         {
+            record_call( *req.method, begin, std::get<3>(msg_fields).size(), error_data, result_data );
+         }
+      }
+      else
+      {
+         RPC_LOG( error, "Invalid message format from fd %d", req.msg.fd() );
+      }
+   }
+
+   // Serves first together with the other queued requests for the same method
+   void process_batch( request & first )
+   {
+      std::chrono::steady_clock::time_point const begin = std::chrono::steady_clock::now();
+      method_entry const * method = first.method;
+
+      std::vector<request> reqs;
+      std::vector<request> shed;
+      reqs.reserve( method->batch.max_batch );
+      reqs.push_back( std::move(first) );
+      method->pool->queue().pop_matching( [method]( request const & r ){ return r.method == method; },
+                                          method->batch.max_batch - 1, method->batch.window, reqs, shed );
+      uint64_t const dequeued = tsc_clock::ticks();
+
+      for( auto& req : shed )
+      {  // Failed right away rather than after the batch
+         req.timestamps.ticks[static_cast<size_t>(stage::dequeued)] = dequeued;
+         tracer::record( trace_event::request_shed, req.msg.fd(), req.msgid );
+         process_message( req, "Server overloaded, request shed" );
+      }
 
-               pack_buffer response_buffer;
-               msgpack::pack(response_buffer, response_fields);
+      std::vector<batch_call> calls;
+      std::vector<msgpack::object_handle> params;
+      std::vector<std::pair<request *, uint32_t>> callers;
+      std::vector<size_t> bytes_in;
+      calls.reserve( reqs.size() );
+      params.reserve( reqs.size() );
+      callers.reserve( reqs.size() );
+      bytes_in.reserve( reqs.size() );
 
-               _conn.post( recv_msg.client, response_buffer );
+      for( auto& req : reqs )
+      {
+         if( req.timestamps.at( stage::dequeued ) == 0 )
+         {  // Taken along by pop_matching()
+            req.timestamps.ticks[static_cast<size_t>(stage::dequeued)] = dequeued;
+         }
+
+         envelope_type msg_fields;
+         msgpack::object_handle params_hndl;
+         try
+         {
+            req.msg.msgpack_data.get().convert( msg_fields );
+            params_hndl = msgpack::unpack( std::get<3>(msg_fields).data(), std::get<3>(msg_fields).size() );
+         }
+         catch(...)
+         {
+            RPC_LOG( error, "Invalid message format from fd %d", req.msg.fd() );
+            continue;
+         }
+
+         params.push_back( std::move(params_hndl) );
+         calls.push_back( batch_call() );
+         calls.back().params = params.back().get();
+         calls.back().fds = req.msg.fds.get();
+         callers.emplace_back( &req, std::get<1>(msg_fields) );
+         bytes_in.push_back( std::get<3>(msg_fields).size() );
+      }
+
+      uint64_t const handler_start = tsc_clock::ticks();
+      tracer::record( trace_event::handler_begin, reqs.front().msg.fd(), reqs.front().msgid, calls.size() );
+      bool const accounting = _resource_accounting;
+      resource_usage const usage_before = accounting ? resource_usage::current() : resource_usage();
+      {
+         profiler::method_scope const scope( method->name.c_str() );
+         method->batch_caller( calls );
+      }
+      if( accounting && !calls.empty() )
+      {
+         _metrics.record_usage( method->metrics_index, resource_usage::current() - usage_before, calls.size() );
+      }
+      tracer::record( trace_event::handler_end, reqs.front().msg.fd(), reqs.front().msgid );
+      uint64_t const handler_end = tsc_clock::ticks();
+
+      for( auto& caller : callers )
+      {
+         caller.first->timestamps.ticks[static_cast<size_t>(stage::handler_start)] = handler_start;
+         caller.first->timestamps.ticks[static_cast<size_t>(stage::handler_end)] = handler_end;
+      }
+
+      for( size_t i = 0; i < calls.size(); ++i )
+      {
+         send_response( *callers[i].first, callers[i].second, calls[i].error, calls[i].result );
+      }
+
+      // Every call of the batch waited for all of it
+      for( size_t i = 0; i < calls.size(); ++i )
+      {
+         record_call( *method, begin, bytes_in[i], calls[i].error, calls[i].result );
+      }
+   }
+
+   // UDP: runs a notification, or a request whose response goes to reply
+   void process_datagram( msgpack::object const & frame, size_t const max_reply, pack_buffer & reply )
+   {
+      std::chrono::steady_clock::time_point const begin = std::chrono::steady_clock::now();
+      if( (frame.type != msgpack::type::ARRAY) || (frame.via.array.size < 3) || (frame.via.array.size > 5) )
+      {
+         throw bad_call( "Invalid message format" );
+      }
+
+      bool const notification = frame.via.array.size == 3;
+      uint32_t msgid = 0;
+      std::string method;
+      std::vector<char> params;
+      if( notification )
+      {
+         std::tuple< rpc_message, std::string, std::vector<char> > msg_fields;
+         frame.convert( msg_fields );
+         method = std::move( std::get<1>(msg_fields) );
+         params = std::move( std::get<2>(msg_fields) );
+      }
+      else
+      {
+         envelope_type msg_fields;
+         frame.convert( msg_fields );
+         msgid = std::get<1>(msg_fields);
+         method = std::move( std::get<2>(msg_fields) );
+         params = std::move( std::get<3>(msg_fields) );
+      }
+
+      pack_buffer error_data;
+      pack_buffer result_data;
+      auto const it = _binded_funcs.find( method );
+      if( method.compare( 0, 2, "__" ) == 0 )
+      {  // Reserved methods tell about, or act on, the whole process. Anyone may forge a datagram
+         error_data = handle_exception( std::make_exception_ptr( bad_call( "Method " + method + " not served over UDP" ) ) );
+      }
+      else if( it == _binded_funcs.end() )
+      {
+         error_data = handle_exception( std::make_exception_ptr( bad_call( "Method " + method + " not bound" ) ) );
+      }
+      else
+      {
+         method_entry const & entry = it->second;
+         bool const accounting = _resource_accounting;
+         resource_usage const usage_before = accounting ? resource_usage::current() : resource_usage();
+         try
+         {
+            profiler::method_scope const scope( entry.name.c_str() );
+            msgpack::object_handle const params_hndl = msgpack::unpack( params.data(), params.size() );
+            if( entry.batch_caller )
+            {
+               std::vector<batch_call> calls( 1 );
+               calls[0].params = params_hndl.get();
+               entry.batch_caller( calls );
+               error_data = std::move( calls[0].error );
+               result_data = std::move( calls[0].result );
             }
             else
             {
-               std::cout << "INVALID MESSAGE FORMAT" << std::endl;
+               result_data = entry.caller( params_hndl.get() );
             }
          }
+         catch(...)
+         {
+            error_data = handle_exception( std::current_exception() );
+         }
+         if( accounting )
+         {
+            _metrics.record_usage( entry.metrics_index, resource_usage::current() - usage_before );
+         }
+         record_call( entry, begin, params.size(), error_data, result_data );
+      }
+
+      if( notification )
+      {
+         if( !error_data.empty() )
+         {
+            RPC_LOG( debug, "udp: notification %s failed", method.c_str() );
+         }
+         return;
+      }
+
+      msgpack::pack( reply, std::make_tuple( rpc_message::response, msgid, static_cast<std::vector<char>>(error_data), static_cast<std::vector<char>>(result_data) ) );
+      if( reply.size() > max_reply )
+      {  // The transport drops it if even the error is too large
+         reply.clear();
+         error_data = handle_exception( std::make_exception_ptr( bad_call( "Response too large" ) ) );
+         msgpack::pack( reply, std::make_tuple( rpc_message::response, msgid, static_cast<std::vector<char>>(error_data), std::vector<char>() ) );
+      }
+   }
+
+   void record_call( method_entry const & method, std::chrono::steady_clock::time_point const begin, size_t const bytes_in,
+                     pack_buffer const & error_data, pack_buffer const & result_data )
+   {
+      auto const elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - begin ).count();
+      _metrics.record( method.metrics_index, !error_data.empty(), bytes_in, error_data.size() + result_data.size(), elapsed > 0 ? elapsed : 0 );
+   }
+
+   void send_response( request & req, uint32_t const msgid, pack_buffer const & error_data, pack_buffer const & result_data )
+   {
+      auto response_fields = std::make_tuple( rpc_message::response, msgid, static_cast<std::vector<char>>(error_data), static_cast<std::vector<char>>(result_data) );
+
+      pack_buffer response_buffer;
+      if( result_data.fds )
+      {
+         pack_fds_marker( response_buffer, result_data.fds );
+      }
+      msgpack::pack(response_buffer, response_fields);
+
+      tcp_socket_server::sent_handler on_sent;
+      if( req.timestamps.at( stage::handler_start ) != 0 )
+      {  // Only requests that were actually run, rejected and shed ones would skew the stages
+         req.timestamps.stamp( stage::serialized );
+         on_sent = track_stages( req, msgid );
       }
+
+      _conn.post( req.msg.client, std::move(response_buffer), req.prio, std::move(on_sent) );
+   }
+
+   // Records every interval up to serialization, and returns the handler that records the send one
+   tcp_socket_server::sent_handler track_stages( request const & req, uint32_t const msgid )
+   {
+      request_timestamps const & ts = req.timestamps;
+      for( size_t i = 0; i + 1 < interval_count; ++i )
+      {
+         if( (ts.ticks[i] != 0) && (ts.ticks[i + 1] != 0) )
+         {
+            _metrics.record_interval( i, ts.interval_ns( i ) );
+         }
+      }
+
+      uint64_t const serialized = ts.at( stage::serialized );
+      if( !ts.sampled )
+      {
+         return [this, serialized]()
+         {
+            _metrics.record_interval( interval_count - 1, tsc_clock::elapsed_ns( serialized, tsc_clock::ticks() ) );
+         };
+      }
+
+      std::shared_ptr<request_breakdown> sample( new request_breakdown() );
+      sample->method = req.method->name;
+      sample->msgid = msgid;
+      for( size_t i = 0; i + 1 < interval_count; ++i )
+      {
+         sample->ns[i] = ts.interval_ns( i );
+      }
+
+      return [this, serialized, sample]()
+      {
+         uint64_t const send_ns = tsc_clock::elapsed_ns( serialized, tsc_clock::ticks() );
+         _metrics.record_interval( interval_count - 1, send_ns );
+         sample->ns[interval_count - 1] = send_ns;
+
+         std::unique_lock<std::mutex> lck(_samples_mutex);
+         if( _samples.size() >= max_samples )
+         {
+            _samples.pop_front();
+         }
+         _samples.push_back( std::move(*sample) );
+      };
    }
 };
 
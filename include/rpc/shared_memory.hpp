@@ -0,0 +1,459 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "rpc/log.hpp"
+
+namespace rpc
+{
+
+// One direction of a shared memory connection: a byte stream through a ring
+// buffer with a single writer and a single reader, which may live in different
+// processes. Neither side makes a system call while the other keeps up. A
+// reader with nothing to read spins for a while, then parks (see park_reader())
+// and the writer wakes it with a futex, or through a doorbell socket for a
+// reader that waits in poll(). A writer that finds the ring full waits for
+// space the same way.
+class shm_pipe
+{
+public:
+   // How long a reader or writer spins before it parks. Not at all with a single CPU, where spinning
+   // only delays the thread it waits for
+   static uint64_t spin_ns()
+   {
+      static uint64_t const ns = (std::thread::hardware_concurrency() > 1) ? 50000 : 0;
+      return ns;
+   }
+
+   // What both processes share besides the data, on cache lines of their own
+   struct control
+   {
+      alignas(64) std::atomic<uint64_t> head;   // Written by the reader
+      std::atomic<uint32_t> writer_parked;
+      std::atomic<uint32_t> space_seq;          // futex word for the writer
+      alignas(64) std::atomic<uint64_t> tail;   // Written by the writer
+      std::atomic<uint32_t> reader_parked;
+      std::atomic<uint32_t> data_seq;           // futex word for the reader
+   };
+
+   // capacity must be a power of two. If doorbell is a socket, the writer wakes a parked reader
+   // by writing a byte to it rather than through the futex
+   shm_pipe( control * ctl, char * data, size_t const capacity, int const doorbell = -1 ) :
+      _ctl( ctl ), _data( data ), _capacity( capacity ), _doorbell( doorbell )
+   {
+   }
+
+   bool readable() const
+   {
+      return !_broken && (_ctl->tail.load( std::memory_order_acquire ) != _ctl->head.load( std::memory_order_relaxed ));
+   }
+
+   // Whether the peer left the indices in a state no correct writer and reader can reach. Nothing is
+   // read or written from then on, the connection must be dropped
+   bool broken() const
+   {
+      return _broken;
+   }
+
+   // Copies as much of data as fits, returns how much did
+   size_t write_some( char const * data, size_t const len )
+   {
+      uint64_t const tail = _ctl->tail.load( std::memory_order_relaxed );
+      uint64_t const head = _ctl->head.load( std::memory_order_acquire );
+      if( !consistent( head, tail ) )
+      {
+         return 0;
+      }
+      size_t const n = std::min( len, static_cast<size_t>( _capacity - (tail - head) ) );
+      if( n == 0 )
+      {
+         return 0;
+      }
+
+      copy_in( tail, data, n );
+      _ctl->tail.store( tail + n, std::memory_order_release );
+
+      // Pairs with the fence in park_reader(): either the reader sees the data, or we see it parked
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      if( _ctl->reader_parked.load( std::memory_order_relaxed ) && _ctl->reader_parked.exchange( 0 ) )
+      {
+         wake_reader();
+      }
+      return n;
+   }
+
+   // Copies up to len bytes out, returns how many
+   size_t read_some( char * buffer, size_t const len )
+   {
+      uint64_t const head = _ctl->head.load( std::memory_order_relaxed );
+      uint64_t const tail = _ctl->tail.load( std::memory_order_acquire );
+      if( !consistent( head, tail ) )
+      {
+         return 0;
+      }
+      size_t const n = std::min( len, static_cast<size_t>( tail - head ) );
+      if( n == 0 )
+      {
+         return 0;
+      }
+
+      copy_out( head, buffer, n );
+      _ctl->head.store( head + n, std::memory_order_release );
+
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      if( _ctl->writer_parked.load( std::memory_order_relaxed ) && _ctl->writer_parked.exchange( 0 ) )
+      {
+         _ctl->space_seq.fetch_add( 1 );
+         futex_wake( _ctl->space_seq );
+      }
+      return n;
+   }
+
+   // Announces that the reader is about to sleep, so that the next write wakes it. Returns false,
+   // and stays awake, if there is something to read already
+   bool park_reader()
+   {
+      _ctl->reader_parked.store( 1, std::memory_order_relaxed );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      if( readable() )
+      {
+         _ctl->reader_parked.store( 0, std::memory_order_relaxed );
+         return false;
+      }
+      return true;
+   }
+
+   void unpark_reader()
+   {
+      _ctl->reader_parked.store( 0, std::memory_order_relaxed );
+   }
+
+   // Spins, then sleeps on the futex until there is something to read or timeout_ms passed.
+   // Returns readable()
+   bool wait_readable( int const timeout_ms )
+   {
+      if( spin( [this]{ return readable(); } ) )
+      {
+         return true;
+      }
+
+      uint32_t const seq = _ctl->data_seq.load();
+      if( park_reader() )
+      {
+         futex_wait( _ctl->data_seq, seq, timeout_ms );
+         unpark_reader();
+      }
+      return readable();
+   }
+
+   // Same for the writer, until there is room in the ring
+   bool wait_writable( int const timeout_ms )
+   {
+      auto writable = [this]{ return _ctl->tail.load( std::memory_order_relaxed ) - _ctl->head.load( std::memory_order_acquire ) < _capacity; };
+      if( spin( writable ) )
+      {
+         return true;
+      }
+
+      uint32_t const seq = _ctl->space_seq.load();
+      _ctl->writer_parked.store( 1, std::memory_order_relaxed );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      if( !writable() )
+      {
+         futex_wait( _ctl->space_seq, seq, timeout_ms );
+      }
+      _ctl->writer_parked.store( 0, std::memory_order_relaxed );
+      return writable();
+   }
+
+   // Wakes the reader out of wait_readable() whether it is parked or not, e.g. to shut it down
+   void wake_reader()
+   {
+      if( _doorbell != -1 )
+      {
+         char const bell = 0;
+         send( _doorbell, &bell, 1, MSG_NOSIGNAL | MSG_DONTWAIT );
+         return;
+      }
+      _ctl->data_seq.fetch_add( 1 );
+      futex_wake( _ctl->data_seq );
+   }
+
+private:
+   control * _ctl;
+   char * _data;
+   uint64_t _capacity;
+   int _doorbell;
+   bool _broken = false;
+
+   // The other process writes the indices, never more than the capacity apart unless it is broken or
+   // malicious. copy_in() and copy_out() would then go past the ring
+   bool consistent( uint64_t const head, uint64_t const tail )
+   {
+      if( !_broken && (tail - head > _capacity) )
+      {
+         RPC_LOG( error, "shm: inconsistent ring indices (head %llu, tail %llu), dropping the connection",
+                  static_cast<unsigned long long>( head ), static_cast<unsigned long long>( tail ) );
+         _broken = true;
+      }
+      return !_broken;
+   }
+
+   template< class Predicate >
+   static bool spin( Predicate && ready )
+   {
+      auto const deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds( spin_ns() );
+      for( unsigned i = 1; ; ++i )
+      {
+         if( ready() )
+         {
+            return true;
+         }
+         if( ((i & 63) == 0) && (std::chrono::steady_clock::now() > deadline) )
+         {
+            return false;
+         }
+#if defined(__x86_64__) || defined(__i386__)
+         __builtin_ia32_pause();
+#endif
+      }
+   }
+
+   void copy_in( uint64_t const pos, char const * data, size_t const n )
+   {
+      size_t const offset = static_cast<size_t>( pos & (_capacity - 1) );
+      size_t const first = std::min( n, static_cast<size_t>( _capacity - offset ) );
+      memcpy( _data + offset, data, first );
+      memcpy( _data, data + first, n - first );
+   }
+
+   void copy_out( uint64_t const pos, char * buffer, size_t const n ) const
+   {
+      size_t const offset = static_cast<size_t>( pos & (_capacity - 1) );
+      size_t const first = std::min( n, static_cast<size_t>( _capacity - offset ) );
+      memcpy( buffer, _data + offset, first );
+      memcpy( buffer + first, _data, n - first );
+   }
+
+   // Shared between processes, so not FUTEX_PRIVATE_FLAG
+   static void futex_wait( std::atomic<uint32_t> & word, uint32_t const expected, int const timeout_ms )
+   {
+      struct timespec ts;
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      syscall( SYS_futex, reinterpret_cast<uint32_t *>( &word ), FUTEX_WAIT, expected, &ts, nullptr, 0 );
+   }
+
+   static void futex_wake( std::atomic<uint32_t> & word )
+   {
+      syscall( SYS_futex, reinterpret_cast<uint32_t *>( &word ), FUTEX_WAKE, 1, nullptr, nullptr, 0 );
+   }
+};
+
+// The memory of a shared memory connection: a memfd holding a pipe in each
+// direction. The server creates it and passes the fd to the client over the
+// Unix socket the client connected with (see send_fd()), which then carries
+// nothing but doorbells and tells each side when the other one is gone.
+class shm_region
+{
+public:
+   static constexpr size_t default_capacity = 1 << 20;   // Per direction
+
+   // Server side
+   static std::unique_ptr<shm_region> create( size_t const capacity = default_capacity )
+   {
+      if( (capacity == 0) || ((capacity & (capacity - 1)) != 0) )
+      {
+         throw std::invalid_argument( "shm_region: capacity must be a power of two" );
+      }
+
+      int const fd = memfd_create( "rpc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+      if( fd == -1 )
+      {
+         throw std::system_error( errno, std::generic_category(), "shm_region: memfd_create" );
+      }
+      if( ftruncate( fd, static_cast<off_t>( data_offset + 2 * capacity ) ) != 0 )
+      {
+         int const err = errno;
+         close( fd );
+         throw std::system_error( err, std::generic_category(), "shm_region: ftruncate" );
+      }
+      if( fcntl( fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL ) != 0 )
+      {  // Otherwise the client could truncate it under our mapping, and the next access is a SIGBUS
+         int const err = errno;
+         close( fd );
+         throw std::system_error( err, std::generic_category(), "shm_region: sealing" );
+      }
+
+      std::unique_ptr<shm_region> region( new shm_region( fd, data_offset + 2 * capacity, -1 ) );
+      region->_header->magic = magic;
+      region->_header->capacity = capacity;
+      return region;
+   }
+
+   // Client side, with the fd received from the server. doorbell is the socket to ring the server through
+   static std::unique_ptr<shm_region> attach( int const fd, int const doorbell )
+   {
+      struct stat st;
+      int const seals = fcntl( fd, F_GET_SEALS );
+      if( (seals == -1) || !(seals & F_SEAL_SHRINK) || (fstat( fd, &st ) != 0) || (static_cast<size_t>( st.st_size ) < data_offset) )
+      {
+         close( fd );
+         throw std::runtime_error( "shm_region: invalid region" );
+      }
+      std::unique_ptr<shm_region> region( new shm_region( fd, static_cast<size_t>( st.st_size ), doorbell ) );
+      if( (region->_header->magic != magic) || (region->_header->capacity != (region->_size - data_offset) / 2) )
+      {
+         throw std::runtime_error( "shm_region: invalid region" );
+      }
+      return region;
+   }
+
+   shm_region( shm_region const & ) = delete;
+   shm_region& operator=( shm_region const & ) = delete;
+
+   ~shm_region()
+   {
+      munmap( _base, _size );
+      close( _fd );
+   }
+
+   int fd() const
+   {
+      return _fd;
+   }
+
+   shm_pipe & to_server()
+   {
+      return *_to_server;
+   }
+
+   shm_pipe & to_client()
+   {
+      return *_to_client;
+   }
+
+private:
+   static constexpr uint64_t magic = 0x72706373686d3031;   // "rpcshm01"
+   static constexpr size_t data_offset = 4096;
+
+   struct header
+   {
+      uint64_t magic;
+      uint64_t capacity;
+      shm_pipe::control to_server;
+      shm_pipe::control to_client;
+   };
+
+   int _fd;
+   size_t _size;
+   void * _base;
+   header * _header;
+   std::unique_ptr<shm_pipe> _to_server;
+   std::unique_ptr<shm_pipe> _to_client;
+
+   shm_region( int const fd, size_t const size, int const doorbell ) : _fd( fd ), _size( size )
+   {
+      static_assert( sizeof(header) <= data_offset, "shm_region: header too large" );
+
+      _base = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+      if( _base == MAP_FAILED )
+      {
+         int const err = errno;
+         close( fd );
+         throw std::system_error( err, std::generic_category(), "shm_region: mmap" );
+      }
+      _header = static_cast<header *>( _base );
+
+      uint64_t const capacity = (size - data_offset) / 2;
+      char * data = static_cast<char *>( _base ) + data_offset;
+      _to_server.reset( new shm_pipe( &_header->to_server, data, capacity, doorbell ) );
+      _to_client.reset( new shm_pipe( &_header->to_client, data + capacity, capacity ) );
+   }
+};
+
+// Passes fd to the process at the other end of the Unix socket sock. Returns false on errors
+inline bool send_fd( int const sock, int const fd )
+{
+   char byte = 0;
+   struct iovec iov;
+   iov.iov_base = &byte;
+   iov.iov_len = 1;
+
+   union
+   {
+      struct cmsghdr align;
+      char buffer[CMSG_SPACE(sizeof(int))];
+   } control;
+   memset( &control, 0, sizeof(control) );
+
+   struct msghdr msg;
+   memset( &msg, 0, sizeof(msg) );
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.buffer;
+   msg.msg_controllen = sizeof(control.buffer);
+
+   struct cmsghdr * cmsg = CMSG_FIRSTHDR( &msg );
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN( sizeof(int) );
+   memcpy( CMSG_DATA( cmsg ), &fd, sizeof(int) );
+
+   return sendmsg( sock, &msg, MSG_NOSIGNAL ) == 1;
+}
+
+// Counterpart of send_fd(), blocks until the fd arrives. Returns -1 on errors
+inline int receive_fd( int const sock )
+{
+   char byte = 0;
+   struct iovec iov;
+   iov.iov_base = &byte;
+   iov.iov_len = 1;
+
+   union
+   {
+      struct cmsghdr align;
+      char buffer[CMSG_SPACE(sizeof(int))];
+   } control;
+   memset( &control, 0, sizeof(control) );
+
+   struct msghdr msg;
+   memset( &msg, 0, sizeof(msg) );
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.buffer;
+   msg.msg_controllen = sizeof(control.buffer);
+
+   if( recvmsg( sock, &msg, MSG_CMSG_CLOEXEC ) != 1 )
+   {
+      return -1;
+   }
+
+   struct cmsghdr * cmsg = CMSG_FIRSTHDR( &msg );
+   if( (cmsg == nullptr) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS) )
+   {
+      return -1;
+   }
+   int fd;
+   memcpy( &fd, CMSG_DATA( cmsg ), sizeof(int) );
+   return fd;
+}
+
+};
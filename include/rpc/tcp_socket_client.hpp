@@ -1,37 +1,75 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <iostream>
 #include <unistd.h>
 #include <poll.h>
+#include <mutex>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include "rpc/transport_defs.hpp"
+#include "rpc/endpoint.hpp"
+#include "rpc/shared_memory.hpp"
+#include "rpc/zerocopy.hpp"
+#include "rpc/blob.hpp"
 #include "rpc/concurrent_queue.hpp"
+#include "rpc/log.hpp"
 
 class tcp_socket_client
 {
 public:
-   tcp_socket_client( char const * addr, uint16_t const port )
+   // Despite its name, connects to Unix domain socket endpoints as well
+   explicit tcp_socket_client( rpc::endpoint const & endpoint ) :
+      _passes_fds( endpoint.kind() == rpc::endpoint::family::unix_domain )
    {
-      struct sockaddr_in my_addr;
-      my_addr.sin_family      = AF_INET;
-      my_addr.sin_port        = htons(port);
-      memset( &(my_addr.sin_zero), 0, 8 );
-
-      if( inet_pton( AF_INET, addr, &(my_addr.sin_addr.s_addr) ) != 1 )
+      if( endpoint.kind() == rpc::endpoint::family::udp )
       {
-         throw std::invalid_argument ( "Invalid address" );
+         throw std::invalid_argument( "tcp_socket_client: UDP endpoints take an rpc::udp_client" );
       }
 
-      _fd = socket( AF_INET, SOCK_STREAM, 0 );
+      struct sockaddr_storage my_addr;
+      socklen_t const my_addr_len = endpoint.to_sockaddr( my_addr );
+
+      _fd = socket( endpoint.socket_family(), SOCK_STREAM, 0 );
       if( _fd == -1 )
       {
          throw std::system_error( errno, std::generic_category(), "tcp_socket_client: error creating UNIX socket" );;
       }
 
-      int ret = connect( _fd, reinterpret_cast<sockaddr*>(&my_addr), sizeof(my_addr) );
+      int ret = connect( _fd, reinterpret_cast<sockaddr*>(&my_addr), my_addr_len );
       if ( ret == -1 )
       {
-         throw std::system_error( errno, std::generic_category(), "tcp_socket_client: connect error errno=" + std::to_string(errno) );
+         int const err = errno;
+         close( _fd );
+         throw std::system_error( err, std::generic_category(), "tcp_socket_client: connect error errno=" + std::to_string(err) );
+      }
+
+      if( endpoint.is_tcp() )
+      {
+         int const nodelay = 1;   // Requests are complete frames, do not let Nagle hold them back
+         setsockopt( _fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay) );
+         _zerocopy.enable( _fd );
+      }
+      else if( endpoint.kind() == rpc::endpoint::family::shared_memory )
+      {  // The server answers with the rings, the socket then only carries doorbells
+         int const region_fd = rpc::receive_fd( _fd );
+         if( region_fd == -1 )
+         {
+            int const err = errno;
+            close( _fd );
+            throw std::system_error( err, std::generic_category(), "tcp_socket_client: no shared memory from server" );
+         }
+         try
+         {
+            _shm = rpc::shm_region::attach( region_fd, _fd );
+         }
+         catch(...)
+         {
+            close( _fd );
+            throw;
+         }
       }
 
       _comm_processor_thrd = std::thread( &tcp_socket_client::comm_processor, this );
@@ -53,15 +91,51 @@ public:
          shutdown( _fd, SHUT_RDWR );
          close( _fd );
       }
+      if( _shm )
+      {
+         _shm->to_client().wake_reader();
+      }
 
       _comm_processor_thrd.join();
    }
 
-   void post( pack_buffer const & data )
+   // Large frames are sent with MSG_ZEROCOPY, and kept until the kernel is done with them
+   void post( pack_buffer data )
    {
+      std::unique_lock<std::mutex> lck(_send_mutex);   // Do not interleave frames of concurrent callers
+      if( !_connected )
+      {
+         throw std::runtime_error( "write: Server closed connection" );
+      }
+      if( _shm )
+      {
+         post_shm( data );
+         return;
+      }
+
+      size_t const threshold = _zerocopy_threshold.load( std::memory_order_relaxed );
+      bool zerocopy = false;
+      if( _zerocopy.used() )
+      {  // Release the frames sent earlier, then see whether the kernel really sent from them
+         _zerocopy.reap( _fd );
+      }
+      if( (threshold != 0) && (data.size() >= threshold) )
+      {
+         zerocopy = _zerocopy.enabled();
+      }
+
       for( size_t sent = 0; sent < data.size(); /*no increment*/ )
       {
-         int ret = send( _fd, &data[sent], (data.size() - sent), 0 );
+         ssize_t ret;
+         if( (sent == 0) && data.fds )
+         {  // The descriptors go with the first byte
+            ret = rpc::send_with_fds( _fd, &data[sent], (data.size() - sent), *data.fds, MSG_NOSIGNAL );
+         }
+         else
+         {
+            ret = zerocopy ? _zerocopy.send( _fd, &data[sent], (data.size() - sent) )
+                           : send( _fd, &data[sent], (data.size() - sent), MSG_NOSIGNAL );
+         }
          if ( ret >= 0 )
          {
             sent += ret;
@@ -72,40 +146,202 @@ public:
          }
          else
          {
-            std::cout << "write: error errno=" << errno << std::endl;
+            RPC_LOG( warning, "write: send interrupted, errno=%d", errno );
          }
       }
+
+      if( zerocopy )
+      {
+         _zerocopy.hold( std::move(data) );
+      }
+   }
+
+   // Blobs from this size on go out as memfd descriptors instead of bytes, 0 to always send bytes.
+   // Unix socket endpoints only, see rpc/blob.hpp
+   void set_blob_fd_threshold( size_t const bytes )
+   {
+      _blob_fd_threshold = bytes;
    }
 
-   concurrent_queue<msgpack::object_handle> _message_queue;
+   size_t blob_fd_threshold() const
+   {
+      return _passes_fds ? _blob_fd_threshold.load( std::memory_order_relaxed ) : 0;
+   }
+
+   // False once the server closed the connection, or it failed. Nothing can be sent from then on
+   bool connected() const
+   {
+      return _connected;
+   }
+
+   // Frames from this size on are sent with MSG_ZEROCOPY, 0 to always copy. TCP only
+   void set_zerocopy_threshold( size_t const bytes )
+   {
+      _zerocopy_threshold = bytes;
+   }
+
+   struct message
+   {
+      msgpack::object_handle data;
+      std::shared_ptr<rpc::fd_list> fds;   // Passed along with the frame, for the blobs in it
+   };
+
+   concurrent_queue<message> _message_queue;
 
 private:
+   static constexpr size_t read_size = 64 * 1024;
+
    bool _keep_running = true;
+   bool const _passes_fds;   // Unix sockets, where blobs may come as descriptors
    int _fd;
+   std::unique_ptr<rpc::shm_region> _shm;   // Shared memory endpoints only
+   std::mutex _send_mutex;
+   rpc::zerocopy_sender _zerocopy;
+   std::atomic<size_t> _zerocopy_threshold{ rpc::zerocopy_sender::default_threshold };
+   std::atomic<size_t> _blob_fd_threshold{ 0 };
+   std::atomic<bool> _connected{ true };
    std::thread _comm_processor_thrd;
 
+   // Lets the reader of _message_queue know with an empty message, so that it fails the calls waiting
+   void disconnected( char const * reason )
+   {
+      RPC_LOG( warning, "%s", reason );
+      _connected = false;
+      _message_queue.push_back( message() );
+   }
+
+   void post_shm( pack_buffer const & data )
+   {
+      rpc::shm_pipe & pipe = _shm->to_server();
+      for( size_t sent = 0; sent < data.size(); /*no increment*/ )
+      {
+         size_t const n = pipe.write_some( &data[sent], data.size() - sent );
+         sent += n;
+         if( pipe.broken() )
+         {
+            throw std::runtime_error( "write: shared memory ring corrupted" );
+         }
+         if( (n == 0) && !pipe.wait_writable( 100 ) && !server_alive() )
+         {
+            throw std::runtime_error( "write: Server closed connection" );
+         }
+      }
+   }
+
+   // The server closes the socket when it goes away, and never writes to it
+   bool server_alive()
+   {
+      struct pollfd pfd;
+      pfd.fd = _fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      return poll( &pfd, 1, 0 ) == 0;
+   }
+
+   // Blocks until there is something to read, or an error or hang-up recv() reports. False if only
+   // the error queue has something
+   bool wait_readable()
+   {
+      struct pollfd pfd;
+      pfd.fd = _fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if( poll( &pfd, 1, -1 ) <= 0 )
+      {
+         return true;
+      }
+      return !((pfd.revents & POLLERR) && !(pfd.revents & (POLLIN | POLLHUP)));
+   }
+
    void comm_processor()
    {
+      // Messages may be split across, or share, reads
+      msgpack::unpacker unpacker;
+
+      if( _shm )
+      {
+         shm_processor( unpacker );
+         return;
+      }
+
+      rpc::fd_list fds;                          // Received, not claimed by a frame yet
+      std::shared_ptr<rpc::fd_list> next_fds;   // Announced for the next frame
       while( _keep_running )
       {
-         char read_buf[256];
-         int ret = recv( _fd, read_buf, sizeof(read_buf), 0 );
+         if( _zerocopy.used() && !wait_readable() && _zerocopy.reap( _fd ) )
+         {  // Only zerocopy completions came, they release frames that would stay pinned until the next post().
+            // Any other error is left to recv() to report
+            continue;
+         }
+
+         unpacker.reserve_buffer( read_size );
+         ssize_t const ret = _passes_fds ? rpc::recv_with_fds( _fd, unpacker.buffer(), unpacker.buffer_capacity(), fds )
+                                         : recv( _fd, unpacker.buffer(), unpacker.buffer_capacity(), 0 );
          if ( ret > 0 )
          {
-            auto message = msgpack::unpack(read_buf, ret);
-            _message_queue.push_back( std::move(message) );
+            unpacker.buffer_consumed( ret );
+
+            msgpack::object_handle obj;
+            while( unpacker.next( obj ) )
+            {
+               size_t fd_count = 0;
+               if( rpc::is_fds_marker( obj.get(), fd_count ) )
+               {  // The descriptors of the next frame, they came in along with the marker
+                  next_fds = fds.take_front( fd_count );
+                  continue;
+               }
+               _message_queue.push_back( message{ std::move(obj), std::move(next_fds) } );
+            }
+
+            if( !fds.empty() && ((unpacker.nonparsed_size() == 0) || (fds.size() > rpc::fd_list::max_per_message)) )
+            {  // No marker claimed them, and none can come for them
+               RPC_LOG( warning, "comm_processor: closing %zu descriptors no frame claimed", fds.size() );
+               fds.clear();
+            }
          }
          else if( _keep_running )
          {  // If still running, treat any error that migh have happened
             if( ret == 0 )
             {
-               throw std::runtime_error( "comm_processor: Server closed connection" );
+               disconnected( "comm_processor: Server closed connection" );
+               return;
             }
             else if ( (errno != EAGAIN) && (errno != EINTR) && (errno != EWOULDBLOCK) )
             {
-               throw std::system_error( errno, std::generic_category(), "comm_processor: recv error" );
+               disconnected( ("comm_processor: recv error " + std::to_string( errno )).c_str() );
+               return;
             }
          }
       }
    }
+
+   void shm_processor( msgpack::unpacker & unpacker )
+   {
+      rpc::shm_pipe & pipe = _shm->to_client();
+      while( _keep_running )
+      {
+         unpacker.reserve_buffer( read_size );
+         size_t const n = pipe.read_some( unpacker.buffer(), unpacker.buffer_capacity() );
+         if( n > 0 )
+         {
+            unpacker.buffer_consumed( n );
+
+            msgpack::object_handle obj;
+            while( unpacker.next( obj ) )
+            {
+               _message_queue.push_back( message{ std::move(obj), nullptr } );
+            }
+         }
+         else if( pipe.broken() )
+         {
+            disconnected( "comm_processor: shared memory ring corrupted" );
+            return;
+         }
+         else if( !pipe.wait_readable( 100 ) && _keep_running && !server_alive() )
+         {
+            disconnected( "comm_processor: Server closed connection" );
+            return;
+         }
+      }
+   }
 };
@@ -1,53 +1,120 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <iomanip>
 #include <thread>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <queue>
+#include <atomic>
+#include <unordered_map>
 #include <iostream>
 #include <unistd.h>
 #include <cstring>
 #include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/sockios.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include "rpc/transport_defs.hpp"
-#include "rpc/concurrent_queue.hpp"
+#include "rpc/endpoint.hpp"
+#include "rpc/priority.hpp"
+#include "rpc/tsc.hpp"
+#include "rpc/trace.hpp"
+#include "rpc/log.hpp"
+#include "rpc/capture.hpp"
+#include "rpc/connection_stats.hpp"
+#include "rpc/io_uring.hpp"
+#include "rpc/shared_memory.hpp"
+#include "rpc/zerocopy.hpp"
+#include "rpc/blob.hpp"
+#include "rpc/placement.hpp"
 #include "msgpack.hpp"
 
 class tcp_socket_server
 {
+   struct connection;
+
 public:
-   tcp_socket_server( char const * addr, uint16_t const port )
+   struct message
    {
-      struct sockaddr_in my_addr;
-      my_addr.sin_family      = AF_INET;
-      my_addr.sin_port        = htons(port);
-      memset( &(my_addr.sin_zero), 0, 8 );
+      message() : received(0) {}
+      message( std::shared_ptr<connection> c, msgpack::object_handle&& obj, std::shared_ptr<rpc::fd_list> f = nullptr ) :
+         client(std::move(c)), msgpack_data(std::move(obj)), received( rpc::tsc_clock::ticks() ), fds( std::move(f) ) {}
+
+      // The socket of the client, for logs and traces. Responses go to client, see post()
+      int fd() const
+      {
+         return client ? client->fd : -1;
+      }
+
+      std::shared_ptr<connection> client;   // Keeps the socket open, so its fd cannot go to another client
+      msgpack::object_handle msgpack_data;
+      uint64_t received;   // rpc::tsc_clock ticks
+      std::shared_ptr<rpc::fd_list> fds;   // Passed along with the frame, for the blobs in it
+   };
 
-      if( inet_pton( AF_INET, addr, &(my_addr.sin_addr.s_addr) ) != 1 )
+   using message_handler = std::function< void ( message && ) >;
+   using sent_handler = std::function< void () >;
+
+   // handler is called from the transport thread for every message received. With io_backend::io_uring
+   // the transport thread also sends whatever post() could not send right away. The socket listens
+   // right away, but connections are only served once start() is called.
+   // Despite its name, serves Unix domain socket endpoints as well
+   tcp_socket_server( rpc::endpoint const & endpoint, message_handler handler, rpc::io_backend const backend = rpc::io_backend::poll ) :
+      _endpoint( endpoint ), _handler( std::move(handler) )
+   {
+      if( _endpoint.kind() == rpc::endpoint::family::udp )
       {
-         throw std::invalid_argument ( "Invalid address" );
+         throw std::invalid_argument( "tcp_socket_server: UDP endpoints are served by server::listen_udp()" );
+      }
+
+      struct sockaddr_storage my_addr;
+      socklen_t const my_addr_len = _endpoint.to_sockaddr( my_addr );
+      if( !_endpoint.is_tcp() && !_endpoint.is_abstract() )
+      {  // The socket file of a previous instance would make bind() fail
+         remove_stale_socket( my_addr, my_addr_len );
       }
 
-      _server_fd = socket( AF_INET, SOCK_STREAM, 0 );
+      _server_fd = socket( _endpoint.socket_family(), SOCK_STREAM, 0 );
       if( _server_fd == -1 )
       {
          throw std::system_error( errno, std::generic_category(), "tcp_socket_server: error creating UNIX socket" );;
       }
 
-      int ret = bind( _server_fd, (struct sockaddr*)&my_addr, sizeof(my_addr) );
+      if( _endpoint.is_tcp() )
+      {
+         int const reuse = 1;   // Do not wait for TIME_WAIT connections of a previous instance to go away
+         setsockopt( _server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse) );
+      }
+
+      int ret = bind( _server_fd, (struct sockaddr*)&my_addr, my_addr_len );
       if ( ret == -1 )
       {
          throw std::system_error( errno, std::generic_category(), "tcp_socket_server: bind error" );
       }
 
-      ret = listen( _server_fd, 5 );
+      ret = listen( _server_fd, SOMAXCONN );
       if ( ret == -1 )
       {
          throw std::system_error( errno, std::generic_category(), "tcp_socket_server: listen error" );
       }
 
-      _comm_processor_thrd = std::thread( &tcp_socket_server::comm_processor, this );
+      if( (backend == rpc::io_backend::io_uring) && (_endpoint.kind() == rpc::endpoint::family::shared_memory) )
+      {  // Frames do not go through the sockets
+         RPC_LOG( warning, "io_uring does not apply to shared memory endpoints, using poll" );
+      }
+      else if( backend == rpc::io_backend::io_uring )
+      {
+         setup_uring();
+      }
    }
 
    tcp_socket_server( tcp_socket_server&& rhs ) = delete;
@@ -60,16 +127,481 @@ public:
    ~tcp_socket_server()
    {
       _keep_running = false;
-      _comm_processor_thrd.join();
+      wake_transport();
+      if( _comm_processor_thrd.joinable() )
+      {
+         _comm_processor_thrd.join();
+      }
 
       if( _server_fd != -1 )
       {
          close( _server_fd );
+         if( !_endpoint.is_tcp() && !_endpoint.is_abstract() )
+         {
+            unlink( _endpoint.address().c_str() );
+         }
+      }
+      if( _wake_fd != -1 )
+      {
+         close( _wake_fd );
+      }
+   }
+
+   // The backend in use, poll if io_uring was asked for but is not available
+   rpc::io_backend backend() const
+   {
+      return _backend;
+   }
+
+   // Queues data to be sent to client, as received in a message. Frames are never interleaved: whichever thread finds the
+   // connection idle becomes its writer and drains the queue, most important (then oldest) frame first,
+   // so small high priority responses are not stuck behind a backlog of bulk ones.
+   // on_sent, if set, is called by the writing thread once the last byte of data has been written.
+   // With io_uring post() only sends what the socket takes right away, and hands the rest over to the
+   // transport thread, which sends the queued frames of many connections in one system call. The
+   // transport thread itself never waits for a client either, whatever the backend. A client that
+   // lets more than max_queued_bytes pile up is not reading, and is disconnected.
+   void post( std::shared_ptr<connection> conn, pack_buffer data, rpc::priority const prio = rpc::priority::normal, sent_handler on_sent = sent_handler() )
+   {
+      int const client_fd = conn->fd;
+      rpc::tracer::record( rpc::trace_event::response_queued, client_fd, 0, data.size() );
+
+      std::unique_lock<std::mutex> lck(conn->mutex);
+      if( conn->closed )
+      {
+         RPC_LOG( warning, "write: connection %d closed. Message lost.", client_fd );
+         return;
+      }
+      conn->queued_bytes += data.size();
+      conn->output.emplace( prio, conn->output_seq++, std::move(data), std::move(on_sent) );
+      if( (conn->queued_bytes > max_queued_bytes) && !conn->closed )
+      {  // The transport thread sees the hangup and closes the connection
+         RPC_LOG( warning, "write: %zu bytes queued for fd %d, disconnecting it", static_cast<size_t>( conn->queued_bytes ), client_fd );
+         conn->closed = true;
+         shutdown( client_fd, SHUT_RDWR );
+      }
+      if( conn->writing )
+      {  // Some other thread is already writing to this connection and will send it
+         return;
+      }
+
+      conn->writing = true;
+      if( (_backend == rpc::io_backend::io_uring) || (std::this_thread::get_id() == _comm_processor_thrd.get_id()) )
+      {
+         if( send_inline( *conn, lck ) )
+         {
+            conn->writing = false;
+            return;
+         }
+         lck.unlock();
+         hand_over( std::move(conn) );
+         return;
+      }
+
+      while( !conn->output.empty() && !conn->closed )
+      {
+         // priority_queue::top() is const, but the element is popped right away
+         outgoing & top = const_cast<outgoing&>( conn->output.top() );
+         pack_buffer frame = std::move( top.data );
+         sent_handler frame_sent = std::move( top.on_sent );
+         conn->output.pop();
+         size_t const frame_size = frame.size();
+         conn->queued_bytes -= frame_size;
+
+         lck.unlock();
+         try
+         {
+            if( conn->shm ? send_frame_shm( *conn, frame ) : send_frame( *conn, frame ) )
+            {
+               increment( conn->bytes_out, frame_size );
+               increment( conn->frames_out, 1 );
+               if( frame_sent )
+               {
+                  frame_sent();
+               }
+            }
+         }
+         catch(...)
+         {
+            lck.lock();
+            conn->writing = false;
+            throw;
+         }
+         lck.lock();
+      }
+      conn->writing = false;
+   }
+
+   // Starts recording every request received, as it came off the wire, to a capture file (see
+   // rpc/capture.hpp). Replaces any capture in progress. Requests partly received already are not
+   // recorded
+   void start_capture( char const * path )
+   {
+      std::unique_ptr<rpc::capture_writer> writer( new rpc::capture_writer( path ) );
+
+      std::unique_lock<std::mutex> lck(_capture_mutex);
+      _capture.writer = std::move( writer );
+      _capture.start = rpc::tsc_clock::ticks();
+      _capture.connections.clear();
+      _capturing = true;
+   }
+
+   // Returns the number of frames captured
+   uint64_t stop_capture()
+   {
+      std::unique_lock<std::mutex> lck(_capture_mutex);
+      _capturing = false;
+      uint64_t const frames = _capture.writer ? _capture.writer->frames() : 0;
+      _capture.writer.reset();
+      return frames;
+   }
+
+   // Frames from this size on are sent with MSG_ZEROCOPY, 0 to always copy. Poll backend, TCP only
+   void set_zerocopy_threshold( size_t const bytes )
+   {
+      _zerocopy_threshold = bytes;
+   }
+
+   // Blobs from this size on go out as memfd descriptors instead of bytes, 0 (the default) to always
+   // send bytes. Descriptors from clients are only accepted while it is not 0, the kernel closes
+   // them otherwise. Unix socket endpoints with the poll backend only, see rpc/blob.hpp
+   void set_blob_fd_threshold( size_t const bytes )
+   {
+      _blob_fd_threshold = bytes;
+   }
+
+   // The threshold for blobs sent on this transport, 0 if it cannot pass descriptors
+   size_t blob_fd_threshold() const
+   {
+      return passes_fds() ? _blob_fd_threshold.load( std::memory_order_relaxed ) : 0;
+   }
+
+   // Counters and the latest TCP_INFO sample of every connection
+   rpc::transport_stats stats()
+   {
+      std::vector<std::shared_ptr<connection>> conns;
+      {
+         std::unique_lock<std::mutex> lck(_connections_mutex);
+         for( auto const & it : _connections )
+         {
+            conns.push_back( it.second );
+         }
+      }
+
+      rpc::transport_stats ret;
+      for( auto const & conn : conns )
+      {
+         rpc::connection_stats c;
+         c.fd = conn->fd;
+         c.peer = conn->peer;
+         c.bytes_in = conn->bytes_in.load( std::memory_order_relaxed );
+         c.bytes_out = conn->bytes_out.load( std::memory_order_relaxed );
+         c.frames_in = conn->frames_in.load( std::memory_order_relaxed );
+         c.frames_out = conn->frames_out.load( std::memory_order_relaxed );
+         {
+            std::unique_lock<std::mutex> lck(conn->mutex);
+            c.queued_frames = conn->output.size() + (conn->unfinished ? 1 : 0);
+            c.queued_bytes = conn->queued_bytes;
+            c.max_rtt_us = conn->max_rtt_us;
+            c.tcp = conn->tcp;
+         }
+         ret.add( c );
+      }
+      return ret;
+   }
+
+   // How often the transport thread samples TCP_INFO of every connection, 0 to stop sampling
+   void set_tcp_sampling_interval( std::chrono::milliseconds const interval )
+   {
+      _tcp_sampling_ms = static_cast<uint64_t>( interval.count() );
+   }
+
+   // Starts the transport thread, which accepts and reads connections from then on. Further calls do nothing
+   void start()
+   {
+      std::unique_lock<std::mutex> lck(_start_mutex);
+      if( !_comm_processor_thrd.joinable() )
+      {
+         _comm_processor_thrd = std::thread( &tcp_socket_server::comm_processor, this );
+      }
+   }
+
+   // Moves the transport thread to cpus, or has it start there. Connections accepted from then on get
+   // their buffers from the memory of the node it runs on
+   void set_cpus( std::vector<int> const & cpus )
+   {
+      std::unique_lock<std::mutex> lck(_start_mutex);
+      _cpus = cpus;
+      if( _comm_processor_thrd.joinable() )
+      {
+         rpc::pin_thread( _comm_processor_thrd.native_handle(), cpus );
+      }
+   }
+
+   // Where the transport thread runs. Only the name until start()
+   rpc::placed_thread placement()
+   {
+      std::unique_lock<std::mutex> lck(_start_mutex);
+      if( !_comm_processor_thrd.joinable() )
+      {
+         rpc::placed_thread ret;
+         ret.name = "transport";
+         return ret;
+      }
+      while( _comm_tid.load() == 0 )
+      {  // Only right after start()
+         std::this_thread::yield();
+      }
+      return rpc::describe_thread( "transport", _comm_processor_thrd.native_handle(), _comm_tid.load() );
+   }
+
+   // After traffic, the poll backend keeps polling without blocking for this long before it parks in
+   // poll(), and TCP connections accepted from then on get SO_BUSY_POLL for as long. 0 to park right away
+   void set_busy_poll( std::chrono::microseconds const window )
+   {
+      _busy_poll_us = static_cast<uint64_t>( window.count() );
+   }
+
+private:
+   static constexpr size_t read_size = 64 * 1024;
+   static constexpr unsigned ring_entries = 4096;       // io_uring submission queue
+   static constexpr unsigned recv_buffers = 512;        // Shared by all connections, a power of two
+   static constexpr size_t recv_buffer_size = 16 * 1024;
+   static constexpr size_t max_batch_frames = 64;       // Sent to one connection per submission
+   static constexpr uint64_t max_queued_bytes = 64 * 1024 * 1024;   // Per connection, see post()
+
+   // Removes the socket file at the endpoint path if no server listens on it any more. Throws if
+   // the path is something else, or a server still answers there
+   void remove_stale_socket( struct sockaddr_storage const & addr, socklen_t const addr_len )
+   {
+      std::string const & path = _endpoint.address();
+      struct stat st;
+      if( lstat( path.c_str(), &st ) == -1 )
+      {
+         if( errno == ENOENT )
+         {
+            return;
+         }
+         throw std::system_error( errno, std::generic_category(), "tcp_socket_server: cannot check " + path );
+      }
+      if( !S_ISSOCK( st.st_mode ) )
+      {
+         throw std::system_error( EEXIST, std::generic_category(), "tcp_socket_server: " + path + " is not a socket" );
+      }
+
+      int const probe = socket( AF_UNIX, SOCK_STREAM, 0 );
+      if( probe == -1 )
+      {
+         throw std::system_error( errno, std::generic_category(), "tcp_socket_server: error creating UNIX socket" );
+      }
+      int const ret = connect( probe, reinterpret_cast<struct sockaddr const *>( &addr ), addr_len );
+      int const err = errno;
+      close( probe );
+      if( ret == 0 )
+      {
+         throw std::system_error( EADDRINUSE, std::generic_category(), "tcp_socket_server: a server already listens on " + path );
+      }
+      if( err != ECONNREFUSED )
+      {
+         throw std::system_error( err, std::generic_category(), "tcp_socket_server: cannot check " + path );
+      }
+      unlink( path.c_str() );
+   }
+
+   struct capture_state
+   {
+      std::unique_ptr<rpc::capture_writer> writer;
+      uint64_t start = 0;
+      std::unordered_map<int, uint32_t> connections;   // fd to the number it has in the capture
+   };
+
+   struct outgoing
+   {
+      outgoing( rpc::priority p, uint64_t s, pack_buffer&& d, sent_handler&& h ) : prio(p), seq(s), data(std::move(d)), on_sent(std::move(h)) {}
+      rpc::priority prio;
+      uint64_t seq;
+      pack_buffer data;
+      sent_handler on_sent;
+
+      // std::priority_queue puts the "largest" element on top
+      bool operator<( outgoing const & rhs ) const
+      {
+         return (prio != rhs.prio) ? (prio > rhs.prio) : (seq > rhs.seq);
+      }
+   };
+
+   // Owns the socket, which is closed once the transport thread is done with the connection and no
+   // request from it is left to answer
+   struct connection
+   {
+      connection( int f, std::string p, std::shared_ptr<rpc::shm_region> s ) : fd( f ), peer( std::move(p) ), shm( std::move(s) ) {}
+
+      ~connection()
+      {
+         close( fd );
+      }
+
+      int const fd;
+      std::string const peer;
+      std::shared_ptr<rpc::shm_region> const shm;   // Shared memory endpoints: frames go through it, not the socket
+      std::atomic<uint64_t> bytes_in{ 0 };     // Written by the transport thread
+      std::atomic<uint64_t> frames_in{ 0 };
+      std::atomic<uint64_t> bytes_out{ 0 };    // Written by the current writer
+      std::atomic<uint64_t> frames_out{ 0 };
+
+      std::mutex mutex;
+      bool writing = false;
+      bool closed = false;
+      uint64_t output_seq = 0;
+      std::priority_queue<outgoing> output;
+      std::unique_ptr<outgoing> unfinished;   // io_uring: rest of a frame post() sent part of, goes out first
+      rpc::zerocopy_sender zerocopy;          // Poll backend over TCP
+      uint64_t queued_bytes = 0;
+      rpc::tcp_sample tcp;
+      uint32_t max_rtt_us = 0;
+   };
+
+   // io_uring: frames of one connection being sent, as a chain of linked sends
+   struct send_batch
+   {
+      std::vector<pack_buffer> frames;
+      std::vector<sent_handler> handlers;
+      std::vector<size_t> sent;   // Bytes of each frame sent so far
+      unsigned pending = 0;       // Completions still to come
+      int error = 0;
+   };
+
+   // What the transport thread keeps of every connection
+   struct reader
+   {
+      msgpack::unpacker unpacker;
+      std::shared_ptr<connection> conn;
+      std::unique_ptr<send_batch> batch;   // io_uring only
+      bool closing = false;                // io_uring: the client is gone, close once batch is done
+      rpc::fd_list fds;                    // Received, not claimed by a frame yet
+      std::shared_ptr<rpc::fd_list> next_fds;   // Announced for the next frame
+      std::vector<char> partial_frame;     // Capturing: the bytes of the next frame in earlier reads
+      bool frame_tracked = true;           // partial_frame has all of them, the frame did not begin before the capture
+   };
+
+   enum class uring_op : uint8_t
+   {
+      accept = 1,
+      recv   = 2,
+      send   = 3,
+      wake   = 4,
+      cancel = 5
+   };
+
+   bool  _keep_running = true;
+   rpc::endpoint const _endpoint;
+   int _server_fd;
+   message_handler _handler;
+   std::mutex _connections_mutex;
+   std::unordered_map<int, std::shared_ptr<connection>> _connections;
+   rpc::io_backend _backend = rpc::io_backend::poll;
+#if RPC_HAVE_IO_URING
+   std::unique_ptr<rpc::uring> _ring;
+   std::unique_ptr<rpc::buffer_ring> _buffers;
+#endif
+   int _wake_fd = -1;                 // eventfd the io_uring transport thread waits on along with the sockets
+   uint64_t _wake_value = 0;
+   std::atomic<bool> _transport_waiting{ false };
+   std::mutex _handover_mutex;
+   std::vector<std::shared_ptr<connection>> _handed_over;   // Connections with frames for the transport thread to send
+   std::atomic<uint64_t> _tcp_sampling_ms{ 1000 };
+   std::atomic<uint64_t> _busy_poll_us{ 0 };
+   std::atomic<size_t> _zerocopy_threshold{ rpc::zerocopy_sender::default_threshold };
+   std::atomic<size_t> _blob_fd_threshold{ 0 };
+   std::atomic<bool> _capturing{ false };
+   std::mutex _capture_mutex;
+   capture_state _capture;
+   std::thread _comm_processor_thrd;
+   std::atomic<int> _comm_tid{ 0 };
+   std::mutex _start_mutex;          // Guards starting _comm_processor_thrd and _cpus
+   std::vector<int> _cpus;
+
+   // io_uring receives do not collect descriptors
+   bool passes_fds() const
+   {
+      return (_endpoint.kind() == rpc::endpoint::family::unix_domain) && (_backend == rpc::io_backend::poll);
+   }
+
+   // Single writer, see connection
+   static inline void increment( std::atomic<uint64_t> & counter, uint64_t const n )
+   {
+      counter.store( counter.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+   }
+
+   // address:port, or the process at the other end of a Unix socket, whose own address is usually unnamed
+   static std::string peer_name( int const client_fd, struct sockaddr_storage const & addr )
+   {
+      if( addr.ss_family == AF_UNIX )
+      {
+         struct ucred cred;
+         socklen_t len = sizeof(cred);
+         if( getsockopt( client_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len ) == 0 )
+         {
+            return "unix:pid=" + std::to_string( cred.pid );
+         }
+         return "unix";
+      }
+
+      struct sockaddr_in const & in = reinterpret_cast<struct sockaddr_in const &>( addr );
+      char ip[INET_ADDRSTRLEN] = {};
+      inet_ntop( AF_INET, &in.sin_addr, ip, sizeof(ip) );
+      return std::string( ip ) + ":" + std::to_string( ntohs( in.sin_port ) );
+   }
+
+   // Samples every connection if the sampling interval has passed since next_sample was set
+   void sample_tcp_info( std::unordered_map<int, reader> const & readers, uint64_t & next_sample )
+   {
+      uint64_t const interval_ms = _tcp_sampling_ms.load( std::memory_order_relaxed );
+      uint64_t const now = rpc::tsc_clock::monotonic_ns();
+      if( (interval_ms == 0) || (now < next_sample) || !_endpoint.is_tcp() )
+      {
+         return;
+      }
+      next_sample = now + interval_ms * 1000000u;
+
+      for( auto const & it : readers )
+      {
+         rpc::tcp_sample sample;
+         struct tcp_info info;
+         socklen_t len = sizeof(info);
+         memset( &info, 0, sizeof(info) );
+         if( getsockopt( it.first, IPPROTO_TCP, TCP_INFO, &info, &len ) != 0 )
+         {
+            continue;
+         }
+         sample.rtt_us = info.tcpi_rtt;
+         sample.rttvar_us = info.tcpi_rttvar;
+         sample.snd_cwnd = info.tcpi_snd_cwnd;
+         sample.unacked = info.tcpi_unacked;
+         sample.retransmits = info.tcpi_total_retrans;
+         sample.lost = info.tcpi_lost;
+
+         int outq = 0;
+         if( ioctl( it.first, SIOCOUTQ, &outq ) == 0 )
+         {
+            sample.unsent_bytes = static_cast<uint64_t>( outq );
+         }
+
+         connection & conn = *it.second.conn;
+         std::unique_lock<std::mutex> lck(conn.mutex);
+         conn.tcp = sample;
+         conn.max_rtt_us = std::max( conn.max_rtt_us, sample.rtt_us );
       }
    }
 
-   void post( int client_fd, pack_buffer const & data )
+   // Returns false if the connection went away before all of data was written. Large frames are sent
+   // with MSG_ZEROCOPY, data is then moved to conn.zerocopy until the kernel is done with it
+   bool send_frame( connection & conn, pack_buffer & data )
    {
+      int const client_fd = conn.fd;
+      size_t const threshold = _zerocopy_threshold.load( std::memory_order_relaxed );
+      bool const zerocopy = (threshold != 0) && (data.size() >= threshold) && conn.zerocopy.enabled();
+
       struct pollfd pollfds[1];
       pollfds[0].fd = client_fd;
       pollfds[0].events = POLLOUT;
@@ -84,77 +616,240 @@ public:
          }
          else if( ret == 0 )
          {  // Timeout
-            std::cout << "write: poll timeout" << std::endl;
+            rpc::tracer::record( rpc::trace_event::send_timeout, client_fd );
+            RPC_LOG( warning, "write: poll timeout on fd %d", client_fd );
+         }
+         else if( (pollfds[0].revents & POLLERR) && conn.zerocopy.used() && conn.zerocopy.reap( client_fd ) )
+         {  // Completions of zerocopy sends, not an error
          }
          else if( !(pollfds[0].revents & POLLOUT) )
          {  // Some error on the socket
-            std::cout << "write: connection closed. Message lost." << std::endl;
-            break;
+            RPC_LOG( warning, "write: connection %d closed. Message lost.", client_fd );
+            return false;
          }
          else
          {
-            ret = send( client_fd, &data[sent], (data.size() - sent), 0 );
+            if( (sent == 0) && data.fds )
+            {  // The descriptors go with the first byte
+               ret = rpc::send_with_fds( client_fd, &data[sent], (data.size() - sent), *data.fds, MSG_NOSIGNAL );
+            }
+            else
+            {
+               ret = zerocopy ? conn.zerocopy.send( client_fd, &data[sent], (data.size() - sent) )
+                              : send( client_fd, &data[sent], (data.size() - sent), MSG_NOSIGNAL );
+            }
             if ( ret >= 0 )
             {
                sent += ret;
             }
+            else if( (errno == EPIPE) || (errno == ECONNRESET) )
+            {  // Hung up, or disconnected by post()
+               RPC_LOG( warning, "write: connection %d closed. Message lost.", client_fd );
+               return false;
+            }
             else if ( (errno != EAGAIN) && (errno != EINTR) )
             {
                throw std::system_error( errno, std::generic_category(), "write: send error" );
             }
             else
             {
-               std::cout << "write: error errno=" << errno << std::endl;
+               RPC_LOG( warning, "write: send interrupted on fd %d, errno=%d", client_fd, errno );
             }
          }
 
          pollfds[0].revents = 0;
       }
+
+      rpc::tracer::record( rpc::trace_event::frame_written, client_fd, 0, data.size() );
+      if( zerocopy )
+      {
+         conn.zerocopy.hold( std::move(data) );
+      }
+      return true;
    }
 
-   struct message
+   // Same as send_frame(), through the shared memory ring of conn
+   bool send_frame_shm( connection & conn, pack_buffer const & data )
    {
-      message( int fd, msgpack::object_handle&& obj ) : client(fd), msgpack_data(std::move(obj)) {}
-      int client;
-      msgpack::object_handle msgpack_data;
-   };
+      rpc::shm_pipe & pipe = conn.shm->to_client();
+      for( size_t sent = 0; sent < data.size(); /*no increment*/ )
+      {
+         size_t const n = pipe.write_some( &data[sent], data.size() - sent );
+         sent += n;
+         if( pipe.broken() )
+         {  // The transport thread sees the hangup and closes the connection
+            shutdown( conn.fd, SHUT_RDWR );
+            return false;
+         }
+         if( (n == 0) && !pipe.wait_writable( 100 ) )
+         {
+            std::unique_lock<std::mutex> lck(conn.mutex);
+            if( conn.closed )
+            {
+               RPC_LOG( warning, "write: connection %d closed. Message lost.", conn.fd );
+               return false;
+            }
+         }
+      }
 
-   concurrent_queue<message> _message_queue;
+      rpc::tracer::record( rpc::trace_event::frame_written, conn.fd, 0, data.size() );
+      return true;
+   }
 
-private:
-   bool  _keep_running = true;
-   int _server_fd;
-   std::thread _comm_processor_thrd;
+   // Makes the connection unreachable to post(). The socket goes with the last reference to it
+   void forget_connection( int client_fd )
+   {
+      std::shared_ptr<connection> conn;
+      {
+         std::unique_lock<std::mutex> lck(_connections_mutex);
+         auto it = _connections.find( client_fd );
+         if( it != _connections.end() )
+         {
+            conn = it->second;
+            _connections.erase( it );
+         }
+      }
+
+      if( conn )
+      {
+         std::unique_lock<std::mutex> lck(conn->mutex);
+         conn->closed = true;
+      }
+      rpc::tracer::record( rpc::trace_event::connection_closed, client_fd );
+      if( _capturing )
+      {  // A later connection may get the same fd
+         std::unique_lock<std::mutex> lck(_capture_mutex);
+         _capture.connections.erase( client_fd );
+      }
+   }
+
+   // data and size are the part of the frame in the latest read, the rest of it is in r.partial_frame
+   void capture_frame( int const client_fd, reader & r, char const * data, size_t const size )
+   {
+      if( !r.frame_tracked )
+      {  // It began before the capture did
+         return;
+      }
+      if( !r.partial_frame.empty() )
+      {
+         r.partial_frame.insert( r.partial_frame.end(), data, data + size );
+         data = r.partial_frame.data();
+      }
+      size_t const frame_size = r.partial_frame.empty() ? size : r.partial_frame.size();
+
+      std::unique_lock<std::mutex> lck(_capture_mutex);
+      if( !_capture.writer )
+      {
+         return;
+      }
+
+      uint32_t const number = static_cast<uint32_t>( _capture.connections.size() );
+      uint32_t const connection = _capture.connections.emplace( client_fd, number ).first->second;
+      uint64_t const ns = rpc::tsc_clock::elapsed_ns( _capture.start, rpc::tsc_clock::ticks() );
+
+      try
+      {
+         _capture.writer->write( ns, connection, data, frame_size );
+      }
+      catch( std::exception const & e )
+      {  // Disk full or the like. Serving requests matters more than recording them
+         RPC_LOG( error, "capture: %s, capture stopped", e.what() );
+         _capturing = false;
+         _capture.writer.reset();
+      }
+   }
 
    void comm_processor()
    {
-      std::cout << "comm_processor: started" << std::endl;
+      RPC_LOG( debug, "comm_processor: started" );
+      rpc::tracer::set_thread_name( "rpc-io" );
+      {
+         std::unique_lock<std::mutex> lck(_start_mutex);
+         if( !_cpus.empty() )
+         {  // Before allocating anything, so that it comes from the node's memory
+            rpc::pin_thread( pthread_self(), _cpus );
+         }
+      }
+      _comm_tid = rpc::current_tid();
+
+      // Messages may be split across, or share, reads. Each connection gets its own streaming unpacker
+      std::unordered_map<int, reader> readers;
+
+#if RPC_HAVE_IO_URING
+      if( _backend == rpc::io_backend::io_uring )
+      {
+         uring_loop( readers );
+      }
+      else
+#endif
+      {
+         poll_loop( readers );
+      }
+
+      for( auto const & it : readers )
+      {
+         forget_connection( it.first );
+      }
 
+      RPC_LOG( debug, "comm_processor: finished" );
+   }
+
+   void poll_loop( std::unordered_map<int, reader> & readers )
+   {
       std::vector<struct pollfd> pollfds;
       pollfds.reserve( 2 );
+      uint64_t next_tcp_sample = 0;
 
       struct pollfd pfd;
       pfd.fd = _server_fd;
       pfd.events = POLLIN;
       pfd.revents = 0;
       pollfds.push_back( pfd );  // Add the own server to the list
+      bool const shared_memory = _endpoint.kind() == rpc::endpoint::family::shared_memory;
+      auto last_active = std::chrono::steady_clock::now();
+
+      // Connections with frames post() left to this thread, which sends them as the clients make room
+      std::unordered_map<int, std::shared_ptr<connection>> flushing;
 
       while( _keep_running )
       {
-         int ret = poll( pollfds.data(), pollfds.size(), 1000 );
+         flush_handed_over( flushing, pollfds );
+
+         // Clients only ring the doorbell when we are parked in poll()
+         bool spinning = false;
+         if( !shared_memory && (_busy_poll_us.load( std::memory_order_relaxed ) != 0) )
+         {
+            auto const window = std::chrono::microseconds( _busy_poll_us.load( std::memory_order_relaxed ) );
+            spinning = (std::chrono::steady_clock::now() - last_active) < window;
+         }
+         int timeout_ms = (spinning || (shared_memory && poll_shm( readers ))) ? 0 : 1000;
+         if( shared_memory && !flushing.empty() )
+         {  // Nothing tells when a ring has room again
+            timeout_ms = std::min( timeout_ms, 10 );
+         }
+         int ret = poll( pollfds.data(), pollfds.size(), timeout_ms );
          if (ret < 0)
          {  // Some error on the poll
             throw std::system_error( errno, std::generic_category(), "comm_processor: poll error" );
          }
-         else if( ret > 0 )
+         if( ret > 0 )
          {
+            last_active = std::chrono::steady_clock::now();
+         }
+
+         sample_tcp_info( readers, next_tcp_sample );
+
+         if( ret > 0 )
+         {
+            std::vector<struct pollfd> accepted;   // Added after the loop, so that it is not invalidated
+
             for( auto it = pollfds.begin(); it != pollfds.end(); it++ )
             {
                if( it->fd == _server_fd )
                {  // Treat the server
                   if( it->revents & POLLIN )
                   {
-                     struct sockaddr_in cli_addr;
+                     struct sockaddr_storage cli_addr;
                      socklen_t clilen = sizeof(cli_addr);
                      int client_fd = accept(_server_fd, (struct sockaddr *) &cli_addr, &clilen);
                      if ( (client_fd == -1) )
@@ -166,30 +861,68 @@ private:
                      }
                      else
                      {
+                        std::shared_ptr<rpc::shm_region> shm;
+                        if( shared_memory && !(shm = offer_shm( client_fd )) )
+                        {
+                           close( client_fd );
+                           continue;
+                        }
+                        add_connection( readers, client_fd, cli_addr, std::move(shm) );
+
                         struct pollfd pfd;
                         pfd.fd = client_fd;
                         pfd.events = POLLIN;
                         pfd.revents = 0;
-                        pollfds.push_back( pfd );  // Add client to the list
-
-                        //std::cout << "Client connected" << std::endl;
+                        accepted.push_back( pfd );  // Add client to the list
                      }
                   }
                }
-               else
+               else if( it->revents != 0 )
                {  // Treat the client
-                  char read_buf[256];
-                  int ret = recv( it->fd, read_buf, sizeof(read_buf), 0 );
+                  reader & r = readers[it->fd];
+                  if( !(it->revents & (POLLIN | POLLHUP | POLLERR)) )
+                  {  // Only room to write, flush_handed_over() takes it
+                     it->revents = 0;
+                     continue;
+                  }
+                  if( !(it->revents & (POLLIN | POLLHUP)) && r.conn->zerocopy.used() )
+                  {  // Only completions of zerocopy sends, recv() would block
+                     r.conn->zerocopy.reap( it->fd );
+                     it->revents = 0;
+                     continue;
+                  }
+
+                  int ret;
+                  if( shared_memory )
+                  {  // Only doorbells come through the socket, frames are in the ring
+                     char doorbells[64];
+                     ret = recv( it->fd, doorbells, sizeof(doorbells), 0 );
+                     if( ret > 0 )
+                     {
+                        receive_shm( it->fd, r );
+                     }
+                  }
+                  else
+                  {
+                     r.unpacker.reserve_buffer( read_size );
+                     ret = (blob_fd_threshold() != 0) ? rpc::recv_with_fds( it->fd, r.unpacker.buffer(), r.unpacker.buffer_capacity(), r.fds )
+                                        : recv( it->fd, r.unpacker.buffer(), r.unpacker.buffer_capacity(), 0 );
+                     if( ret > 0 )
+                     {
+                        received( it->fd, r, static_cast<size_t>( ret ) );
+                     }
+                  }
+
                   if ( ret > 0 )
                   {
-                     auto message = msgpack::unpack(read_buf, ret);
-                     _message_queue.emplace_back( it->fd, std::move(message) );
                      it->revents = 0;
                   }
                   else if( (ret == 0) || (errno == ECONNRESET) )
                   {
                      //std::cout << "Client closed connection" << std::endl;
-                     close( it->fd );
+                     readers.erase( it->fd );
+                     flushing.erase( it->fd );
+                     forget_connection( it->fd );
                      it = pollfds.erase( it );
                      --it; // The loop will increment it
                   }
@@ -201,11 +934,696 @@ private:
 
                it->revents = 0;
             }
+
+            pollfds.insert( pollfds.end(), accepted.begin(), accepted.end() );
          }
       }
+   }
+
+   // Poll backend: sends what the connections handed over by post() take without blocking, and has
+   // poll() watch those with frames left for room to write
+   void flush_handed_over( std::unordered_map<int, std::shared_ptr<connection>> & flushing, std::vector<struct pollfd> & pollfds )
+   {
+      {
+         std::unique_lock<std::mutex> lck(_handover_mutex);
+         for( auto & conn : _handed_over )
+         {
+            flushing[conn->fd] = std::move( conn );
+         }
+         _handed_over.clear();
+      }
+      if( flushing.empty() )
+      {
+         return;
+      }
+
+      for( auto & pfd : pollfds )
+      {
+         auto const it = flushing.find( pfd.fd );
+         if( it == flushing.end() )
+         {
+            continue;
+         }
+
+         std::unique_lock<std::mutex> lck(it->second->mutex);
+         if( send_inline( *it->second, lck ) )
+         {
+            it->second->writing = false;
+            lck.unlock();
+            flushing.erase( it );
+            pfd.events = POLLIN;
+         }
+         else if( !it->second->shm )
+         {  // The doorbell socket of a shared memory connection is always writable
+            pfd.events = POLLIN | POLLOUT;
+         }
+      }
+   }
+
+   reader & add_connection( std::unordered_map<int, reader> & readers, int const client_fd, struct sockaddr_storage const & addr,
+                            std::shared_ptr<rpc::shm_region> shm = nullptr )
+   {
+      rpc::tracer::record( rpc::trace_event::connection_accepted, client_fd );
 
-      std::cout << "comm_processor: finished" << std::endl;
+      if( _endpoint.is_tcp() )
+      {
+         int const nodelay = 1;   // Responses are complete frames, do not let Nagle hold them back
+         setsockopt( client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay) );
+
+#ifdef SO_BUSY_POLL
+         int const busy_poll = static_cast<int>( _busy_poll_us.load( std::memory_order_relaxed ) );
+         if( (busy_poll != 0) && (setsockopt( client_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll) ) == -1) )
+         {  // Raising it above net.core.busy_read takes CAP_NET_ADMIN
+            RPC_LOG( debug, "comm_processor: SO_BUSY_POLL refused on fd %d (%d)", client_fd, errno );
+         }
+#endif
+      }
+
+      // Constructed in place, a moved unpacker keeps pointing to the original one's zone
+      reader & r = readers.emplace( std::piecewise_construct, std::forward_as_tuple(client_fd), std::forward_as_tuple() ).first->second;
+      r.conn = std::make_shared<connection>( client_fd, peer_name( client_fd, addr ), std::move(shm) );
+      if( _endpoint.is_tcp() && (_backend == rpc::io_backend::poll) )
+      {  // io_uring sends are not tracked for completions
+         r.conn->zerocopy.enable( client_fd );
+      }
+
+      std::unique_lock<std::mutex> lck(_connections_mutex);
+      _connections[client_fd] = r.conn;
+      return r;
+   }
+
+   // Shared memory endpoints: sets up the rings of a new connection and passes them to the client
+   std::shared_ptr<rpc::shm_region> offer_shm( int const client_fd )
+   {
+      try
+      {
+         std::shared_ptr<rpc::shm_region> shm( rpc::shm_region::create() );
+         if( !rpc::send_fd( client_fd, shm->fd() ) )
+         {
+            throw std::system_error( errno, std::generic_category(), "send_fd" );
+         }
+         return shm;
+      }
+      catch( std::exception const & e )
+      {
+         RPC_LOG( warning, "comm_processor: shared memory setup failed on fd %d (%s)", client_fd, e.what() );
+         return nullptr;
+      }
+   }
+
+   // Drains the ring of every shared memory connection, spinning a while if they are all empty. Returns
+   // true if anything came in, or false once every connection is parked, waiting for a doorbell
+   bool poll_shm( std::unordered_map<int, reader> & readers )
+   {
+      auto const deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds( rpc::shm_pipe::spin_ns() );
+      do
+      {
+         bool received = false;
+         for( auto & it : readers )
+         {
+            it.second.conn->shm->to_server().unpark_reader();
+            received = receive_shm( it.first, it.second ) || received;
+         }
+         if( received )
+         {
+            return true;
+         }
+      } while( !readers.empty() && (std::chrono::steady_clock::now() < deadline) );
+
+      for( auto & it : readers )
+      {
+         if( !it.second.conn->shm->to_server().park_reader() )
+         {
+            return true;
+         }
+      }
+      return false;
+   }
+
+   // Returns whether there was anything to read
+   bool receive_shm( int const client_fd, reader & r )
+   {
+      rpc::shm_pipe & pipe = r.conn->shm->to_server();
+      bool any = false;
+      for( ;; )
+      {
+         r.unpacker.reserve_buffer( read_size );
+         size_t const n = pipe.read_some( r.unpacker.buffer(), r.unpacker.buffer_capacity() );
+         if( n == 0 )
+         {
+            if( pipe.broken() )
+            {  // The poll loop sees the hangup and closes the connection
+               shutdown( client_fd, SHUT_RDWR );
+            }
+            return any;
+         }
+         any = true;
+         received( client_fd, r, n );
+      }
+   }
+
+   // bytes were just read into the unpacker's buffer
+   void received( int const client_fd, reader & r, size_t const bytes )
+   {
+      msgpack::unpacker & unpacker = r.unpacker;
+      char const * const data = unpacker.buffer();
+      unpacker.buffer_consumed( bytes );
+      increment( r.conn->bytes_in, bytes );
+      rpc::tracer::record( rpc::trace_event::data_received, client_fd, 0, bytes );
+
+      // Where the bytes of the next frame in this read start, those of earlier reads may be gone from
+      // the unpacker's buffer, so the capture keeps a copy of them
+      bool const capturing = _capturing.load( std::memory_order_relaxed );
+      char const * frame_begin = data;
+
+      msgpack::object_handle obj;
+      while( unpacker.next( obj ) )
+      {
+         size_t fd_count = 0;
+         if( rpc::is_fds_marker( obj.get(), fd_count ) )
+         {  // The descriptors of the next frame, they came in along with the marker
+            r.next_fds = r.fds.take_front( fd_count );
+            frame_begin = unpacker.nonparsed_buffer();
+            r.partial_frame.clear();
+            r.frame_tracked = true;
+            continue;
+         }
+
+         rpc::tracer::record( rpc::trace_event::frame_received, client_fd );
+         increment( r.conn->frames_in, 1 );
+         if( capturing )
+         {
+            capture_frame( client_fd, r, frame_begin, unpacker.nonparsed_buffer() - frame_begin );
+         }
+         _handler( message( r.conn, std::move(obj), std::move(r.next_fds) ) );
+
+         frame_begin = unpacker.nonparsed_buffer();
+         r.partial_frame.clear();
+         r.frame_tracked = true;
+      }
+
+      if( frame_begin != data + bytes )
+      {  // A frame continues in the next read
+         if( capturing && r.frame_tracked )
+         {
+            r.partial_frame.insert( r.partial_frame.end(), frame_begin, data + bytes );
+         }
+         else
+         {
+            r.partial_frame.clear();
+            r.frame_tracked = false;
+         }
+      }
+
+      if( !r.fds.empty() && ((unpacker.nonparsed_size() == 0) || (r.fds.size() > rpc::fd_list::max_per_message)) )
+      {  // No marker claimed them, and none can come for them: they go with the first byte of theirs
+         RPC_LOG( warning, "comm_processor: closing %zu descriptors no frame claimed on fd %d", r.fds.size(), client_fd );
+         r.fds.clear();
+      }
+   }
+
+   void setup_uring()
+   {
+#if RPC_HAVE_IO_URING
+      try
+      {
+         std::unique_ptr<rpc::uring> ring( new rpc::uring( ring_entries ) );
+         if( !ring->supports( IORING_OP_SEND_ZC ) )
+         {  // No way to probe for multishot recv, which came with the same release
+            throw std::runtime_error( "kernel older than 6.0" );
+         }
+         _buffers.reset( new rpc::buffer_ring( *ring, 0, recv_buffers, recv_buffer_size ) );
+         _ring = std::move( ring );
+
+         _wake_fd = eventfd( 0, EFD_CLOEXEC );
+         if( _wake_fd == -1 )
+         {
+            throw std::system_error( errno, std::generic_category(), "eventfd" );
+         }
+         _backend = rpc::io_backend::io_uring;
+      }
+      catch( std::exception const & e )
+      {
+         RPC_LOG( warning, "io_uring unavailable (%s), falling back to poll", e.what() );
+         _buffers.reset();
+         _ring.reset();
+      }
+#else
+      RPC_LOG( warning, "io_uring not supported by this build, falling back to poll" );
+#endif
+   }
+
+   void wake_transport()
+   {
+      if( _wake_fd != -1 )
+      {
+         uint64_t const one = 1;
+         if( write( _wake_fd, &one, sizeof(one) ) < 0 )
+         {  // Only fails if the counter is about to overflow, the transport thread is awake then
+         }
+      }
+   }
+
+   // Called by post() with the connection's writing flag set
+   void hand_over( std::shared_ptr<connection> && conn )
+   {
+      {
+         std::unique_lock<std::mutex> lck(_handover_mutex);
+         _handed_over.push_back( std::move(conn) );
+      }
+
+      if( _transport_waiting.load() )
+      {
+         wake_transport();
+      }
+   }
+
+   // Sends queued frames for as long as the connection takes them without blocking, which spares small
+   // responses the hop to the transport thread. Returns false, what is left being for the transport
+   // thread, once it does not. Called with the connection locked and its writing flag set
+   bool send_inline( connection & conn, std::unique_lock<std::mutex> & lck )
+   {
+      while( (conn.unfinished || !conn.output.empty()) && !conn.closed )
+      {
+         std::unique_ptr<outgoing> frame = std::move( conn.unfinished );
+         if( !frame )
+         {
+            // priority_queue::top() is const, but the element is popped right away
+            outgoing & top = const_cast<outgoing&>( conn.output.top() );
+            frame.reset( new outgoing( top.prio, top.seq, std::move(top.data), std::move(top.on_sent) ) );
+            conn.output.pop();
+         }
+         conn.queued_bytes -= frame->data.size();
+
+         lck.unlock();
+         ssize_t const ret = send_some( conn, frame->data );
+         if( ret == static_cast<ssize_t>( frame->data.size() ) )
+         {
+            increment( conn.bytes_out, frame->data.size() );
+            increment( conn.frames_out, 1 );
+            rpc::tracer::record( rpc::trace_event::frame_written, conn.fd, 0, frame->data.size() );
+            if( frame->on_sent )
+            {
+               frame->on_sent();
+            }
+            lck.lock();
+            continue;
+         }
+
+         if( ret > 0 )
+         {
+            increment( conn.bytes_out, static_cast<uint64_t>( ret ) );
+            frame->data.erase( frame->data.begin(), frame->data.begin() + ret );
+            frame->data.fds.reset();   // They went with the first byte
+         }
+         lck.lock();
+         if( (ret < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) )
+         {
+            RPC_LOG( warning, "write: connection %d closed. Message lost.", conn.fd );
+            conn.closed = true;
+            shutdown( conn.fd, SHUT_RDWR );
+            return true;
+         }
+         conn.queued_bytes += frame->data.size();
+         conn.unfinished = std::move( frame );
+         return false;
+      }
+      return true;
+   }
+
+   // Whatever the connection takes of data right away, -1 with errno set if it takes nothing
+   static ssize_t send_some( connection & conn, pack_buffer const & data )
+   {
+      if( conn.shm )
+      {
+         rpc::shm_pipe & pipe = conn.shm->to_client();
+         size_t const n = pipe.write_some( data.data(), data.size() );
+         errno = pipe.broken() ? EPIPE : EAGAIN;
+         return ((n == 0) || pipe.broken()) ? -1 : static_cast<ssize_t>( n );
+      }
+      if( data.fds )
+      {
+         return rpc::send_with_fds( conn.fd, data.data(), data.size(), *data.fds, MSG_DONTWAIT | MSG_NOSIGNAL );
+      }
+      return send( conn.fd, data.data(), data.size(), MSG_DONTWAIT | MSG_NOSIGNAL );
+   }
+
+   static void discard_output( connection & conn )
+   {
+      std::unique_lock<std::mutex> lck(conn.mutex);
+      conn.unfinished.reset();
+      while( !conn.output.empty() )
+      {
+         conn.output.pop();
+      }
+      conn.queued_bytes = 0;
+      conn.writing = false;
+   }
+
+#if RPC_HAVE_IO_URING
+   static uint64_t user_data( uring_op const op, int const fd, uint32_t const index = 0 )
+   {
+      return (static_cast<uint64_t>( op ) << 56) | (static_cast<uint64_t>( index ) << 32) | static_cast<uint32_t>( fd );
+   }
+
+   struct io_uring_sqe * next_sqe()
+   {
+      struct io_uring_sqe * sqe = _ring->get_sqe();
+      if( sqe == nullptr )
+      {  // Full, make room
+         _ring->submit_and_wait( 0 );
+         sqe = _ring->get_sqe();
+         if( sqe == nullptr )
+         {
+            throw std::runtime_error( "comm_processor: io_uring submission queue full" );
+         }
+      }
+      return sqe;
+   }
+
+   void arm_accept()
+   {
+      struct io_uring_sqe * sqe = next_sqe();
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = _server_fd;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->user_data = user_data( uring_op::accept, _server_fd );
+   }
+
+   // Keeps receiving into buffers of the ring until the connection ends or the ring runs dry
+   void arm_recv( int const client_fd )
+   {
+      struct io_uring_sqe * sqe = next_sqe();
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = client_fd;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = _buffers->group();
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->user_data = user_data( uring_op::recv, client_fd );
+   }
+
+   void arm_wake()
+   {
+      struct io_uring_sqe * sqe = next_sqe();
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = _wake_fd;
+      sqe->addr = reinterpret_cast<uint64_t>( &_wake_value );
+      sqe->len = sizeof(_wake_value);
+      sqe->user_data = user_data( uring_op::wake, _wake_fd );
+   }
+
+   // One io_uring_enter() per iteration submits the sends of every connection handed over and
+   // reaps the accepts, receives and sends of all of them
+   void uring_loop( std::unordered_map<int, reader> & readers )
+   {
+      uint64_t next_tcp_sample = 0;
+      std::vector<std::shared_ptr<connection>> handed_over;
+
+      arm_accept();
+      arm_wake();
+
+      while( _keep_running )
+      {
+         {
+            std::unique_lock<std::mutex> lck(_handover_mutex);
+            handed_over.swap( _handed_over );
+         }
+         for( auto& conn : handed_over )
+         {
+            start_batch( readers, conn );
+         }
+         handed_over.clear();
+
+         // Writers wake us up through the eventfd if they find us waiting, see hand_over()
+         _transport_waiting.store( true );
+         bool idle;
+         {
+            std::unique_lock<std::mutex> lck(_handover_mutex);
+            idle = _handed_over.empty();
+         }
+         _ring->submit_and_wait( idle ? 1 : 0, 1000 );
+         _transport_waiting.store( false, std::memory_order_relaxed );
+
+         sample_tcp_info( readers, next_tcp_sample );
+
+         _ring->for_each_cqe( [this, &readers]( struct io_uring_cqe const & cqe ){ complete( readers, cqe ); } );
+      }
+
+      // Sends in flight point into the frames of readers, and receives into the buffer ring
+      struct io_uring_sqe * sqe = next_sqe();
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+      sqe->user_data = user_data( uring_op::cancel, -1 );
+      auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds( 1 );
+      bool in_flight = true;
+      while( in_flight && (std::chrono::steady_clock::now() < deadline) )
+      {
+         _ring->submit_and_wait( 1, 100 );
+         _ring->for_each_cqe( [this, &readers]( struct io_uring_cqe const & cqe ){ complete( readers, cqe ); } );
+         in_flight = std::any_of( readers.begin(), readers.end(), []( std::pair<int const, reader> const & it ){ return bool( it.second.batch ); } );
+      }
+
+      _buffers.reset();
+      _ring.reset();
+   }
+
+   void complete( std::unordered_map<int, reader> & readers, struct io_uring_cqe const & cqe )
+   {
+      auto const op = static_cast<uring_op>( cqe.user_data >> 56 );
+      int const fd = static_cast<int>( cqe.user_data & 0xffffffff );
+      bool const more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+      switch( op )
+      {
+         case uring_op::accept:
+            if( cqe.res >= 0 )
+            {
+               struct sockaddr_storage addr;
+               socklen_t len = sizeof(addr);
+               memset( &addr, 0, sizeof(addr) );
+               getpeername( cqe.res, reinterpret_cast<struct sockaddr *>( &addr ), &len );
+               add_connection( readers, cqe.res, addr );
+               arm_recv( cqe.res );
+            }
+            else if( (cqe.res != -EAGAIN) && (cqe.res != -EINTR) && (cqe.res != -ECANCELED) )
+            {
+               throw std::system_error( -cqe.res, std::generic_category(), "comm_processor: accept error" );
+            }
+            if( !more && _keep_running )
+            {
+               arm_accept();
+            }
+            break;
+
+         case uring_op::recv:
+         {
+            auto it = readers.find( fd );
+            if( cqe.flags & IORING_CQE_F_BUFFER )
+            {
+               uint16_t const id = static_cast<uint16_t>( cqe.flags >> IORING_CQE_BUFFER_SHIFT );
+               if( (cqe.res > 0) && (it != readers.end()) )
+               {  // Copied out right away, so that the buffer goes back to the kernel
+                  reader & r = it->second;
+                  r.unpacker.reserve_buffer( cqe.res );
+                  memcpy( r.unpacker.buffer(), _buffers->buffer( id ), cqe.res );
+                  _buffers->recycle( id );
+                  received( fd, r, static_cast<size_t>( cqe.res ) );
+               }
+               else
+               {
+                  _buffers->recycle( id );
+               }
+            }
+
+            if( !more && (it != readers.end()) && !it->second.closing && _keep_running )
+            {
+               if( (cqe.res > 0) || (cqe.res == -ENOBUFS) )
+               {  // Stopped early, e.g. for lack of buffers
+                  arm_recv( fd );
+               }
+               else
+               {
+                  if( (cqe.res < 0) && (cqe.res != -ECONNRESET) )
+                  {
+                     RPC_LOG( warning, "comm_processor: recv error on fd %d, errno=%d", fd, -cqe.res );
+                  }
+                  end_connection( readers, it );
+               }
+            }
+            break;
+         }
+
+         case uring_op::send:
+            sent( readers, fd, static_cast<uint32_t>( (cqe.user_data >> 32) & 0xffffff ), cqe.res );
+            break;
+
+         case uring_op::wake:
+            if( _keep_running )
+            {
+               arm_wake();
+            }
+            break;
+
+         case uring_op::cancel:
+            break;
+      }
+   }
+
+   // The client is gone. The reader stays until sends in flight complete, so that the socket stays open
+   void end_connection( std::unordered_map<int, reader> & readers, std::unordered_map<int, reader>::iterator it )
+   {
+      forget_connection( it->first );
+      if( it->second.batch )
+      {
+         it->second.closing = true;
+         return;
+      }
+      readers.erase( it );
+   }
+
+   // Takes the next frames queued for conn and submits them as linked sends, so they go out in order
+   void start_batch( std::unordered_map<int, reader> & readers, std::shared_ptr<connection> const & conn )
+   {
+      auto it = readers.find( conn->fd );
+      if( (it == readers.end()) || (it->second.conn != conn) || it->second.closing )
+      {  // Closed since
+         discard_output( *conn );
+         return;
+      }
+
+      reader & r = it->second;
+      std::unique_ptr<send_batch> batch( new send_batch() );
+      {
+         std::unique_lock<std::mutex> lck(conn->mutex);
+         if( conn->unfinished )
+         {
+            conn->queued_bytes -= conn->unfinished->data.size();
+            batch->frames.push_back( std::move( conn->unfinished->data ) );
+            batch->handlers.push_back( std::move( conn->unfinished->on_sent ) );
+            conn->unfinished.reset();
+         }
+         while( !conn->output.empty() && (batch->frames.size() < max_batch_frames) )
+         {
+            // priority_queue::top() is const, but the element is popped right away
+            outgoing & top = const_cast<outgoing&>( conn->output.top() );
+            conn->queued_bytes -= top.data.size();
+            batch->frames.push_back( std::move( top.data ) );
+            batch->handlers.push_back( std::move( top.on_sent ) );
+            conn->output.pop();
+         }
+
+         if( batch->frames.empty() )
+         {
+            conn->writing = false;
+            return;
+         }
+      }
+
+      batch->sent.assign( batch->frames.size(), 0 );
+      r.batch = std::move( batch );
+      submit_sends( conn->fd, *r.batch );
+   }
+
+   // Submits what is left of batch. A short send cancels the rest of the chain, which is then resubmitted
+   void submit_sends( int const client_fd, send_batch & batch )
+   {
+      size_t first = 0;
+      while( (first < batch.frames.size()) && (batch.sent[first] == batch.frames[first].size()) )
+      {
+         ++first;
+      }
+
+      size_t const count = batch.frames.size() - first;
+      if( _ring->space() < count )
+      {  // A chain must not be split across submissions
+         _ring->submit_and_wait( 0 );
+      }
+
+      for( size_t i = first; i < batch.frames.size(); ++i )
+      {
+         struct io_uring_sqe * sqe = next_sqe();
+         sqe->opcode = IORING_OP_SEND;
+         sqe->fd = client_fd;
+         sqe->addr = reinterpret_cast<uint64_t>( batch.frames[i].data() + batch.sent[i] );
+         sqe->len = static_cast<uint32_t>( batch.frames[i].size() - batch.sent[i] );
+         sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+         sqe->flags = (i + 1 < batch.frames.size()) ? IOSQE_IO_LINK : 0;
+         sqe->user_data = user_data( uring_op::send, client_fd, static_cast<uint32_t>( i ) );
+         ++batch.pending;
+      }
+   }
+
+   void sent( std::unordered_map<int, reader> & readers, int const client_fd, uint32_t const index, int const res )
+   {
+      auto it = readers.find( client_fd );
+      if( (it == readers.end()) || !it->second.batch )
+      {
+         return;
+      }
+
+      reader & r = it->second;
+      send_batch & batch = *r.batch;
+      if( res >= 0 )
+      {
+         batch.sent[index] += static_cast<size_t>( res );
+      }
+      else if( (res != -ECANCELED) && (batch.error == 0) )
+      {
+         batch.error = -res;
+      }
+
+      if( --batch.pending != 0 )
+      {
+         return;
+      }
+
+      bool complete = true;
+      for( size_t i = 0; i < batch.frames.size(); ++i )
+      {
+         complete = complete && (batch.sent[i] == batch.frames[i].size());
+      }
+
+      if( !complete && (batch.error == 0) && !r.closing && _keep_running )
+      {
+         submit_sends( client_fd, batch );
+         return;
+      }
+
+      for( size_t i = 0; i < batch.frames.size(); ++i )
+      {
+         if( batch.sent[i] != batch.frames[i].size() )
+         {
+            RPC_LOG( warning, "write: connection %d closed. Message lost.", client_fd );
+            continue;
+         }
+
+         increment( r.conn->bytes_out, batch.frames[i].size() );
+         increment( r.conn->frames_out, 1 );
+         rpc::tracer::record( rpc::trace_event::frame_written, client_fd, 0, batch.frames[i].size() );
+         if( batch.handlers[i] )
+         {
+            batch.handlers[i]();
+         }
+      }
+      r.batch.reset();
+
+      if( r.closing )
+      {
+         discard_output( *r.conn );
+         readers.erase( it );
+         return;
+      }
+
+      std::shared_ptr<connection> const conn = r.conn;
+      if( !_keep_running )
+      {
+         discard_output( *conn );
+         return;
+      }
+      start_batch( readers, conn );
    }
+#endif
 
    /*static void hexdump( char const * data, size_t const len )
    {
@@ -0,0 +1,316 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "rpc/tsc.hpp"
+
+namespace rpc
+{
+
+// What happened. fd and msgid identify the connection and the request, arg is event specific
+enum class trace_event : uint16_t
+{
+   connection_accepted = 1,
+   connection_closed   = 2,
+   data_received       = 3,    // arg: bytes read
+   frame_received      = 4,    // A complete message was unpacked
+   request_queued      = 5,    // arg: priority
+   queue_full          = 6,    // Rejected by a bounded executor queue
+   request_shed        = 7,    // Rejected by the load shedder
+   handler_begin       = 8,    // arg: batch size
+   handler_end         = 9,
+   response_queued     = 10,   // arg: bytes
+   frame_written       = 11,   // arg: bytes
+   send_timeout        = 12    // The socket did not become writable in time
+};
+
+struct trace_record
+{
+   uint64_t tsc;
+   uint64_t arg;
+   uint32_t msgid;
+   int32_t fd;
+   uint16_t event;
+   uint16_t reserved[3];
+};
+
+static_assert( sizeof(trace_record) == 32, "trace_record must stay 32 bytes, the dump format depends on it" );
+
+// Binary dump layout, read back by tools/trace_dump:
+//   trace_file_header, then for each of ring_count rings a trace_ring_header
+//   followed by capacity trace_records. The ring holds the last min(head,
+//   capacity) records written, the oldest one at index head % capacity.
+struct trace_file_header
+{
+   char magic[8];       // "RPCTRACE"
+   uint32_t version;
+   uint32_t ring_count;
+   double ns_per_tick;
+};
+
+struct trace_ring_header
+{
+   uint32_t tid;
+   uint32_t capacity;
+   uint64_t head;
+   char name[16];
+};
+
+// Flight recorder of what the transport and worker threads did. Each thread
+// writes into a ring of its own, so recording is a few plain stores. Nothing is
+// recorded until enable( true ).
+//
+// dump() only uses async-signal-safe calls and may run from a signal handler
+// (see dump_on_signal()). It does not stop the writers, so the newest records
+// of a busy thread may come out torn.
+class tracer
+{
+public:
+   static constexpr size_t ring_capacity = 8192;   // Records per thread, a power of two
+   static constexpr size_t max_rings = 256;        // Threads beyond that are not traced
+
+   static void enable( bool const on )
+   {
+      if( on )
+      {
+         tsc_clock::calibrate();
+      }
+      state().enabled.store( on, std::memory_order_relaxed );
+   }
+
+   static bool enabled()
+   {
+      return state().enabled.load( std::memory_order_relaxed );
+   }
+
+   static inline void record( trace_event const event, int const fd = -1, uint32_t const msgid = 0, uint64_t const arg = 0 )
+   {
+      if( !enabled() )
+      {
+         return;
+      }
+
+      ring * r = local_ring();
+      if( r == nullptr )
+      {
+         return;
+      }
+
+      uint64_t const head = r->header.head;
+      trace_record & rec = r->records[head & (ring_capacity - 1)];
+      rec.tsc = tsc_clock::ticks();
+      rec.arg = arg;
+      rec.msgid = msgid;
+      rec.fd = fd;
+      rec.event = static_cast<uint16_t>( event );
+      std::atomic_signal_fence( std::memory_order_release );   // A dump from a signal on this thread sees whole records
+      r->header.head = head + 1;
+   }
+
+   // Shown as the thread name in the converted trace. Does not allocate the thread's ring
+   static void set_thread_name( char const * name )
+   {
+      ring_owner & o = owner();
+      size_t const n = strnlen( name, sizeof(o.name) - 1 );
+      memcpy( o.name, name, n );
+      o.name[n] = '\0';
+      if( o.r != nullptr )
+      {
+         memcpy( o.r->header.name, o.name, sizeof(o.name) );
+      }
+   }
+
+   // Where dump_on_signal() and the server's "__trace_dump" method write to
+   static void set_dump_path( char const * path )
+   {
+      char * const dest = state().dump_path;
+      size_t const n = strnlen( path, sizeof(state().dump_path) - 1 );
+      memcpy( dest, path, n );
+      dest[n] = '\0';
+   }
+
+   static char const * dump_path()
+   {
+      return state().dump_path;
+   }
+
+   // Dumps the rings to dump_path() whenever signo (e.g. SIGUSR2) is received
+   static void dump_on_signal( int const signo )
+   {
+      state();
+      tsc_clock::calibrate();
+
+      struct sigaction sa;
+      memset( &sa, 0, sizeof(sa) );
+      sa.sa_handler = []( int ){ dump( dump_path() ); };
+      sa.sa_flags = SA_RESTART;
+      sigemptyset( &sa.sa_mask );
+      sigaction( signo, &sa, nullptr );
+   }
+
+   static bool dump( char const * path )
+   {
+      if( (path == nullptr) || (path[0] == '\0') )
+      {
+         return false;
+      }
+
+      int const fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+      if( fd == -1 )
+      {
+         return false;
+      }
+
+      shared_state & st = state();
+      uint32_t const count = st.ring_count.load( std::memory_order_acquire );
+
+      trace_file_header file;
+      memset( &file, 0, sizeof(file) );
+      memcpy( file.magic, "RPCTRACE", sizeof(file.magic) );
+      file.version = 1;
+      file.ring_count = count;
+      file.ns_per_tick = tsc_clock::calibrate().ns_per_tick;
+
+      bool ok = write_all( fd, &file, sizeof(file) );
+      for( uint32_t i = 0; ok && (i < count); ++i )
+      {
+         ring const * r = st.rings[i];
+         ok = write_all( fd, &r->header, sizeof(r->header) ) && write_all( fd, r->records, sizeof(r->records) );
+      }
+
+      close( fd );
+      return ok;
+   }
+
+private:
+   struct ring
+   {
+      trace_ring_header header;
+      std::atomic<bool> in_use{ false };
+      trace_record records[ring_capacity];
+   };
+
+   struct shared_state
+   {
+      std::atomic<bool> enabled{ false };
+      std::atomic<uint32_t> ring_count{ 0 };
+      ring * rings[max_rings] = {};
+      char dump_path[256] = {};
+   };
+
+   // Rings are never freed, a thread that exits hands its ring over to the next new one
+   struct ring_owner
+   {
+      ring * r = nullptr;
+      bool tried = false;
+      char name[16] = {};
+
+      ~ring_owner()
+      {
+         if( r != nullptr )
+         {
+            r->in_use.store( false, std::memory_order_release );
+         }
+      }
+   };
+
+   static shared_state & state()
+   {
+      static shared_state st;
+      return st;
+   }
+
+   static ring_owner & owner()
+   {
+      static thread_local ring_owner o;
+      return o;
+   }
+
+   // Allocated on the first record, so threads never traced cost nothing
+   static ring * local_ring()
+   {
+      ring_owner & o = owner();
+      if( !o.tried )
+      {
+         o.tried = true;
+         o.r = acquire_ring();
+         if( o.r != nullptr )
+         {
+            memcpy( o.r->header.name, o.name, sizeof(o.name) );
+         }
+      }
+      return o.r;
+   }
+
+   static ring * acquire_ring()
+   {
+      shared_state & st = state();
+      uint32_t const tid = static_cast<uint32_t>( syscall( SYS_gettid ) );
+
+      for( uint32_t i = 0; i < st.ring_count.load( std::memory_order_acquire ); ++i )
+      {
+         bool expected = false;
+         if( st.rings[i]->in_use.compare_exchange_strong( expected, true ) )
+         {
+            reset( *st.rings[i], tid );
+            return st.rings[i];
+         }
+      }
+
+      ring * r = new ring();
+      r->in_use = true;
+      reset( *r, tid );
+
+      static std::atomic<uint32_t> next{ 0 };
+      uint32_t const slot = next++;
+      if( slot >= max_rings )
+      {
+         delete r;
+         return nullptr;
+      }
+
+      // Published in slot order, so that dump() never sees an empty slot below ring_count
+      st.rings[slot] = r;
+      for( uint32_t expected = slot; !st.ring_count.compare_exchange_weak( expected, slot + 1, std::memory_order_release ); expected = slot )
+      {
+      }
+      return r;
+   }
+
+   static void reset( ring & r, uint32_t const tid )
+   {
+      r.header.head = 0;
+      r.header.tid = tid;
+      r.header.capacity = ring_capacity;
+      memset( r.header.name, 0, sizeof(r.header.name) );
+   }
+
+   static bool write_all( int const fd, void const * data, size_t size )
+   {
+      char const * p = static_cast<char const *>( data );
+      while( size > 0 )
+      {
+         ssize_t const ret = write( fd, p, size );
+         if( ret < 0 )
+         {
+            if( errno == EINTR )
+            {
+               continue;
+            }
+            return false;
+         }
+         p += ret;
+         size -= static_cast<size_t>( ret );
+      }
+      return true;
+   }
+};
+
+};
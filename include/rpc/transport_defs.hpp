@@ -1,8 +1,14 @@
 #pragma once
 
+#include <memory>
 #include <vector>
 #include <msgpack.hpp>
 
+namespace rpc
+{
+class fd_list;
+};
+
 //namespace rpc
 //{
 
@@ -27,6 +33,8 @@ public:
    {
       std::vector<char>::insert( std::vector<char>::end(), s, s + n );
    }
+
+   std::shared_ptr<rpc::fd_list> fds;   // Descriptors to pass along with the frame, see rpc/blob.hpp
 };
 
 //};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace rpc
+{
+
+// Cheap timestamps for instrumenting the request path. On x86 with an
+// invariant TSC, ticks() is a bare rdtsc and ticks are converted to
+// nanoseconds with a rate measured against CLOCK_MONOTONIC. Anywhere else
+// ticks are CLOCK_MONOTONIC nanoseconds.
+class tsc_clock
+{
+public:
+   struct calibration
+   {
+      bool use_tsc = false;
+      double ns_per_tick = 1.0;
+   };
+
+   // Measures the TSC rate the first time. Takes a couple of milliseconds, so call it at startup
+   static calibration const & calibrate()
+   {
+      static calibration const cal = measure();
+      return cal;
+   }
+
+   static inline uint64_t ticks()
+   {
+#if defined(__x86_64__) || defined(__i386__)
+      if( calibrate().use_tsc )
+      {
+         return __rdtsc();
+      }
+#endif
+      return monotonic_ns();
+   }
+
+   static inline uint64_t to_ns( uint64_t const ticks )
+   {
+      return static_cast<uint64_t>( ticks * calibrate().ns_per_tick );
+   }
+
+   // Nanoseconds from begin to end, 0 if either is missing or they are out of order
+   static inline uint64_t elapsed_ns( uint64_t const begin, uint64_t const end )
+   {
+      return ((begin != 0) && (end > begin)) ? to_ns( end - begin ) : 0;
+   }
+
+   static inline uint64_t monotonic_ns()
+   {
+      struct timespec ts;
+      clock_gettime( CLOCK_MONOTONIC, &ts );
+      return static_cast<uint64_t>( ts.tv_sec ) * 1000000000u + static_cast<uint64_t>( ts.tv_nsec );
+   }
+
+private:
+   static calibration measure()
+   {
+      calibration cal;
+#if defined(__x86_64__) || defined(__i386__)
+      unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+      if( (__get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx ) == 0) || !(edx & (1u << 8)) )
+      {  // TSC rate may change with frequency scaling or stop in deep sleep states
+         return cal;
+      }
+
+      uint64_t const ns_begin = monotonic_ns();
+      uint64_t const tsc_begin = __rdtsc();
+      uint64_t ns_end = ns_begin;
+      while( ns_end - ns_begin < 2000000 )
+      {
+         ns_end = monotonic_ns();
+      }
+      uint64_t const tsc_end = __rdtsc();
+
+      if( tsc_end > tsc_begin )
+      {
+         cal.use_tsc = true;
+         cal.ns_per_tick = static_cast<double>( ns_end - ns_begin ) / static_cast<double>( tsc_end - tsc_begin );
+      }
+#endif
+      return cal;
+   }
+};
+
+};
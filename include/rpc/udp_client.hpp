@@ -0,0 +1,289 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "msgpack.hpp"
+#include "rpc/transport_defs.hpp"
+#include "rpc/endpoint.hpp"
+#include "rpc/udp_socket_server.hpp"
+#include "rpc/log.hpp"
+
+namespace rpc
+{
+
+// Talks to server::listen_udp(), one datagram per message, for high rate notifications where an
+// occasional loss is fine, and small idempotent calls.
+//
+// Notifications are queued and go out in batches with sendmmsg(): once batch_size are queued, on
+// flush(), before a call, and on destruction. There is no timer, a few notifications stay queued
+// until one of those happens. A call sends its request right away, and sends it again every
+// timeout until a response comes, so the method must be safe to run more than once. Calls from
+// several threads wait for their responses concurrently.
+//
+// Messages must fit a datagram, larger ones throw std::length_error. Keep them below the path MTU
+// (about 1450 bytes) to avoid fragmentation, which multiplies the loss rate. The server fails calls
+// whose response would be more than udp_socket_server::max_amplification times their request.
+class udp_client
+{
+public:
+   static constexpr size_t batch_size = 32;
+
+   explicit udp_client( endpoint const & server )
+   {
+      if( server.kind() != endpoint::family::udp )
+      {
+         throw std::invalid_argument( "udp_client: not a UDP endpoint" );
+      }
+
+      struct sockaddr_storage addr;
+      socklen_t const addr_len = server.to_sockaddr( addr );
+      _fd = socket( AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+      if( _fd == -1 )
+      {
+         throw std::system_error( errno, std::generic_category(), "udp_client: socket" );
+      }
+      if( connect( _fd, reinterpret_cast<struct sockaddr *>( &addr ), addr_len ) == -1 )
+      {  // Only sets the destination, and filters out datagrams from anyone else
+         int const err = errno;
+         close( _fd );
+         throw std::system_error( err, std::generic_category(), "udp_client: connect error" );
+      }
+   }
+
+   udp_client( udp_client const & ) = delete;
+   udp_client& operator=( udp_client const & ) = delete;
+
+   ~udp_client()
+   {
+      flush();
+      close( _fd );
+   }
+
+   // How long a call waits for each attempt, and how many attempts it makes before throwing
+   void set_timeout( std::chrono::milliseconds const per_attempt, unsigned const attempts )
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      _timeout = per_attempt;
+      _attempts = (attempts == 0) ? 1 : attempts;
+   }
+
+   // Queued, and NOT sent until batch_size are queued, flush() or call() is called, or the client
+   // is destroyed. Call flush() after the last of a burst
+   template< class... Args >
+   void notify( std::string const & method, Args&&... args )
+   {
+      pack_buffer datagram;
+      msgpack::pack( datagram, std::make_tuple( rpc_message::notification, method, pack_params( std::forward<Args>(args)... ) ) );
+      check_size( datagram );
+
+      std::unique_lock<std::mutex> lck(_mutex);
+      _queued.push_back( std::move(datagram) );
+      if( _queued.size() >= batch_size )
+      {
+         send_queued();
+      }
+   }
+
+   // Sends the notifications queued. Some may be lost if the socket buffer is full
+   void flush()
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      send_queued();
+   }
+
+   template< class ret_t, class... Args >
+   ret_t call( std::string const & method, Args&&... args )
+   {
+      pack_buffer request;
+      uint32_t msgid;
+      std::chrono::milliseconds timeout;
+      unsigned attempts;
+      {
+         std::unique_lock<std::mutex> lck(_mutex);
+         msgid = _msgid_counter++;
+         timeout = _timeout;
+         attempts = _attempts;
+         send_queued();   // Keep the order with earlier notifications
+      }
+      msgpack::pack( request, std::make_tuple( rpc_message::request, msgid, method, pack_params( std::forward<Args>(args)... ) ) );
+      check_size( request );
+
+      response resp;
+      {
+         std::unique_lock<std::mutex> lck(_recv_mutex);
+         _waiting.emplace( msgid, response() );
+      }
+      bool answered = false;
+      for( unsigned attempt = 0; (attempt < attempts) && !answered; ++attempt )
+      {
+         if( (send( _fd, request.data(), request.size(), 0 ) < 0) && (errno != EAGAIN) && (errno != ENOBUFS) )
+         {
+            int const err = errno;
+            std::unique_lock<std::mutex> lck(_recv_mutex);
+            _waiting.erase( msgid );
+            throw std::system_error( err, std::generic_category(), "udp_client: send error" );
+         }
+         answered = wait_response( msgid, std::chrono::steady_clock::now() + timeout, resp );
+      }
+      if( !answered )
+      {
+         throw std::runtime_error( "udp_client: no response to " + method );
+      }
+
+      if( !std::get<2>(resp.fields).empty() )
+      {  // Exception was thrown
+         msgpack::object_handle const hndl = msgpack::unpack( std::get<2>(resp.fields).data(), std::get<2>(resp.fields).size() );
+         throw std::runtime_error( hndl.get().as<std::string>() );
+      }
+      msgpack::object_handle const hndl = msgpack::unpack( std::get<3>(resp.fields).data(), std::get<3>(resp.fields).size() );
+      return hndl.get().as<ret_t>();
+   }
+
+private:
+   struct response
+   {
+      bool arrived = false;
+      std::tuple< rpc_message, uint32_t, std::vector<char>, std::vector<char> > fields;
+   };
+
+   int _fd = -1;
+   std::mutex _mutex;   // Guards the members below, up to _recv_mutex
+   std::vector<pack_buffer> _queued;
+   uint32_t _msgid_counter = 0;
+   std::chrono::milliseconds _timeout{ 100 };
+   unsigned _attempts = 3;
+
+   // One waiting call at a time reads the socket, and hands the responses of the others over
+   std::mutex _recv_mutex;   // Guards the members below
+   std::condition_variable _recv_cv;
+   std::unordered_map<uint32_t, response> _waiting;   // By msgid, of the calls waiting
+   bool _reading = false;
+   std::vector<char> _recv_buffer = std::vector<char>( udp_socket_server::max_datagram );
+
+   // Waits until deadline for the response to msgid, reading the socket if no other call does.
+   // The msgid stops waiting once its response arrived
+   bool wait_response( uint32_t const msgid, std::chrono::steady_clock::time_point const deadline, response & resp )
+   {
+      std::unique_lock<std::mutex> lck(_recv_mutex);
+      for( ;; )
+      {
+         auto const it = _waiting.find( msgid );
+         if( it->second.arrived )
+         {
+            resp = std::move( it->second );
+            _waiting.erase( it );
+            return true;
+         }
+
+         auto const now = std::chrono::steady_clock::now();
+         if( now >= deadline )
+         {
+            return false;
+         }
+         if( _reading )
+         {
+            _recv_cv.wait_until( lck, deadline );
+            continue;
+         }
+
+         _reading = true;
+         lck.unlock();
+         response received;
+         bool const got = read_response( deadline - now, received );
+         lck.lock();
+         _reading = false;
+         if( got )
+         {
+            auto const owner = _waiting.find( std::get<1>(received.fields) );
+            if( owner != _waiting.end() )
+            {  // Otherwise a late response to an earlier attempt, or to a call that gave up
+               owner->second = std::move( received );
+               owner->second.arrived = true;
+            }
+         }
+         // Whoever got a response, or has to take over reading
+         _recv_cv.notify_all();
+      }
+   }
+
+   // Reads one datagram, false if none came in time or it was not a response
+   bool read_response( std::chrono::steady_clock::duration const timeout, response & resp )
+   {
+      struct pollfd pfd;
+      pfd.fd = _fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      int const wait_ms = static_cast<int>( std::chrono::duration_cast<std::chrono::milliseconds>( timeout ).count() ) + 1;
+      if( poll( &pfd, 1, wait_ms ) <= 0 )
+      {
+         return false;
+      }
+
+      ssize_t const ret = recv( _fd, _recv_buffer.data(), _recv_buffer.size(), MSG_DONTWAIT );
+      if( ret <= 0 )
+      {  // ECONNREFUSED: nobody listening (yet), try again on the next attempt
+         return false;
+      }
+
+      try
+      {
+         msgpack::object_handle const hndl = msgpack::unpack( _recv_buffer.data(), static_cast<size_t>( ret ) );
+         hndl.get().convert( resp.fields );
+      }
+      catch( std::exception const & e )
+      {
+         RPC_LOG( warning, "udp_client: invalid datagram dropped (%s)", e.what() );
+         return false;
+      }
+      return true;
+   }
+
+   template< class... Args >
+   static std::vector<char> pack_params( Args&&... args )
+   {
+      pack_buffer buffer;
+      msgpack::pack( buffer, std::make_tuple( std::forward<Args>(args)... ) );
+      return std::move( static_cast<std::vector<char> &>( buffer ) );
+   }
+
+   static void check_size( pack_buffer const & datagram )
+   {
+      if( datagram.size() > udp_socket_server::max_datagram )
+      {
+         throw std::length_error( "udp_client: message of " + std::to_string( datagram.size() ) + " bytes does not fit a datagram" );
+      }
+   }
+
+   void send_queued()
+   {
+      std::vector<struct iovec> iovs( _queued.size() );
+      std::vector<struct mmsghdr> msgs( _queued.size() );
+      for( size_t i = 0; i < _queued.size(); ++i )
+      {
+         iovs[i].iov_base = _queued[i].data();
+         iovs[i].iov_len = _queued[i].size();
+         memset( &msgs[i], 0, sizeof(msgs[i]) );
+         msgs[i].msg_hdr.msg_iov = &iovs[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      for( size_t sent = 0; sent < msgs.size(); /*no increment*/ )
+      {  // A datagram the kernel refuses is lost, like one dropped on the way
+         int const ret = sendmmsg( _fd, &msgs[sent], static_cast<unsigned>( msgs.size() - sent ), 0 );
+         sent += (ret > 0) ? static_cast<size_t>( ret ) : 1;
+      }
+      _queued.clear();
+   }
+};
+
+};
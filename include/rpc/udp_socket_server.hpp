@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "rpc/transport_defs.hpp"
+#include "rpc/endpoint.hpp"
+#include "rpc/log.hpp"
+#include "msgpack.hpp"
+
+// Receives datagrams of one msgpack frame each, for notifications and small calls where an
+// occasional loss is fine. Every receiver thread has a socket of its own bound to the same port
+// with SO_REUSEPORT, so the kernel spreads senders over them, and moves batches of datagrams in
+// and out with recvmmsg() and sendmmsg().
+//
+// The handler runs on the receiver thread, and fills reply with the datagram to send back, if any.
+// Replies are at most max_amplification times the size of their request: the source address of a
+// datagram is easily forged, and the server must not become a way to flood someone else.
+class udp_socket_server
+{
+public:
+   // Largest UDP payload over IPv4. Anything above the path MTU (usually about 1450 bytes) is
+   // fragmented, and lost altogether whenever one fragment is
+   static constexpr size_t max_datagram = 65507;
+   static constexpr size_t max_amplification = 4;
+
+   // reply must not be longer than max_reply, or it is dropped
+   using datagram_handler = std::function< void ( msgpack::object const & frame, size_t max_reply, pack_buffer & reply ) >;
+
+   udp_socket_server( rpc::endpoint const & endpoint, size_t const receivers, datagram_handler handler ) :
+      _handler( std::move(handler) )
+   {
+      if( endpoint.kind() != rpc::endpoint::family::udp )
+      {
+         throw std::invalid_argument( "udp_socket_server: not a UDP endpoint" );
+      }
+
+      struct sockaddr_storage addr;
+      socklen_t const addr_len = endpoint.to_sockaddr( addr );
+      try
+      {
+         for( size_t i = 0; i < std::max<size_t>( receivers, 1 ); ++i )
+         {
+            _fds.push_back( open_socket( addr, addr_len ) );
+            if( i == 0 )
+            {  // The others must get the same port if the kernel chose it
+               socklen_t len = sizeof(addr);
+               getsockname( _fds[0], reinterpret_cast<struct sockaddr *>( &addr ), &len );
+            }
+         }
+      }
+      catch(...)
+      {
+         close_sockets();
+         throw;
+      }
+      _port = ntohs( reinterpret_cast<struct sockaddr_in const &>( addr ).sin_port );
+
+      for( int const fd : _fds )
+      {
+         _threads.emplace_back( &udp_socket_server::receiver, this, fd );
+      }
+   }
+
+   udp_socket_server( udp_socket_server const & ) = delete;
+   udp_socket_server& operator=( udp_socket_server const & ) = delete;
+
+   ~udp_socket_server()
+   {
+      _keep_running = false;
+      for( auto& it : _threads )
+      {
+         it.join();
+      }
+      close_sockets();
+   }
+
+   // The port bound, useful when the endpoint asked for any (0)
+   uint16_t port() const
+   {
+      return _port;
+   }
+
+   // Datagrams dropped as truncated or not a single msgpack frame
+   uint64_t dropped() const
+   {
+      return _dropped.load( std::memory_order_relaxed );
+   }
+
+private:
+   static constexpr unsigned batch = 32;   // Datagrams per recvmmsg() and sendmmsg()
+
+   std::atomic<bool> _keep_running{ true };
+   std::atomic<uint64_t> _dropped{ 0 };
+   datagram_handler _handler;
+   std::vector<int> _fds;
+   std::vector<std::thread> _threads;
+   uint16_t _port = 0;
+
+   static int open_socket( struct sockaddr_storage const & addr, socklen_t const addr_len )
+   {
+      int const fd = socket( AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+      if( fd == -1 )
+      {
+         throw std::system_error( errno, std::generic_category(), "udp_socket_server: socket" );
+      }
+
+      int const on = 1;
+      setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on) );
+      int const buffer = 4 << 20;   // Absorbs bursts, the kernel caps it to net.core.rmem_max
+      setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer) );
+      if( bind( fd, reinterpret_cast<struct sockaddr const *>( &addr ), addr_len ) == -1 )
+      {
+         int const err = errno;
+         close( fd );
+         throw std::system_error( err, std::generic_category(), "udp_socket_server: bind error" );
+      }
+      return fd;
+   }
+
+   void close_sockets()
+   {
+      for( int const fd : _fds )
+      {
+         close( fd );
+      }
+      _fds.clear();
+   }
+
+   void receiver( int const fd )
+   {
+      std::vector<char> buffers( batch * max_datagram );
+      std::vector<struct iovec> iovs( batch );
+      std::vector<struct sockaddr_storage> peers( batch );
+      std::vector<struct mmsghdr> in( batch );
+
+      std::vector<pack_buffer> replies( batch );
+      std::vector<struct iovec> reply_iovs( batch );
+      std::vector<struct mmsghdr> out( batch );
+
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+
+      while( _keep_running )
+      {
+         pfd.revents = 0;
+         if( poll( &pfd, 1, 200 ) <= 0 )
+         {  // Timeouts are there to see _keep_running
+            continue;
+         }
+
+         for( unsigned i = 0; i < batch; ++i )
+         {
+            iovs[i].iov_base = &buffers[i * max_datagram];
+            iovs[i].iov_len = max_datagram;
+            memset( &in[i], 0, sizeof(in[i]) );
+            in[i].msg_hdr.msg_iov = &iovs[i];
+            in[i].msg_hdr.msg_iovlen = 1;
+            in[i].msg_hdr.msg_name = &peers[i];
+            in[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+         }
+
+         int const received = recvmmsg( fd, in.data(), batch, MSG_DONTWAIT, nullptr );
+         if( received < 0 )
+         {
+            if( (errno != EAGAIN) && (errno != EINTR) )
+            {
+               RPC_LOG( error, "udp: recvmmsg error %d on fd %d", errno, fd );
+            }
+            continue;
+         }
+
+         unsigned replying = 0;
+         for( int i = 0; i < received; ++i )
+         {
+            pack_buffer & reply = replies[replying];
+            reply.clear();
+            if( !handle( in[i], reply ) || reply.empty() )
+            {
+               continue;
+            }
+
+            reply_iovs[replying].iov_base = reply.data();
+            reply_iovs[replying].iov_len = reply.size();
+            memset( &out[replying], 0, sizeof(out[replying]) );
+            out[replying].msg_hdr.msg_iov = &reply_iovs[replying];
+            out[replying].msg_hdr.msg_iovlen = 1;
+            out[replying].msg_hdr.msg_name = &peers[i];
+            out[replying].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+            ++replying;
+         }
+
+         for( unsigned sent = 0; sent < replying; /*no increment*/ )
+         {  // Lost replies are the client's to retry, but do not give up on the rest of the batch
+            int const ret = sendmmsg( fd, &out[sent], replying - sent, MSG_DONTWAIT );
+            sent += (ret > 0) ? static_cast<unsigned>( ret ) : 1;
+         }
+      }
+   }
+
+   // Returns false if the datagram was dropped
+   bool handle( struct mmsghdr const & datagram, pack_buffer & reply )
+   {
+      if( datagram.msg_hdr.msg_flags & MSG_TRUNC )
+      {
+         _dropped.fetch_add( 1, std::memory_order_relaxed );
+         RPC_LOG( warning, "udp: truncated datagram dropped" );
+         return false;
+      }
+
+      try
+      {
+         char const * const data = static_cast<char const *>( datagram.msg_hdr.msg_iov->iov_base );
+         size_t offset = 0;
+         msgpack::object_handle const frame = msgpack::unpack( data, datagram.msg_len, offset );
+         if( offset != datagram.msg_len )
+         {
+            throw std::runtime_error( "more than one frame" );
+         }
+         _handler( frame.get(), max_reply( datagram.msg_len ), reply );
+      }
+      catch( std::exception const & e )
+      {
+         _dropped.fetch_add( 1, std::memory_order_relaxed );
+         RPC_LOG( warning, "udp: invalid datagram dropped (%s)", e.what() );
+         return false;
+      }
+
+      if( reply.size() > max_reply( datagram.msg_len ) )
+      {
+         RPC_LOG( warning, "udp: reply of %zu bytes to a request of %u dropped", reply.size(), datagram.msg_len );
+         return false;
+      }
+      return true;
+   }
+
+   static size_t max_reply( size_t const request_size )
+   {
+      return std::min( max_datagram, max_amplification * request_size );
+   }
+};
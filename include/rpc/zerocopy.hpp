@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "rpc/transport_defs.hpp"
+#include "rpc/log.hpp"
+
+// MSG_ZEROCOPY needs Linux 4.14, and the definitions of glibc 2.27 or linux/errqueue.h
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/errqueue.h>)
+#include <linux/errqueue.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define RPC_HAVE_ZEROCOPY 1
+#endif
+#endif
+#endif
+
+#ifndef RPC_HAVE_ZEROCOPY
+#define RPC_HAVE_ZEROCOPY 0
+#endif
+
+namespace rpc
+{
+
+// Sends large frames on one TCP socket with MSG_ZEROCOPY: the kernel sends straight from the frame
+// instead of copying it, so the frame is held here until the kernel reports it done with it, which
+// is once the peer acknowledged the data. Completions come through the socket error queue, which
+// sets POLLERR on the socket until reap() reads them.
+//
+// Over loopback, and with some NICs, the kernel copies the data after all, at a higher cost than
+// a plain send. The first completion saying so turns zerocopy off for the socket.
+//
+// One thread sends at a time, reap() may be called from any thread.
+class zerocopy_sender
+{
+public:
+   // Pinning pages and the completion are not worth it for smaller frames
+   static constexpr size_t default_threshold = 64 * 1024;
+
+   // Returns false if the kernel does not support zerocopy on fd
+   bool enable( int const fd )
+   {
+#if RPC_HAVE_ZEROCOPY
+      int const on = 1;
+      std::unique_lock<std::mutex> lck(_mutex);
+      _enabled = setsockopt( fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on) ) == 0;
+      return _enabled;
+#else
+      (void)fd;
+      return false;
+#endif
+   }
+
+   bool enabled() const
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      return _enabled;
+   }
+
+   // Whether any frame was sent with zerocopy, and so whether completions may come in
+   bool used() const
+   {
+      return _used.load( std::memory_order_relaxed );
+   }
+
+   // Frames not released by the kernel yet
+   size_t held() const
+   {
+      std::unique_lock<std::mutex> lck(_mutex);
+      return _held.size();
+   }
+
+   // Same as send(), falls back to copying when the kernel runs out of memory to track the pages.
+   // The frame data points into must then be passed to hold() once completely sent
+   ssize_t send( int const fd, char const * data, size_t const len )
+   {
+#if RPC_HAVE_ZEROCOPY
+      ssize_t const ret = ::send( fd, data, len, MSG_NOSIGNAL | MSG_ZEROCOPY );
+      if( ret >= 0 )
+      {  // Every successful call takes the next completion id
+         ++_next_id;
+         _pending = true;
+         _used.store( true, std::memory_order_relaxed );
+         return ret;
+      }
+      if( errno != ENOBUFS )
+      {
+         return ret;
+      }
+#endif
+      return ::send( fd, data, len, MSG_NOSIGNAL );
+   }
+
+   // Keeps frame until the kernel is done with the zerocopy sends of it, unless reap() already saw
+   // them completed
+   void hold( pack_buffer && frame )
+   {
+      if( !_pending )
+      {
+         return;
+      }
+      _pending = false;
+
+      uint32_t const id = _next_id - 1;
+      std::unique_lock<std::mutex> lck(_mutex);
+      if( _any_completed && (static_cast<int32_t>( id - _completed ) <= 0) )
+      {
+         return;
+      }
+      _held.emplace_back( id, std::move(frame) );
+   }
+
+   // Reads the completions queued on fd and releases the frames they cover. Returns false if
+   // there were none
+   bool reap( int const fd )
+   {
+      bool reaped = false;
+#if RPC_HAVE_ZEROCOPY
+      std::unique_lock<std::mutex> lck(_mutex);
+      for( ;; )
+      {
+         char control[128];
+         struct msghdr msg;
+         memset( &msg, 0, sizeof(msg) );
+         msg.msg_control = control;
+         msg.msg_controllen = sizeof(control);
+         if( recvmsg( fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 )
+         {
+            break;
+         }
+
+         for( struct cmsghdr * cm = CMSG_FIRSTHDR( &msg ); cm != nullptr; cm = CMSG_NXTHDR( &msg, cm ) )
+         {
+            bool const recverr = ((cm->cmsg_level == SOL_IP) && (cm->cmsg_type == IP_RECVERR)) ||
+                                 ((cm->cmsg_level == SOL_IPV6) && (cm->cmsg_type == IPV6_RECVERR));
+            struct sock_extended_err const * err = reinterpret_cast<struct sock_extended_err const *>( CMSG_DATA( cm ) );
+            if( !recverr || (err->ee_errno != 0) || (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) )
+            {
+               continue;
+            }
+
+            reaped = true;
+            if( (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && _enabled )
+            {
+               RPC_LOG( debug, "zerocopy: the kernel copies on fd %d anyway, sending normally", fd );
+               _enabled = false;
+            }
+
+            // TCP completes in order, ids up to ee_data are done (the comparisons survive wrapping)
+            if( !_any_completed || (static_cast<int32_t>( err->ee_data - _completed ) > 0) )
+            {
+               _completed = err->ee_data;
+               _any_completed = true;
+            }
+            while( !_held.empty() && (static_cast<int32_t>( _held.front().first - err->ee_data ) <= 0) )
+            {
+               _held.pop_front();
+            }
+         }
+      }
+#else
+      (void)fd;
+#endif
+      return reaped;
+   }
+
+private:
+   mutable std::mutex _mutex;
+   bool _enabled = false;
+   std::atomic<bool> _used{ false };
+   std::deque<std::pair<uint32_t, pack_buffer>> _held;   // Completion id of the last send of each frame
+   uint32_t _completed = 0;        // Highest completion id reaped, if _any_completed
+   bool _any_completed = false;
+   uint32_t _next_id = 0;    // Sending thread only
+   bool _pending = false;    // Sending thread only: sent with zerocopy since the last hold()
+};
+
+};
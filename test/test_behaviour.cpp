@@ -0,0 +1,871 @@
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <vector>
+#include <dirent.h>
+#define RPC_COUNT_ALLOCATIONS   // For the allocation accounting check
+#include "rpc/server.hpp"
+#include "rpc/client.hpp"
+#include "rpc/local_client.hpp"
+#include "rpc/pooled_client.hpp"
+#include "rpc/udp_client.hpp"
+#include "rpc/capture.hpp"
+
+// Small checks of behaviour the server and clients promise. Each one runs its own servers, on ports
+// 20600 and up and sockets under /tmp. Prints what failed and exits with 1 if anything did
+
+static int failures = 0;
+
+#define CHECK( cond ) check( (cond), #cond, __LINE__ )
+
+static void check( bool const ok, char const * what, int const line )
+{
+   if( !ok )
+   {
+      std::cout << "  FAILED line " << line << ": " << what << std::endl;
+      ++failures;
+   }
+}
+
+// Runs f, false if it did not throw
+template< class F >
+static bool throws( F f )
+{
+   try
+   {
+      f();
+   }
+   catch( std::exception const & )
+   {
+      return true;
+   }
+   return false;
+}
+
+static int open_fds()
+{
+   int ret = 0;
+   if( DIR * dir = opendir( "/proc/self/fd" ) )
+   {
+      while( readdir( dir ) != nullptr )
+      {
+         ++ret;
+      }
+      closedir( dir );
+   }
+   return ret;
+}
+
+static std::string socket_path( char const * name )
+{
+   return "/tmp/rpc_test_" + std::to_string( getpid() ) + "_" + name;
+}
+
+static int connect_raw( rpc::endpoint const & ep )
+{
+   struct sockaddr_storage addr;
+   socklen_t const addr_len = ep.to_sockaddr( addr );
+   int const fd = socket( ep.socket_family(), SOCK_STREAM, 0 );
+   if( connect( fd, reinterpret_cast<struct sockaddr *>( &addr ), addr_len ) == -1 )
+   {
+      close( fd );
+      return -1;
+   }
+   return fd;
+}
+
+static void check_load_shedding()
+{
+   std::cout << "load shedding" << std::endl;
+   using queue_type = rpc::request_queue<int>;
+   queue_type queue;
+   rpc::codel_options opts;
+   opts.enabled = true;
+   opts.target = std::chrono::microseconds( 2000 );
+   opts.interval = std::chrono::microseconds( 20000 );
+   queue.set_load_shedding( opts );
+
+   // Requests come in twice as fast as they are served
+   std::atomic<bool> running{ true };
+   size_t shed = 0;
+   std::thread consumer( [&]()
+   {
+      while( running )
+      {
+         int value;
+         queue_type::pop_status const status = queue.pop( value );
+         if( status == queue_type::pop_status::ok )
+         {
+            std::this_thread::sleep_for( std::chrono::microseconds( 1000 ) );
+         }
+         shed += (status == queue_type::pop_status::shed) ? 1 : 0;
+      }
+   } );
+   size_t longest = 0;
+   auto const end = std::chrono::steady_clock::now() + std::chrono::seconds( 1 );
+   for( auto next = std::chrono::steady_clock::now(); next < end; next += std::chrono::microseconds( 500 ) )
+   {
+      std::this_thread::sleep_until( next );
+      queue.emplace_back( rpc::priority::normal, 0 );
+      longest = std::max( longest, queue.size() );
+   }
+   size_t const left = queue.size();
+   running = false;
+   queue.notify_all();
+   consumer.join();
+
+   // Without shedding about 1000 would be left waiting
+   CHECK( shed > 0 );
+   CHECK( longest < 300 );
+   CHECK( left < 50 );
+}
+
+static void check_no_stray_responses()
+{
+   std::cout << "no stray responses" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20610 );
+   rpc::server server( ep );
+   server.bind( "slow", [](){ std::this_thread::sleep_for( std::chrono::milliseconds( 200 ) ); return true; } );
+   server.async_run( 1 );
+
+   // [0, 1, "slow", bin( [] )] from a client that hangs up before the answer, then a client that
+   // may well get the same fd on the server
+   std::vector<unsigned char> const frame = { 0x94, 0x00, 0x01, 0xa4, 's', 'l', 'o', 'w', 0xc4, 0x01, 0x90 };
+   int const gone = connect_raw( ep );
+   send( gone, frame.data(), frame.size(), 0 );
+   std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+   close( gone );
+   std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+
+   int const fd = connect_raw( ep );
+   std::this_thread::sleep_for( std::chrono::milliseconds( 400 ) );
+   char buffer[64];
+   CHECK( recv( fd, buffer, sizeof(buffer), MSG_DONTWAIT ) == -1 );
+   close( fd );
+}
+
+static void check_malformed_requests()
+{
+   std::cout << "malformed requests" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20608 );
+   rpc::server server( ep );
+   server.bind( "f", []( int a ){ return a + 1; } );
+   server.bind( "g", []( int a ){ return a + 2; }, rpc::executor( "isolated", 1, 4 ) );
+   server.async_run( 1 );
+
+   // [0, 1, "f", 5] with params that are not a bin, [0, 2, "g", bin( 0xc1 )] with params that are
+   // not msgpack, and a frame that is not an array
+   std::vector<unsigned char> const frames = { 0x94, 0x00, 0x01, 0xa1, 'f', 0x05,
+                                               0x94, 0x00, 0x02, 0xa1, 'g', 0xc4, 0x01, 0xc1,
+                                               0x05 };
+   int const fd = connect_raw( ep );
+   send( fd, frames.data(), frames.size(), 0 );
+   std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+   close( fd );
+
+   rpc::client client( ep );
+   CHECK( client.call<int>( "f", 1 ) == 2 );
+   CHECK( client.call<int>( "g", 1 ) == 3 );
+}
+
+static void check_unread_rejections()
+{
+   std::cout << "unread rejections" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20609 );
+   rpc::server server( ep );
+   server.bind( "slow", [](){ std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) ); return true; },
+                rpc::executor( "slow", 1, 1 ) );
+   server.async_run( 1 );
+
+   // [0, msgid, "slow", bin( [] )], all but a couple rejected, by a client that never reads the rejections
+   std::vector<unsigned char> frames;
+   for( uint32_t msgid = 0; msgid < 200000; ++msgid )
+   {
+      unsigned char const frame[] = { 0x94, 0x00, 0xce, static_cast<unsigned char>( msgid >> 24 ), static_cast<unsigned char>( msgid >> 16 ),
+                                      static_cast<unsigned char>( msgid >> 8 ), static_cast<unsigned char>( msgid ),
+                                      0xa4, 's', 'l', 'o', 'w', 0xc4, 0x01, 0x90 };
+      frames.insert( frames.end(), frame, frame + sizeof(frame) );
+   }
+   int const fd = connect_raw( ep );
+   std::thread flood( [&](){ send( fd, frames.data(), frames.size(), MSG_NOSIGNAL ); } );
+   std::this_thread::sleep_for( std::chrono::milliseconds( 500 ) );
+
+   rpc::client client( ep );
+   std::future<bool> pong = client.async_call<bool>( "__ping" );
+   CHECK( pong.wait_for( std::chrono::seconds( 5 ) ) == std::future_status::ready );
+
+   shutdown( fd, SHUT_RDWR );
+   flood.join();
+   close( fd );
+}
+
+static void check_elastic_pool()
+{
+   std::cout << "elastic pool" << std::endl;
+   {
+      rpc::server server( rpc::endpoint::tcp( "127.0.0.1", 20600 ) );
+      CHECK( throws( [&](){ server.async_run( rpc::pool_size( 0, 0 ) ); } ) );
+   }
+
+   rpc::server server( rpc::endpoint::tcp( "127.0.0.1", 20601 ) );
+   server.bind( "nap", [](){ std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) ); return 1; } );
+   rpc::pool_size size( 0, 4 );
+   size.grow_after = std::chrono::microseconds( 1000 );
+   server.async_run( size );
+
+   rpc::client client( rpc::endpoint::tcp( "127.0.0.1", 20601 ) );
+   std::vector<std::future<int>> naps;
+   for( int i = 0; i < 8; ++i )
+   {
+      naps.push_back( client.async_call<int>( "nap" ) );
+   }
+   int answered = 0;
+   for( auto& it : naps )
+   {
+      answered += it.get();
+   }
+   CHECK( answered == 8 );
+   CHECK( server.executors_stats()[0].spawned >= 2 );
+}
+
+static void check_batch()
+{
+   std::cout << "batched methods" << std::endl;
+   rpc::server server( rpc::endpoint::tcp( "127.0.0.1", 20602 ) );
+   server.bind_batch( "square", []( std::vector<int> const & v ){ std::vector<int> r; for( int x : v ) r.push_back( x * x ); return r; }, rpc::batch_options( 8, std::chrono::microseconds( 2000 ) ) );
+   server.bind_batch( "fail", []( std::vector<int> const & ) -> std::vector<int> { throw std::runtime_error( "batch failed" ); }, rpc::batch_options( 8, std::chrono::microseconds( 2000 ) ) );
+   server.async_run( 1 );
+
+   rpc::client client( rpc::endpoint::tcp( "127.0.0.1", 20602 ) );
+   std::vector<std::future<int>> squares;
+   for( int i = 0; i < 16; ++i )
+   {
+      squares.push_back( client.async_call<int>( "square", i ) );
+   }
+   std::future<int> bad_argument = client.async_call<int>( "square", std::string( "nine" ) );
+   for( int i = 0; i < 16; ++i )
+   {
+      CHECK( squares[i].get() == i * i );
+   }
+   // Only the caller that sent it gets the error of a bad argument
+   CHECK( throws( [&](){ bad_argument.get(); } ) );
+
+   // Every caller of a batch gets the error its handler threw
+   std::vector<std::future<int>> failing;
+   for( int i = 0; i < 4; ++i )
+   {
+      failing.push_back( client.async_call<int>( "fail", i ) );
+   }
+   for( auto& it : failing )
+   {
+      std::string error;
+      try
+      {
+         it.get();
+      }
+      catch( std::exception const & e )
+      {
+         error = e.what();
+      }
+      CHECK( error == "batch failed" );
+   }
+}
+
+static void check_method_stats()
+{
+   std::cout << "method stats" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20612 );
+   rpc::server server( ep );
+   server.bind( "add", []( int a, int b ){ return a + b; } );
+   server.bind( "fail", []( int ) -> int { throw std::runtime_error( "failed" ); } );
+   server.async_run( 1 );
+
+   rpc::client client( ep );
+   for( int i = 0; i < 10; ++i )
+   {
+      client.call<int>( "add", i, 1 );
+   }
+   for( int i = 0; i < 3; ++i )
+   {
+      CHECK( throws( [&](){ client.call<int>( "fail", i ); } ) );
+   }
+   std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );   // Recorded after the response is posted
+
+   std::vector<rpc::method_stats> const local = server.methods_stats();
+   auto const fail = std::find_if( local.begin(), local.end(), []( rpc::method_stats const & m ){ return m.method == "fail"; } );
+   CHECK( (fail != local.end()) && (fail->calls == 3) && (fail->errors == 3) && (fail->latency.count() == 3) );
+
+   std::vector<rpc::method_summary> const remote = client.call<std::vector<rpc::method_summary>>( "__stats" );
+   auto const add = std::find_if( remote.begin(), remote.end(), []( rpc::method_summary const & m ){ return m.method == "add"; } );
+   CHECK( (add != remote.end()) && (add->calls == 10) && (add->errors == 0) && (add->bytes_in > 0) && (add->p50_ns > 0) );
+}
+
+static void check_lifecycle()
+{
+   std::cout << "request lifecycle" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20613 );
+   rpc::server server( ep );
+   server.bind( "add", []( int a, int b ){ return a + b; } );
+   server.set_lifecycle_sampling( 2 );
+   server.async_run( 1 );
+
+   rpc::client client( ep );
+   for( int i = 0; i < 10; ++i )
+   {
+      client.call<int>( "add", i, 1 );
+   }
+   std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );   // The send interval ends after the response is written
+
+   rpc::stage_stats const stages = server.stages_stats();
+   for( auto const & interval : stages.intervals )
+   {
+      CHECK( interval.count() == 10 );
+   }
+
+   std::vector<rpc::request_breakdown> const samples = server.sampled_requests();
+   CHECK( samples.size() == 5 );
+   for( auto const & sample : samples )
+   {
+      CHECK( (sample.method == "add") && (sample.ns[rpc::interval_count - 1] > 0) );
+   }
+}
+
+static void check_trace()
+{
+   std::cout << "trace rings" << std::endl;
+   std::string const path = socket_path( "trace" );
+   char const * const long_name = "a-thread-name-longer-than-a-ring-has-room-for";
+   rpc::tracer::set_dump_path( path.c_str() );
+   rpc::tracer::set_thread_name( long_name );
+   rpc::tracer::enable( true );
+   rpc::tracer::record( rpc::trace_event::send_timeout );   // Gives this thread its ring
+
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20614 );
+   rpc::server server( ep );
+   server.bind( "add", []( int a, int b ){ return a + b; } );
+   server.async_run( 1 );
+   rpc::client client( ep );
+   client.call<int>( "add", 2, 3 );
+   CHECK( client.call<std::string>( "__trace_dump" ) == path );
+   rpc::tracer::enable( false );
+
+   std::ifstream in( path, std::ios::binary );
+   std::vector<char> const dump( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+   unlink( path.c_str() );
+
+   rpc::trace_file_header file;
+   CHECK( dump.size() >= sizeof(file) );
+   if( dump.size() < sizeof(file) )
+   {
+      return;
+   }
+   memcpy( &file, dump.data(), sizeof(file) );
+   CHECK( memcmp( file.magic, "RPCTRACE", sizeof(file.magic) ) == 0 );
+
+   std::set<std::string> names;
+   std::set<uint16_t> events;
+   size_t offset = sizeof(file);
+   for( uint32_t i = 0; (i < file.ring_count) && (offset + sizeof(rpc::trace_ring_header) <= dump.size()); ++i )
+   {
+      rpc::trace_ring_header ring;
+      memcpy( &ring, &dump[offset], sizeof(ring) );
+      offset += sizeof(ring);
+      names.insert( std::string( ring.name, strnlen( ring.name, sizeof(ring.name) ) ) );
+      for( uint64_t r = 0; (r < std::min<uint64_t>( ring.head, ring.capacity )) && (offset + (r + 1) * sizeof(rpc::trace_record) <= dump.size()); ++r )
+      {
+         rpc::trace_record record;
+         memcpy( &record, &dump[offset + r * sizeof(record)], sizeof(record) );
+         events.insert( record.event );
+      }
+      offset += ring.capacity * sizeof(rpc::trace_record);
+   }
+   CHECK( names.count( "rpc-io" ) == 1 );
+   CHECK( names.count( std::string( long_name, 15 ) ) == 1 );
+   CHECK( events.count( static_cast<uint16_t>( rpc::trace_event::handler_begin ) ) == 1 );
+   CHECK( events.count( static_cast<uint16_t>( rpc::trace_event::frame_written ) ) == 1 );
+}
+
+static void check_logging()
+{
+   std::cout << "logging" << std::endl;
+   std::mutex mutex;
+   std::vector<std::string> lines;
+   rpc::logger::flush();
+   rpc::logger::set_sink( [&]( rpc::log_level, char const * text )
+   {
+      std::unique_lock<std::mutex> lck(mutex);
+      if( strncmp( text, "storm", 5 ) == 0 )
+      {
+         lines.emplace_back( text );
+      }
+   } );
+   rpc::logger::set_max_per_second( 5 );
+
+   // One logging statement, hit 100 times within a second, then once in the next one
+   auto const storm = []( int const i ){ RPC_LOG( warning, "storm %d", i ); };
+   auto const next_second = []()
+   {
+      uint64_t const ns = rpc::tsc_clock::monotonic_ns();
+      std::this_thread::sleep_for( std::chrono::nanoseconds( 1000000000u - (ns % 1000000000u) + 1000000u ) );
+   };
+   next_second();
+   for( int i = 0; i < 100; ++i )
+   {
+      storm( i );
+   }
+   next_second();
+   storm( 100 );
+   rpc::logger::flush();
+
+   rpc::logger::set_max_per_second( 10 );
+   rpc::logger::set_sink( []( rpc::log_level level, char const * text )
+   {
+      fprintf( stderr, "[rpc %s] %s\n", rpc::log_level_name( level ), text );
+   } );
+   CHECK( lines.size() == 6 );
+   CHECK( !lines.empty() && (lines.back() == "storm 100 (95 similar messages suppressed)") );
+}
+
+static void check_capture_replay()
+{
+   std::cout << "capture and replay" << std::endl;
+   std::string const path = socket_path( "capture" );
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20603 );
+   rpc::server server( ep );
+   server.bind( "add", []( int a, int b ){ return a + b; } );
+   server.async_run( 1 );
+
+   // Requests for add( 1, 2 ) and add( 3, 4 ), with encodings msgpack would not pick itself, so that
+   // packing them again would show
+   std::vector<unsigned char> const wide = { 0x94, 0x00, 0xce, 0, 0, 0, 7, 0xd9, 3, 'a', 'd', 'd', 0xc4, 8, 0xdc, 0, 2, 0xd0, 1, 0xcd, 0, 2 };
+   std::vector<unsigned char> const narrow = { 0x94, 0x00, 0x08, 0xa3, 'a', 'd', 'd', 0xc4, 3, 0x92, 3, 4 };
+
+   server.start_capture( path.c_str() );
+   int const fd = connect_raw( ep );
+   int const nodelay = 1;
+   setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay) );
+   for( unsigned char const c : wide )
+   {  // Split across as many reads as possible
+      send( fd, &c, 1, 0 );
+      std::this_thread::sleep_for( std::chrono::milliseconds( 2 ) );
+   }
+   send( fd, narrow.data(), narrow.size(), 0 );
+   std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+   CHECK( server.stop_capture() == 2 );
+   close( fd );
+
+   rpc::capture_reader reader( path.c_str() );
+   rpc::capture_record rec;
+   std::vector<std::vector<unsigned char>> const sent = { wide, narrow };
+   std::vector<unsigned char> frames;
+   for( auto const & it : sent )
+   {
+      CHECK( reader.next( rec ) && (rec.size == it.size()) && (memcmp( rec.data, it.data(), it.size() ) == 0) );
+      frames.insert( frames.end(), it.begin(), it.end() );
+   }
+   CHECK( !reader.next( rec ) );
+   unlink( path.c_str() );
+
+   // Played back as rpc_replay does, the server answers the same
+   int const replay = connect_raw( ep );
+   send( replay, frames.data(), frames.size(), 0 );
+   msgpack::unpacker unpacker;
+   std::vector<int> results;
+   while( results.size() < 2 )
+   {
+      unpacker.reserve_buffer( 4096 );
+      ssize_t const ret = recv( replay, unpacker.buffer(), unpacker.buffer_capacity(), 0 );
+      if( ret <= 0 )
+      {
+         break;
+      }
+      unpacker.buffer_consumed( ret );
+      msgpack::object_handle obj;
+      while( unpacker.next( obj ) )
+      {
+         std::tuple< rpc_message, uint32_t, std::vector<char>, std::vector<char> > fields;
+         obj.get().convert( fields );
+         results.push_back( msgpack::unpack( std::get<3>(fields).data(), std::get<3>(fields).size() ).get().as<int>() );
+      }
+   }
+   close( replay );
+   CHECK( (results.size() == 2) && (results[0] == 3) && (results[1] == 7) );
+}
+
+static void check_profiling()
+{
+   std::cout << "profiling" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20611 );
+   {
+      rpc::server server( ep );
+      server.async_run( 1 );
+      rpc::client client( ep );
+      CHECK( throws( [&](){ client.call<bool>( "__profile_start", 99u ); } ) );
+   }
+
+   rpc::server server( ep );
+   server.enable_profiling();
+   server.async_run( 1 );
+   rpc::client client( ep );
+   CHECK( client.call<bool>( "__profile_start", 99u ) );
+   client.call<std::string>( "__profile_stop" );
+}
+
+static void check_resource_accounting()
+{
+   std::cout << "resource accounting" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20615 );
+   rpc::server server( ep );
+   server.bind( "burn", []()
+   {
+      std::vector<char> const buffer( 1024 * 1024, 'x' );
+      auto const until = std::chrono::steady_clock::now() + std::chrono::milliseconds( 20 );
+      size_t sum = 0;
+      while( std::chrono::steady_clock::now() < until )
+      {
+         sum += static_cast<size_t>( std::count( buffer.begin(), buffer.begin() + 4096, 'x' ) );
+      }
+      return sum;
+   } );
+   server.bind( "nap", [](){ std::this_thread::sleep_for( std::chrono::milliseconds( 20 ) ); return true; } );
+   server.set_resource_accounting( true );
+   server.async_run( 1 );
+
+   rpc::client client( ep );
+   for( int i = 0; i < 3; ++i )
+   {
+      client.call<size_t>( "burn" );
+      client.call<bool>( "nap" );
+   }
+   std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+
+   std::vector<rpc::method_stats> const stats = server.methods_stats();
+   auto const find = [&]( char const * name ){ return std::find_if( stats.begin(), stats.end(), [&]( rpc::method_stats const & m ){ return m.method == name; } ); };
+   auto const burn = find( "burn" );
+   auto const nap = find( "nap" );
+   CHECK( (burn != stats.end()) && (nap != stats.end()) );
+   if( (burn != stats.end()) && (nap != stats.end()) )
+   {
+      CHECK( (burn->accounted_calls == 3) && (nap->accounted_calls == 3) );
+      CHECK( burn->cpu_ns > 45000000u );
+      CHECK( nap->cpu_ns < 15000000u );
+      CHECK( (burn->alloc_bytes >= 3u * 1024 * 1024) && (burn->allocs >= 3) );
+   }
+}
+
+static void check_connection_stats()
+{
+   std::cout << "connection stats" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20616 );
+   rpc::server server( ep );
+   server.bind( "add", []( int a, int b ){ return a + b; } );
+   server.set_tcp_sampling_interval( std::chrono::milliseconds( 10 ) );
+   server.async_run( 1 );
+
+   rpc::client client( ep );
+   for( int i = 0; i < 5; ++i )
+   {
+      client.call<int>( "add", i, 1 );
+   }
+   std::this_thread::sleep_for( std::chrono::milliseconds( 20 ) );   // Sampled on the next frame after the interval
+
+   rpc::transport_stats const stats = client.call<rpc::transport_stats>( "__connections" );
+   CHECK( (stats.connections == 1) && (stats.per_connection.size() == 1) );
+   if( stats.per_connection.size() == 1 )
+   {
+      rpc::connection_stats const & conn = stats.per_connection[0];
+      CHECK( conn.peer.compare( 0, 10, "127.0.0.1:" ) == 0 );
+      CHECK( (conn.frames_in == 6) && (conn.frames_out >= 5) );
+      CHECK( (conn.bytes_in > 0) && (conn.bytes_out > 0) );
+      CHECK( conn.tcp.snd_cwnd > 0 );
+   }
+}
+
+static void check_io_uring()
+{
+   std::cout << "io_uring backend" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20617 );
+   rpc::server server( ep, rpc::io_backend::io_uring );
+   server.bind( "add", []( int a, int b ){ return a + b; } );
+   server.bind( "repeat", []( unsigned n ){ return std::string( n, 'x' ); } );
+   server.async_run( 1 );
+   std::cout << "  serving with " << ((server.backend() == rpc::io_backend::io_uring) ? "io_uring" : "poll") << std::endl;
+
+   for( int round = 0; round < 2; ++round )
+   {  // The second time on a new connection
+      rpc::client client( ep );
+      std::vector<std::future<int>> sums;
+      for( int i = 0; i < 200; ++i )
+      {
+         sums.push_back( client.async_call<int>( "add", i, round ) );
+      }
+      std::future<std::string> large = client.async_call<std::string>( "repeat", 4u * 1024 * 1024 );
+
+      bool all = true;
+      for( int i = 0; i < 200; ++i )
+      {
+         all = all && (sums[i].get() == i + round);
+      }
+      CHECK( all );
+      CHECK( large.get() == std::string( 4u * 1024 * 1024, 'x' ) );
+   }
+}
+
+static void check_transport( char const * name, rpc::endpoint const & ep )
+{
+   std::cout << name << " transport" << std::endl;
+   std::unique_ptr<rpc::server> server( new rpc::server( ep ) );
+   server->bind( "add", []( int a, int b ){ return a + b; } );
+   server->async_run( 1 );
+
+   rpc::client client( ep );
+   CHECK( client.call<int>( "add", 2, 3 ) == 5 );
+
+   server.reset();
+   std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+   CHECK( throws( [&](){ client.call<int>( "add", 2, 3 ); } ) );
+}
+
+static void check_local_client()
+{
+   std::cout << "local client" << std::endl;
+   rpc::server server( rpc::endpoint::tcp( "127.0.0.1", 20605 ) );
+   server.bind( "add", []( int a, int b ){ return a + b; } );
+   server.bind( "echo", []( std::vector<std::string> const & v ){ return v; } );
+   server.bind( "fail", []() -> int { throw std::runtime_error( "local failure" ); } );
+
+   rpc::local_client direct( server, rpc::local_client::mode::direct );
+   rpc::local_client serialized( server, rpc::local_client::mode::serialized );
+   std::vector<std::string> const words = { "one", "", "three" };
+   CHECK( direct.call<int>( "add", 2, 3 ) == serialized.call<int>( "add", 2, 3 ) );
+   CHECK( direct.call<std::vector<std::string>>( "echo", words ) == serialized.call<std::vector<std::string>>( "echo", words ) );
+
+   std::string direct_error;
+   std::string serialized_error;
+   try { direct.call<int>( "fail" ); } catch( std::runtime_error const & e ) { direct_error = e.what(); }
+   try { serialized.call<int>( "fail" ); } catch( std::runtime_error const & e ) { serialized_error = e.what(); }
+   CHECK( (direct_error == "local failure") && (direct_error == serialized_error) );
+   CHECK( throws( [&](){ direct.call<int>( "missing" ); } ) && throws( [&](){ serialized.call<int>( "missing" ); } ) );
+}
+
+static void check_zerocopy()
+{
+   std::cout << "zerocopy sends" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20618 );
+   rpc::server server( ep );
+   server.bind( "shift", []( std::string s ){ for( auto & c : s ){ ++c; } return s; } );
+   server.set_zerocopy_threshold( 64 * 1024 );
+   server.async_run( 2 );
+
+   rpc::client client( ep );
+   client.set_zerocopy_threshold( 64 * 1024 );
+   for( int round = 0; round < 2; ++round )
+   {  // Frames must not change before the kernel is done with them, however many are in flight
+      std::vector<std::future<std::string>> shifted;
+      for( char c = 'a'; c < 'a' + 8; ++c )
+      {
+         shifted.push_back( client.async_call<std::string>( "shift", std::string( 1024 * 1024, c ) ) );
+      }
+      bool all = true;
+      for( char c = 'a'; c < 'a' + 8; ++c )
+      {
+         all = all && (shifted[c - 'a'].get() == std::string( 1024 * 1024, static_cast<char>( c + 1 ) ));
+      }
+      CHECK( all );
+   }
+}
+
+static void check_blobs()
+{
+   std::cout << "blobs over descriptors" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::unix_domain( socket_path( "blob" ) );
+   int const fds_before = open_fds();
+   {
+      rpc::server server( ep );
+      server.set_blob_fd_threshold( 4096 );
+      server.bind( "make", []( size_t n, char c ){ rpc::blob b = rpc::blob::allocate( n ); memset( b.writable_data(), c, n ); return b; } );
+      server.bind( "echo", []( rpc::blob const & b ){ return b; } );
+      server.async_run( 1 );
+
+      rpc::client client( ep );
+      client.set_blob_fd_threshold( 4096 );
+      rpc::blob const made = client.call<rpc::blob>( "make", size_t( 1 << 20 ), 'q' );
+      CHECK( (made.size() == (1 << 20)) && (made.data()[0] == 'q') && (made.data()[made.size() - 1] == 'q') );
+      std::vector<char> const data( 100000, 'z' );
+      rpc::blob const echoed = client.call<rpc::blob>( "echo", rpc::blob( data ) );
+      CHECK( (echoed.size() == data.size()) && (memcmp( echoed.data(), data.data(), data.size() ) == 0) );
+      CHECK( client.call<rpc::blob>( "echo", rpc::blob( "ab", 2 ) ).size() == 2 );
+
+      // Descriptors no frame claims are closed, not kept until the connection ends
+      int const fds_connected = open_fds();
+      int const raw = connect_raw( ep );
+      for( int i = 0; i < 20; ++i )
+      {
+         rpc::fd_list spam;
+         for( int j = 0; j < 100; ++j )
+         {
+            spam.push_back( dup( 0 ) );
+         }
+         char const nil = static_cast<char>( 0xc0 );
+         rpc::send_with_fds( raw, &nil, 1, spam, 0 );
+      }
+      std::this_thread::sleep_for( std::chrono::milliseconds( 200 ) );
+      CHECK( open_fds() - fds_connected < 10 );
+      close( raw );
+   }
+   CHECK( open_fds() == fds_before );
+}
+
+static void check_udp()
+{
+   std::cout << "udp transport" << std::endl;
+   std::unique_ptr<rpc::server> server( new rpc::server( rpc::endpoint::tcp( "127.0.0.1", 20604 ) ) );
+   server->bind( "add", []( int a, int b ){ return a + b; } );
+   server->bind( "echo", []( std::string const & s ){ return s; } );
+   server->bind( "repeat", []( unsigned n ){ return std::string( n, 'x' ); } );
+   uint16_t const port = server->listen_udp( rpc::endpoint::udp( "127.0.0.1", 0 ), 1 );
+   server->async_run( 1 );
+
+   rpc::udp_client client( rpc::endpoint::udp( "127.0.0.1", port ) );
+   client.set_timeout( std::chrono::milliseconds( 50 ), 2 );
+   CHECK( client.call<int>( "add", 2, 3 ) == 5 );
+   CHECK( client.call<std::string>( "echo", std::string( 10, 'x' ) ) == std::string( 10, 'x' ) );
+
+   // Neither reserved methods, nor a large reply to a small request, for any forged source address
+   CHECK( throws( [&](){ client.call<bool>( "__ping" ); } ) );
+   CHECK( throws( [&](){ client.call<std::string>( "repeat", 1000u ); } ) );
+
+   server.reset();
+   CHECK( throws( [&](){ client.call<int>( "add", 2, 3 ); } ) );
+}
+
+static void check_busy_poll()
+{
+   std::cout << "busy poll" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20619 );
+   rpc::server server( ep );
+   server.bind( "add", []( int a, int b ){ return a + b; } );
+   server.set_busy_poll( std::chrono::microseconds( 200 ) );
+   server.async_run( 2 );
+
+   // Requests that come while a worker spins, and after every thread went back to sleep, are both
+   // served: a producer that skipped the wakeup must not leave a request behind
+   rpc::client client( ep );
+   bool all = true;
+   for( int i = 0; (i < 300) && all; ++i )
+   {
+      std::future<int> sum = client.async_call<int>( "add", i, 1 );
+      all = (sum.wait_for( std::chrono::seconds( 5 ) ) == std::future_status::ready) && (sum.get() == i + 1);
+      if( i % 100 == 99 )
+      {
+         std::this_thread::sleep_for( std::chrono::milliseconds( 20 ) );
+      }
+   }
+   CHECK( all );
+}
+
+static void check_placement()
+{
+   std::cout << "thread placement" << std::endl;
+   rpc::endpoint const ep = rpc::endpoint::tcp( "127.0.0.1", 20620 );
+   rpc::server server( ep );
+   CHECK( throws( [&](){ rpc::thread_placement where; where.numa_node = 4096; server.set_placement( where ); } ) );
+
+   rpc::thread_placement where;
+   where.transport = { 0 };
+   where.workers = { 0 };
+   where.executors["isolated"] = { 0 };
+   server.set_placement( where );
+   server.bind( "add", []( int a, int b ){ return a + b; }, rpc::executor( "isolated", 1 ) );
+   server.async_run( 1 );
+
+   rpc::client client( ep );
+   CHECK( client.call<int>( "add", 2, 3 ) == 5 );
+   rpc::placement_report const report = client.call<rpc::placement_report>( "__placement" );
+   CHECK( !report.topology.nodes.empty() );
+   std::set<std::string> placed;
+   for( auto const & thread : report.threads )
+   {
+      CHECK( (thread.tid != 0) && (thread.cpus == std::vector<int>{ 0 }) );
+      placed.insert( thread.name );
+   }
+   CHECK( (placed.count( "transport" ) == 1) && (placed.count( "default" ) == 1) && (placed.count( "isolated" ) == 1) );
+}
+
+static void check_pooled_client()
+{
+   std::cout << "pooled client failover" << std::endl;
+   std::unique_ptr<rpc::server> first( new rpc::server( rpc::endpoint::tcp( "127.0.0.1", 20606 ) ) );
+   first->bind( "who", [](){ return 1; } );
+   first->async_run( 1 );
+   rpc::server second( rpc::endpoint::tcp( "127.0.0.1", 20607 ) );
+   second.bind( "who", [](){ return 2; } );
+   second.async_run( 1 );
+
+   rpc::pool_options opts;
+   opts.health_interval = std::chrono::milliseconds( 50 );
+   opts.retry_after = std::chrono::milliseconds( 10000 );
+   rpc::pooled_client pool( { rpc::endpoint::tcp( "127.0.0.1", 20606 ), rpc::endpoint::tcp( "127.0.0.1", 20607 ) }, opts );
+   int seen[3] = { 0, 0, 0 };
+   for( int i = 0; i < 100; ++i )
+   {
+      ++seen[pool.call<int>( "who" )];
+   }
+   CHECK( (seen[1] > 0) && (seen[2] > 0) );
+
+   first.reset();
+   std::this_thread::sleep_for( std::chrono::milliseconds( 200 ) );
+   int from_second = 0;
+   for( int i = 0; i < 100; ++i )
+   {
+      try
+      {
+         from_second += (pool.call<int>( "who" ) == 2) ? 1 : 0;
+      }
+      catch( std::exception const & )
+      {
+      }
+   }
+   CHECK( from_second == 100 );
+   for( auto const & it : pool.stats() )
+   {
+      CHECK( !it.connected || (it.endpoint == "127.0.0.1:20607") );
+   }
+}
+
+int main()
+{
+   check_load_shedding();
+   check_no_stray_responses();
+   check_malformed_requests();
+   check_unread_rejections();
+   check_elastic_pool();
+   check_batch();
+   check_method_stats();
+   check_lifecycle();
+   check_trace();
+   check_logging();
+   check_capture_replay();
+   check_profiling();
+   check_resource_accounting();
+   check_connection_stats();
+   check_io_uring();
+   check_transport( "unix", rpc::endpoint::unix_domain( socket_path( "unix" ) ) );
+   check_transport( "shm", rpc::endpoint::shared_memory( socket_path( "shm" ) ) );
+   check_local_client();
+   check_zerocopy();
+   check_blobs();
+   check_udp();
+   check_busy_poll();
+   check_placement();
+   check_pooled_client();
+
+   std::cout << (failures == 0 ? "All checks passed" : std::to_string( failures ) + " checks failed") << std::endl;
+   return (failures == 0) ? 0 : 1;
+}
@@ -2,6 +2,7 @@
 #include <vector>
 #include <tuple>
 #include "rpc/client.hpp"
+#include "rpc/metrics.hpp"
 
 
 int main()
@@ -33,5 +34,10 @@ int main()
       }
    }
 
+   for( auto const & it : client.call<std::vector<rpc::method_summary>>( "__stats" ) )
+   {
+      std::cout << it.method << ": calls=" << it.calls << " errors=" << it.errors << " p99=" << it.p99_ns << " ns" << std::endl;
+   }
+
    return 0;
 }
@@ -43,9 +43,9 @@ int main()
 {
    rpc::server server;
    server.bind( "foo", &foo );
-   server.bind( "funcA", &funcA );
+   server.bind( "funcA", &funcA, rpc::priority::high );
    server.bind( "funcB", &funcB );
-   server.bind( "funcC", &funcC );
+   server.bind( "funcC", &funcC, rpc::executor( "slow", 2 ) );
 
    int b;
    server.bind( "funcD", [&]( int a){ b = a+1;} );
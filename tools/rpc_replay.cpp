@@ -0,0 +1,320 @@
+/**
+ * Plays a capture taken with rpc::server::start_capture() back against a
+ * running server, over as many connections as the capture saw, sending every
+ * frame byte for byte as it was received.
+ *
+ * Usage: rpc_replay <capture file> [--host=ADDR] [--port=PORT] [--unix=PATH] [--speed=X] [--loops=N]
+ *
+ * --unix connects to a server listening on a Unix domain socket instead, a
+ * path starting with '@' being in the abstract namespace.
+ *
+ * --speed=1 (the default) keeps the recorded pacing, 2 plays twice as fast and
+ * 0 sends as fast as the connections accept. The capture is memory-mapped and
+ * frames are sent straight from the mapping. Reports throughput and the
+ * latency of the responses, measured from the intended send time.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "rpc/capture.hpp"
+#include "rpc/endpoint.hpp"
+#include "rpc/histogram.hpp"
+
+namespace
+{
+
+using replay_clock = std::chrono::steady_clock;
+
+struct replay_config
+{
+   std::string path;
+   std::string host = "127.0.0.1";
+   uint16_t port = 20000;
+   std::string unix_path;   // Connect to this Unix socket rather than host:port
+   double speed = 1.0;
+   unsigned loops = 1;
+};
+
+struct connection
+{
+   int fd = -1;
+   std::thread reader;
+
+   std::mutex mutex;
+   std::unordered_map<uint32_t, std::deque<replay_clock::time_point>> pending;   // By msgid, which a capture may reuse
+   uint64_t responses = 0;
+   uint64_t errors = 0;
+   uint64_t unmatched = 0;
+   rpc::latency_histogram latency;
+};
+
+// Reads the msgid of a request frame ([type, msgid, method, params...]) without unpacking it
+bool peek_msgid( char const * data, size_t const size, uint32_t & msgid )
+{
+   auto const * p = reinterpret_cast<uint8_t const *>( data );
+   if( (size < 3) || ((p[0] & 0xf0) != 0x90) || (p[1] > 0x7f) )
+   {  // Not a fixarray starting with a positive fixint type
+      return false;
+   }
+
+   uint8_t const tag = p[2];
+   if( tag <= 0x7f )
+   {
+      msgid = tag;
+      return true;
+   }
+
+   size_t const len = (tag == 0xcc) ? 1 : (tag == 0xcd) ? 2 : (tag == 0xce) ? 4 : 0;
+   if( (len == 0) || (size < 3 + len) )
+   {
+      return false;
+   }
+
+   msgid = 0;
+   for( size_t i = 0; i < len; ++i )
+   {
+      msgid = (msgid << 8) | p[3 + i];
+   }
+   return true;
+}
+
+int connect_to( replay_config const & cfg )
+{
+   rpc::endpoint const server = cfg.unix_path.empty() ? rpc::endpoint::tcp( cfg.host.c_str(), cfg.port )
+                                                      : rpc::endpoint::unix_domain( cfg.unix_path );
+   struct sockaddr_storage addr;
+   socklen_t const addr_len = server.to_sockaddr( addr );
+
+   int const fd = socket( server.socket_family(), SOCK_STREAM, 0 );
+   if( (fd == -1) || (connect( fd, reinterpret_cast<struct sockaddr*>(&addr), addr_len ) == -1) )
+   {
+      throw std::system_error( errno, std::generic_category(), "connect" );
+   }
+
+   if( server.is_tcp() )
+   {
+      int const nodelay = 1;
+      setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay) );
+   }
+   return fd;
+}
+
+void read_responses( connection & conn )
+{
+   msgpack::unpacker unpacker;
+   for( ;; )
+   {
+      unpacker.reserve_buffer( 64 * 1024 );
+      ssize_t const ret = recv( conn.fd, unpacker.buffer(), unpacker.buffer_capacity(), 0 );
+      if( ret <= 0 )
+      {
+         if( (ret < 0) && (errno == EINTR) )
+         {
+            continue;
+         }
+         return;
+      }
+      unpacker.buffer_consumed( static_cast<size_t>(ret) );
+
+      msgpack::object_handle obj;
+      while( unpacker.next( obj ) )
+      {
+         replay_clock::time_point const now = replay_clock::now();
+         msgpack::object const & msg = obj.get();
+         if( (msg.type != msgpack::type::ARRAY) || (msg.via.array.size != 4) )
+         {
+            continue;
+         }
+
+         uint32_t const msgid = msg.via.array.ptr[1].as<uint32_t>();
+         bool const error = (msg.via.array.ptr[2].type == msgpack::type::BIN) && (msg.via.array.ptr[2].via.bin.size != 0);
+
+         std::unique_lock<std::mutex> lck(conn.mutex);
+         ++conn.responses;
+         conn.errors += error ? 1 : 0;
+         auto it = conn.pending.find( msgid );
+         if( (it == conn.pending.end()) || it->second.empty() )
+         {
+            ++conn.unmatched;
+            continue;
+         }
+         conn.latency.record( now - it->second.front() );
+         it->second.pop_front();
+      }
+   }
+}
+
+bool send_all( int const fd, char const * data, size_t size )
+{
+   while( size > 0 )
+   {
+      ssize_t const ret = send( fd, data, size, MSG_NOSIGNAL );
+      if( ret < 0 )
+      {
+         if( errno == EINTR )
+         {
+            continue;
+         }
+         return false;
+      }
+      data += ret;
+      size -= static_cast<size_t>( ret );
+   }
+   return true;
+}
+
+int replay( replay_config const & cfg )
+{
+   rpc::capture_reader capture( cfg.path.c_str() );
+
+   // First pass: how many connections and requests there are
+   uint32_t connection_count = 0;
+   uint64_t frames = 0;
+   rpc::capture_record rec;
+   while( capture.next( rec ) )
+   {
+      connection_count = std::max( connection_count, rec.connection + 1 );
+      ++frames;
+   }
+   std::printf( "%s: %llu requests over %u connections\n", cfg.path.c_str(), static_cast<unsigned long long>( frames ), connection_count );
+
+   std::vector<std::unique_ptr<connection>> conns;
+   for( uint32_t i = 0; i < connection_count; ++i )
+   {
+      conns.emplace_back( new connection() );
+      conns.back()->fd = connect_to( cfg );
+      connection * c = conns.back().get();
+      c->reader = std::thread( [c](){ read_responses( *c ); } );
+   }
+
+   uint64_t sent = 0;
+   replay_clock::time_point const begin = replay_clock::now();
+   for( unsigned loop = 0; loop < cfg.loops; ++loop )
+   {
+      capture.rewind();
+      replay_clock::duration const loop_offset = replay_clock::now() - begin;
+
+      while( capture.next( rec ) )
+      {
+         replay_clock::time_point intended = replay_clock::now();
+         if( cfg.speed > 0 )
+         {
+            intended = begin + loop_offset + std::chrono::duration_cast<replay_clock::duration>( std::chrono::nanoseconds( rec.ns ) / cfg.speed );
+            std::this_thread::sleep_until( intended );
+         }
+
+         connection & conn = *conns[rec.connection];
+         uint32_t msgid = 0;
+         if( peek_msgid( rec.data, rec.size, msgid ) )
+         {
+            std::unique_lock<std::mutex> lck(conn.mutex);
+            conn.pending[msgid].push_back( intended );
+         }
+
+         if( !send_all( conn.fd, rec.data, rec.size ) )
+         {
+            std::fprintf( stderr, "send: %s\n", strerror( errno ) );
+            break;
+         }
+         ++sent;
+      }
+   }
+   replay_clock::time_point const sent_all = replay_clock::now();
+
+   // Give the server a moment to answer what is still in flight
+   replay_clock::time_point const deadline = replay_clock::now() + std::chrono::seconds( 5 );
+   for( ;; )
+   {
+      uint64_t responses = 0;
+      for( auto const & c : conns )
+      {
+         std::unique_lock<std::mutex> lck(c->mutex);
+         responses += c->responses;
+      }
+      if( (responses >= sent) || (replay_clock::now() >= deadline) )
+      {
+         break;
+      }
+      std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+   }
+   double const seconds = std::chrono::duration<double>( replay_clock::now() - begin ).count();
+
+   uint64_t responses = 0, errors = 0, unmatched = 0;
+   rpc::latency_histogram latency;
+   for( auto& c : conns )
+   {
+      shutdown( c->fd, SHUT_RDWR );
+      c->reader.join();
+      close( c->fd );
+      responses += c->responses;
+      errors += c->errors;
+      unmatched += c->unmatched;
+      latency.merge( c->latency );
+   }
+
+   std::printf( "sent %llu in %.3f s (%.0f/s), %llu responses (%llu errors, %llu unmatched) in %.3f s\n",
+                static_cast<unsigned long long>( sent ), std::chrono::duration<double>( sent_all - begin ).count(),
+                sent / std::chrono::duration<double>( sent_all - begin ).count(),
+                static_cast<unsigned long long>( responses ), static_cast<unsigned long long>( errors ),
+                static_cast<unsigned long long>( unmatched ), seconds );
+   std::printf( "latency us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", latency.percentile( 50 ) / 1000.0,
+                latency.percentile( 99 ) / 1000.0, latency.percentile( 99.9 ) / 1000.0, latency.max() / 1000.0 );
+
+   return (responses >= sent) ? 0 : 1;
+}
+
+}
+
+int main( int argc, char * argv[] )
+{
+   replay_config cfg;
+   for( int i = 1; i < argc; ++i )
+   {
+      std::string const arg = argv[i];
+      size_t const eq = arg.find( '=' );
+      std::string const key = arg.substr( 0, eq );
+      std::string const value = (eq == std::string::npos) ? std::string() : arg.substr( eq + 1 );
+
+      if( key == "--host" )               cfg.host = value;
+      else if( key == "--port" )          cfg.port = static_cast<uint16_t>( std::strtoul( value.c_str(), nullptr, 10 ) );
+      else if( key == "--unix" )          cfg.unix_path = value;
+      else if( key == "--speed" )         cfg.speed = std::strtod( value.c_str(), nullptr );
+      else if( key == "--loops" )         cfg.loops = static_cast<unsigned>( std::strtoul( value.c_str(), nullptr, 10 ) );
+      else if( (key.compare( 0, 2, "--" ) != 0) && cfg.path.empty() )   cfg.path = arg;
+      else
+      {
+         cfg.path.clear();
+         break;
+      }
+   }
+
+   if( cfg.path.empty() || (cfg.speed < 0) )
+   {
+      std::fprintf( stderr, "Usage: %s <capture file> [--host=ADDR] [--port=PORT] [--unix=PATH] [--speed=X] [--loops=N]\n", argv[0] );
+      return 1;
+   }
+
+   try
+   {
+      return replay( cfg );
+   }
+   catch( std::exception const & e )
+   {
+      std::fprintf( stderr, "%s\n", e.what() );
+      return 1;
+   }
+}
@@ -0,0 +1,212 @@
+/**
+ * Converts a binary dump of rpc::tracer rings into Chrome trace event JSON,
+ * which chrome://tracing and ui.perfetto.dev open directly.
+ *
+ * Usage: trace_dump <dump file> [output.json]
+ *
+ * Every traced thread becomes a track named after it. Handler runs show up as
+ * slices, everything else as instant events carrying fd, msgid and arg.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "rpc/trace.hpp"
+
+namespace
+{
+
+struct thread_trace
+{
+   rpc::trace_ring_header header;
+   std::vector<rpc::trace_record> records;   // Oldest first
+};
+
+char const * event_name( uint16_t const event )
+{
+   switch( static_cast<rpc::trace_event>( event ) )
+   {
+      case rpc::trace_event::connection_accepted: return "connection_accepted";
+      case rpc::trace_event::connection_closed:   return "connection_closed";
+      case rpc::trace_event::data_received:       return "data_received";
+      case rpc::trace_event::frame_received:      return "frame_received";
+      case rpc::trace_event::request_queued:      return "request_queued";
+      case rpc::trace_event::queue_full:          return "queue_full";
+      case rpc::trace_event::request_shed:        return "request_shed";
+      case rpc::trace_event::handler_begin:       return "handler";
+      case rpc::trace_event::handler_end:         return "handler";
+      case rpc::trace_event::response_queued:     return "response_queued";
+      case rpc::trace_event::frame_written:       return "frame_written";
+      case rpc::trace_event::send_timeout:        return "send_timeout";
+   }
+   return "unknown";
+}
+
+std::string json_escape( char const * s, size_t const max_len )
+{
+   std::string ret;
+   for( size_t i = 0; (i < max_len) && (s[i] != '\0'); ++i )
+   {
+      if( (s[i] == '"') || (s[i] == '\\') )
+      {
+         ret += '\\';
+      }
+      ret += (static_cast<unsigned char>(s[i]) < 0x20) ? '?' : s[i];
+   }
+   return ret;
+}
+
+bool read_dump( char const * path, rpc::trace_file_header & file, std::vector<thread_trace> & threads )
+{
+   std::ifstream in( path, std::ios::binary );
+   if( !in.read( reinterpret_cast<char*>(&file), sizeof(file) ) )
+   {
+      std::cerr << path << ": too short" << std::endl;
+      return false;
+   }
+
+   if( (memcmp( file.magic, "RPCTRACE", sizeof(file.magic) ) != 0) || (file.version != 1) )
+   {
+      std::cerr << path << ": not an rpc trace dump" << std::endl;
+      return false;
+   }
+
+   for( uint32_t i = 0; i < file.ring_count; ++i )
+   {
+      thread_trace t;
+      std::vector<rpc::trace_record> ring;
+      if( !in.read( reinterpret_cast<char*>(&t.header), sizeof(t.header) ) )
+      {
+         std::cerr << path << ": truncated" << std::endl;
+         return false;
+      }
+
+      ring.resize( t.header.capacity );
+      if( !in.read( reinterpret_cast<char*>(ring.data()), ring.size() * sizeof(rpc::trace_record) ) )
+      {
+         std::cerr << path << ": truncated" << std::endl;
+         return false;
+      }
+
+      uint64_t const count = std::min<uint64_t>( t.header.head, t.header.capacity );
+      uint64_t const first = t.header.head - count;
+      for( uint64_t n = first; n < t.header.head; ++n )
+      {
+         t.records.push_back( ring[n % t.header.capacity] );
+      }
+      threads.push_back( std::move(t) );
+   }
+
+   return true;
+}
+
+}
+
+int main( int argc, char * argv[] )
+{
+   if( (argc < 2) || (argc > 3) )
+   {
+      std::cerr << "Usage: " << argv[0] << " <dump file> [output.json]" << std::endl;
+      return 1;
+   }
+
+   rpc::trace_file_header file;
+   std::vector<thread_trace> threads;
+   if( !read_dump( argv[1], file, threads ) )
+   {
+      return 1;
+   }
+
+   std::ofstream out_file;
+   if( argc == 3 )
+   {
+      out_file.open( argv[2] );
+      if( !out_file )
+      {
+         std::cerr << argv[2] << ": cannot open for writing" << std::endl;
+         return 1;
+      }
+   }
+   std::ostream & out = (argc == 3) ? out_file : std::cout;
+
+   // Timestamps are relative to the oldest record
+   uint64_t base = UINT64_MAX;
+   for( auto const & t : threads )
+   {
+      if( !t.records.empty() )
+      {
+         base = std::min( base, t.records.front().tsc );
+      }
+   }
+
+   out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+   bool first = true;
+   auto separator = [&first, &out]()
+   {
+      if( !first )
+      {
+         out << ",\n";
+      }
+      first = false;
+   };
+
+   char ts[32];
+   for( auto const & t : threads )
+   {
+      std::string name = json_escape( t.header.name, sizeof(t.header.name) );
+      if( name.empty() )
+      {
+         name = "thread " + std::to_string( t.header.tid );
+      }
+      separator();
+      out << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << t.header.tid << ",\"name\":\"thread_name\",\"args\":{\"name\":\"" << name << "\"}}";
+
+      int depth = 0;   // A dump may start in the middle of a handler run
+      for( auto const & rec : t.records )
+      {
+         if( rec.tsc < base )
+         {  // Torn by a concurrent write
+            continue;
+         }
+
+         auto const event = static_cast<rpc::trace_event>( rec.event );
+         char const * ph = "i";
+         if( event == rpc::trace_event::handler_begin )
+         {
+            ph = "B";
+            ++depth;
+         }
+         else if( event == rpc::trace_event::handler_end )
+         {
+            if( depth == 0 )
+            {
+               continue;
+            }
+            ph = "E";
+            --depth;
+         }
+
+         snprintf( ts, sizeof(ts), "%.3f", (rec.tsc - base) * file.ns_per_tick / 1000.0 );
+         separator();
+         out << "{\"ph\":\"" << ph << "\",\"pid\":1,\"tid\":" << t.header.tid << ",\"ts\":" << ts
+             << ",\"name\":\"" << event_name( rec.event ) << "\"";
+         if( ph[0] == 'i' )
+         {
+            out << ",\"s\":\"t\"";
+         }
+         if( ph[0] != 'E' )
+         {
+            out << ",\"args\":{\"fd\":" << rec.fd << ",\"msgid\":" << rec.msgid << ",\"arg\":" << rec.arg << "}";
+         }
+         out << "}";
+      }
+   }
+
+   out << "\n]}\n";
+   return 0;
+}